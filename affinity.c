@@ -0,0 +1,164 @@
+/* affinity.c
+
+	CPU pinning and NUMA topology.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+#include "affinity.h"
+
+static unsigned char cpu_nodes[AFFINITY_MAX_CPUS];	// Node of every CPU.
+static int number_of_nodes = 1;
+
+/**
+ * @name affinity_read_cpulist - Assigns the CPUs of a sysfs cpulist, such
+ * as "0-3,8-11", to a node.
+ * @param path: The cpulist file.
+ * @param node: The node.
+ *
+ * @return
+ */
+static void affinity_read_cpulist(const char *path, int node) {
+	char list[4096], *range, *saveptr = NULL;
+	int first, last, cpu;
+	FILE *f;
+
+	if (!(f = fopen(path, "r")))
+		return;
+	if (!fgets(list, sizeof(list), f)) {
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	for (range = strtok_r(list, ",\n", &saveptr); range; range = strtok_r(NULL, ",\n", &saveptr)) {
+		switch (sscanf(range, "%d-%d", &first, &last)) {
+			case 1:
+				last = first;
+				break;
+			case 2:
+				break;
+			default:
+				continue;
+		}
+		for (cpu = first; cpu <= last && cpu < AFFINITY_MAX_CPUS; cpu++)
+			if (cpu >= 0)
+				cpu_nodes[cpu] = (unsigned char) node;
+	}
+}
+
+/**
+ * @name affinity_init - Reads the NUMA node of every CPU.
+ *
+ * @return The number of nodes, at least 1.
+ */
+int affinity_init(void) {
+	char path[300];
+	struct dirent *entry;
+	DIR *dir;
+	int node;
+
+	memset(cpu_nodes, 0, sizeof(cpu_nodes));
+	number_of_nodes = 1;
+	if (!(dir = opendir("/sys/devices/system/node")))
+		return number_of_nodes;
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "node", 4) || sscanf(entry->d_name + 4, "%d", &node) != 1)
+			continue;
+		if (node < 0 || node >= AFFINITY_MAX_NODES)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		affinity_read_cpulist(path, node);
+		if (node + 1 > number_of_nodes)
+			number_of_nodes = node + 1;
+	}
+	closedir(dir);
+	return number_of_nodes;
+}
+
+/**
+ * @name affinity_node - Returns the NUMA node of a CPU.
+ * @param cpu: The CPU.
+ *
+ * @return The node, 0 if unknown.
+ */
+int affinity_node(int cpu) {
+
+	if (cpu < 0 || cpu >= AFFINITY_MAX_CPUS)
+		return 0;
+	return cpu_nodes[cpu];
+}
+
+/**
+ * @name affinity_cpus - Lists the CPUs the process may run on, one from
+ * each NUMA node in turn, so that threads given consecutive entries are
+ * spread evenly over the nodes.
+ * @param cpus: Receives the CPUs.
+ * @param max: Size of cpus.
+ *
+ * @return The number of CPUs filled in.
+ */
+int affinity_cpus(int *cpus, int max) {
+	static int next[AFFINITY_MAX_NODES];
+	cpu_set_t allowed;
+	int count = 0, node, cpu, found;
+
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return 0;
+
+	memset(next, 0, sizeof(next));
+	do {
+		found = 0;
+		for (node = 0; node < number_of_nodes && count < max; node++) {
+			// The next allowed CPU of this node.
+			for (cpu = next[node]; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &allowed) && cpu_nodes[cpu] == node)
+					break;
+			if (cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE) {
+				cpus[count++] = cpu;
+				next[node] = cpu + 1;
+				found = 1;
+			}
+			else
+				next[node] = cpu;
+		}
+	} while (found && count < max);
+
+	return count;
+}
+
+/**
+ * @name affinity_attr - Sets the CPU of the threads created with an
+ * attribute object.
+ * @param attr: The attributes.
+ * @param cpu: The CPU.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+int affinity_attr(pthread_attr_t *attr, int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/**
+ * @name affinity_pin_self - Pins the calling thread to a CPU.
+ * @param cpu: The CPU.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+int affinity_pin_self(int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
@@ -0,0 +1,33 @@
+/* affinity.h
+
+	CPU pinning and NUMA topology.
+
+	The node of every CPU is read from /sys/devices/system/node, so no
+	libnuma is needed. Without that directory every CPU is on node 0.
+*/
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+#define AFFINITY_MAX_CPUS  1024
+#define AFFINITY_MAX_NODES 64
+
+// read the NUMA node of every CPU. Returns the number of nodes, at least 1.
+int affinity_init(void);
+
+// the NUMA node of 'cpu', 0 if unknown.
+int affinity_node(int cpu);
+
+// fill 'cpus' with up to 'max' CPUs the process may run on, taking one
+// from each NUMA node in turn. Returns the number filled in.
+int affinity_cpus(int *cpus, int max);
+
+// make threads created with 'attr' start on 'cpu'. 0 on success.
+int affinity_attr(pthread_attr_t *attr, int cpu);
+
+// pin the calling thread to 'cpu'. 0 on success.
+int affinity_pin_self(int cpu);
+
+#endif
@@ -0,0 +1,144 @@
+/* bulkload.c
+
+	Offline bulk loader for the key-value server's database.
+
+	Reads "key:value" lines and builds a KISSDB file in one sequential
+	pass with KISSDB_build(), instead of sending every pair through
+	KISSDB_put(). Keys and values are stored zero padded to the same
+	sizes the server uses, so the result can be served directly.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "kissdb.h"
+
+#define KEY_SIZE                 128
+#define VALUE_SIZE              1024
+#define LINE_SIZE               2048
+#define DEFAULT_DB_PATH    "mydb.db"
+
+// Definition of the input stream handed to KISSDB_build().
+typedef struct bulk_input {
+	FILE *in;
+	unsigned long line_number;
+	unsigned long loaded;
+	unsigned long skipped;
+} bulk_input;
+
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+	fprintf(stderr, "Usage: bulkload [OPTION]... [FILE]\n\n");
+	fprintf(stderr, "Builds a database from \"key:value\" lines read from FILE or stdin.\n\n");
+	fprintf(stderr, "Available Options:\n");
+	fprintf(stderr, "-h:          Print this help message.\n");
+	fprintf(stderr, "-o <path>:   Database file to create (default %s).\n", DEFAULT_DB_PATH);
+	fprintf(stderr, "-t <size>:   Hash table size in entries (default: number of input lines).\n");
+}
+
+/**
+ * @name next_pair - Reads the next well formed line of the input.
+ * @param arg: The bulk_input.
+ * @param kbuf: Buffer of KEY_SIZE bytes for the key.
+ * @param vbuf: Buffer of VALUE_SIZE bytes for the value.
+ *
+ * @return 1 if a pair was read, 0 at end of input.
+ */
+int next_pair(void *arg, void *kbuf, void *vbuf) {
+	bulk_input *input = (bulk_input *) arg;
+	char line[LINE_SIZE];
+	char *separator;
+	size_t length;
+
+	while (fgets(line, LINE_SIZE, input->in)) {
+		input->line_number++;
+
+		length = strlen(line);
+		while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = '\0';
+
+		separator = strchr(line, ':');
+		if (!separator || separator == line || separator[1] == '\0'
+			|| (size_t)(separator - line) >= KEY_SIZE || strlen(separator + 1) >= VALUE_SIZE) {
+
+			fprintf(stderr, "(Warning) bulkload: Skipping malformed line %lu\n", input->line_number);
+			input->skipped++;
+			continue;
+		}
+		*separator = '\0';
+
+		memset(kbuf, 0, KEY_SIZE);
+		memset(vbuf, 0, VALUE_SIZE);
+		memcpy(kbuf, line, separator - line);
+		memcpy(vbuf, separator + 1, strlen(separator + 1));
+		input->loaded++;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @name main - The main routine.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int main(int argc, char **argv) {
+
+	char *db_path = DEFAULT_DB_PATH;
+	unsigned long hash_table_size = 0;
+	bulk_input input;
+	int option, rc;
+	struct timespec start, finish;
+	double elapsed;
+
+	while ((option = getopt(argc, argv, "ho:t:")) != -1) {
+		switch (option) {
+			case 'h':
+				print_usage();
+				exit(0);
+			case 'o':
+				db_path = optarg;
+				break;
+			case 't':
+				hash_table_size = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				print_usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&input, 0, sizeof(input));
+	if (optind < argc) {
+		if (!(input.in = fopen(argv[optind], "r"))) {
+			perror(argv[optind]);
+			return 1;
+		}
+	} else
+		input.in = stdin;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rc = KISSDB_build(db_path, hash_table_size, KEY_SIZE, VALUE_SIZE, next_pair, &input);
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	elapsed = (double)(finish.tv_sec - start.tv_sec) + (double)(finish.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (input.in != stdin)
+		fclose(input.in);
+
+	if (rc) {
+		fprintf(stderr, "(Error) bulkload: Cannot build %s (error %d).\n", db_path, rc);
+		return 1;
+	}
+
+	fprintf(stderr, "(Info) bulkload: Loaded %lu pairs (%lu lines skipped) into %s in %.3f seconds.\n",
+		input.loaded, input.skipped, db_path, elapsed);
+
+	return 0;
+}
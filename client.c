@@ -1,7 +1,7 @@
 /* client.c
 
 	Assignment L1: Simple multi-threaded key-value server
-	for the course MYY601 Operating Systems, University of Ioannina 
+	for the course MYY601 Operating Systems, University of Ioannina
 
 	Single thread implementation by S. Anastasiadis, G. Kappes 2016
 
@@ -10,10 +10,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
 #include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include "utils.h"
+#include "histogram.h"
 
 #define SERVER_PORT     6767
 #define BUF_SIZE        2048
@@ -23,9 +33,115 @@
 #define GET_MODE           1
 #define PUT_MODE           2
 #define USER_MODE          3
-#define NUMBER_OF_THREADS  4
-#define REQUESTS_PER_THREAD 1
-#define MODE 1					// Single thread -> 0, Multi thread -> 1.
+#define LOAD_MODE          4
+#define BILLION   1000000000
+
+// Load generator defaults.
+#define DEFAULT_CONCURRENCY      4
+#define DEFAULT_DURATION        10		// Seconds.
+#define DEFAULT_KEYS (MAX_STATION_ID + 1)
+#define DEFAULT_WRITE_PERCENT   50
+#define DEFAULT_VALUE_SIZE       8
+#define MAX_VALUE_SIZE        1023		// The server's VALUE_SIZE, less the terminator.
+#define MAX_LARGE_VALUE_SIZE (64 << 20)		// The server's LARGE_VALUE_MAX; longer values are streamed.
+#define STREAM_CHUNK_SIZE    65536		// The server's STREAM_CHUNK_SIZE.
+#define DEFAULT_ZIPF_THETA    0.99
+#define DEFAULT_HOT_FRACTION   0.2
+#define DEFAULT_HOT_PROBABILITY 0.8
+#define DEFAULT_CONNECTIONS     64		// Event driven engine.
+#define MAX_PIPELINE            64		// Requests in flight on one connection.
+#define REQUEST_OVERHEAD        64		// Longest request, less the value.
+#define RECONNECT_MS           100
+#define DRAIN_SECONDS           10		// Wait for replies this long after the end.
+#define MAX_EVENTS             256
+
+// Key distributions.
+#define DIST_UNIFORM 0		// Every key equally likely.
+#define DIST_ZIPF    1		// Key i drawn with probability proportional to 1 / (i + 1)^theta.
+#define DIST_HOTSET  2		// A fraction of the keys gets a fixed share of the requests.
+
+// Outcomes of one request.
+#define REPLY_OK     0
+#define REPLY_MISS   1		// GET of a key that is not stored.
+#define REPLY_FAILED 2		// Connection failure or error reply.
+#define REPLY_BUSY   3		// Shed by the server's admission control.
+
+// Where the server listens: a TCP port or a Unix domain socket.
+typedef struct server_address {
+	struct sockaddr_storage addr;
+	socklen_t length;
+} server_address;
+
+typedef struct load_config {
+	server_address server_addr;
+	int concurrency;		// Client threads, each with one request in flight.
+	double rate;			// Target requests per second over all threads, 0 for closed loop.
+	double duration;		// Seconds.
+	int write_percent;		// Share of PUT requests.
+	unsigned long keys;		// Key space: station.0 up to station.<keys - 1>.
+	int distribution;
+	double zipf_theta;
+	double zipf_zetan;		// Precomputed constants of the Zipfian generator.
+	double zipf_eta;
+	double hot_fraction;		// Share of the key space that is hot.
+	double hot_probability;		// Share of the requests that go to the hot keys.
+	int value_size;
+	int event_driven;		// Use event_thread() instead of load_thread().
+	int connections;		// Event driven: persistent connections over all threads.
+	int pipeline;			// Event driven: requests in flight on each connection.
+	int json;			// Print the report as one JSON object.
+} load_config;
+
+typedef struct load_worker {
+	pthread_t thread_id;
+	int id;
+	const load_config *config;
+	uint64_t rng;
+	uint64_t requests[2];		// GETs, PUTs.
+	uint64_t misses;
+	uint64_t failures;
+	uint64_t busy;
+	uint64_t served;		// Requests answered with neither BUSY nor a failure.
+	uint64_t unsent;		// Event driven, open loop: scheduled but never sent.
+	histogram service;		// From sending the request to the reply.
+	histogram response;		// From when the request was due to the reply.
+} load_worker;
+
+// A request sent on an event driven connection and awaiting its reply.
+typedef struct load_pending {
+	uint64_t due;
+	uint64_t sent;
+	int is_put;
+} load_pending;
+
+typedef struct load_connection {
+	int fd;				// -1 while waiting to reconnect.
+	int connected;
+	int ready;			// On the ready stack of the thread.
+	int want_write;			// EPOLLOUT is armed.
+	uint64_t retry_at;
+	load_pending pending[MAX_PIPELINE];	// Oldest at 'first'; replies come in order.
+	int first;
+	int in_flight;
+	char *out;			// Framed requests; the socket has not taken out_start..out_end yet.
+	size_t out_start;
+	size_t out_end;
+	char in[sizeof(int) + BUF_SIZE];	// Start of the next reply frames.
+	size_t in_length;
+} load_connection;
+
+// State of one event_thread().
+typedef struct event_loop {
+	load_worker *worker;
+	int epoll_fd;
+	int timer_fd;			// Fires when the next open loop request is due.
+	load_connection *connections;
+	load_connection **ready;	// Connections that can take another request.
+	int ready_count;
+	int in_flight;
+	char *out;			// Request buffers of all connections.
+	char value[MAX_VALUE_SIZE + 1];
+} event_loop;
 
 /**
  * @name print_usage - Prints usage information.
@@ -35,14 +151,40 @@ void print_usage() {
 	fprintf(stderr, "Usage: client [OPTION]...\n\n");
 	fprintf(stderr, "Available Options:\n");
 	fprintf(stderr, "-h:             Print this help message.\n");
-	fprintf(stderr, "-a <address>:   Specify the server address or hostname.\n");
+	fprintf(stderr, "-a <address>:   Specify the server address or hostname (default localhost).\n");
+	fprintf(stderr, "-u <path>:      Connect to the server's Unix domain socket instead, e.g.\n");
+	fprintf(stderr, "                kvserver.sock in its working directory.\n");
 	fprintf(stderr, "-o <operation>: Send a single operation to the server.\n");
 	fprintf(stderr, "                <operation>:\n");
 	fprintf(stderr, "                PUT:key:value\n");
 	fprintf(stderr, "                GET:key\n");
+	fprintf(stderr, "                STATS\n");
+	fprintf(stderr, "-f <file>:      With -o PUT:key, store the file as the key's value; with\n");
+	fprintf(stderr, "                -o GET:key, write the key's value to the file. Values of up\n");
+	fprintf(stderr, "                to %d MB are streamed in chunks.\n", MAX_LARGE_VALUE_SIZE >> 20);
 	fprintf(stderr, "-i <count>:     Specify the number of iterations.\n");
 	fprintf(stderr, "-g:             Repeatedly send GET operations.\n");
 	fprintf(stderr, "-p:             Repeatedly send PUT operations.\n");
+	fprintf(stderr, "\nWithout -o, -g or -p the client generates load:\n");
+	fprintf(stderr, "-c <threads>:   Concurrent requests, one per thread (default %d).\n", DEFAULT_CONCURRENCY);
+	fprintf(stderr, "-r <rate>:      Send <rate> requests per second in total (open loop).\n");
+	fprintf(stderr, "                Without -r, each thread sends its next request as soon as\n");
+	fprintf(stderr, "                the previous one is answered (closed loop).\n");
+	fprintf(stderr, "-t <seconds>:   Duration (default %d).\n", DEFAULT_DURATION);
+	fprintf(stderr, "-w <percent>:   Share of PUT requests (default %d).\n", DEFAULT_WRITE_PERCENT);
+	fprintf(stderr, "-k <keys>:      Number of distinct keys (default %d).\n", DEFAULT_KEYS);
+	fprintf(stderr, "-d <dist>:      Key distribution:\n");
+	fprintf(stderr, "                uniform (default)\n");
+	fprintf(stderr, "                zipf[:theta] (0 < theta < 1, default %.2f)\n", DEFAULT_ZIPF_THETA);
+	fprintf(stderr, "                hotset[:fraction:probability] (default %.1f:%.1f)\n", DEFAULT_HOT_FRACTION, DEFAULT_HOT_PROBABILITY);
+	fprintf(stderr, "-v <bytes>:     Value size of PUT requests (default %d). Longer values than\n", DEFAULT_VALUE_SIZE);
+	fprintf(stderr, "                %d bytes, up to %d MB, are streamed with PUT_LARGE and\n", MAX_VALUE_SIZE, MAX_LARGE_VALUE_SIZE >> 20);
+	fprintf(stderr, "                GET_LARGE, which -e does not support.\n");
+	fprintf(stderr, "-e:             Event driven: each of the -c threads drives its share of\n");
+	fprintf(stderr, "                the connections with epoll instead of one blocking request.\n");
+	fprintf(stderr, "-n <conns>:     Event driven: persistent connections in total (default %d).\n", DEFAULT_CONNECTIONS);
+	fprintf(stderr, "-P <depth>:     Event driven: pipelined requests per connection (default 1, at most %d).\n", MAX_PIPELINE);
+	fprintf(stderr, "-j:             Print the load report as one JSON object.\n");
 }
 
 /**
@@ -52,241 +194,1272 @@ void print_usage() {
  *
  * @return
  */
-void talk(const struct sockaddr_in server_addr, char *buffer) {
+void talk(const server_address *server_addr, char *buffer) {
 	char rcv_buffer[BUF_SIZE];
 	int socket_fd, numbytes;
 
 	// create socket
-	if ((socket_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+	if ((socket_fd = socket(server_addr->addr.ss_family, SOCK_STREAM, 0)) == -1) {
 		ERROR("socket()");
 	}
 
 	// connect to the server.
-	if (connect(socket_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1) {
+	if (connect(socket_fd, (const struct sockaddr *) &server_addr->addr, server_addr->length) == -1) {
 		ERROR("connect()");
 	}
 
 	// send message.
 	write_str_to_socket(socket_fd, buffer, strlen(buffer));
 
-	// receive results.
+	// receive the result; the server keeps the connection open for more requests.
 	printf("Result: ");
-	do {
-		memset(rcv_buffer, 0, BUF_SIZE);
-		numbytes = read_str_from_socket(socket_fd, rcv_buffer, BUF_SIZE);
-		if (numbytes != 0)
-    		printf("%s", rcv_buffer); // print to stdout
-	} while (numbytes > 0);
+	memset(rcv_buffer, 0, BUF_SIZE);
+	numbytes = read_str_from_socket(socket_fd, rcv_buffer, BUF_SIZE);
+	if (numbytes != 0)
+		printf("%s", rcv_buffer); // print to stdout
 	printf("\n");
 
 	// close the connection to the server.
 	close(socket_fd);
 }
 
-void *func(void *arg) {
+/**
+ * @name now - Reads the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static uint64_t now(void) {
+	struct timespec ts;
 
-	struct sockaddr_in server_addr = *(const struct sockaddr_in*) arg;
-	int random_station, value, request_type, i;
-	char snd_buffer[BUF_SIZE];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * BILLION + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @name sleep_until - Sleeps until a point in time.
+ * @param when: The time to wake up at, from now().
+ *
+ * @return
+ */
+static void sleep_until(uint64_t when) {
+	struct timespec ts;
+
+	ts.tv_sec = when / BILLION;
+	ts.tv_nsec = when % BILLION;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * @name next_random - xorshift64* generator; each thread keeps its own state.
+ * @param state: The generator state, never 0.
+ *
+ * @return 64 random bits.
+ */
+static uint64_t next_random(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @name next_uniform - Draws a number uniformly from [0, 1).
+ * @param state: The generator state.
+ *
+ * @return The number.
+ */
+static double next_uniform(uint64_t *state) {
+
+	return (double) (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @name zipf_setup - Precomputes the constants of the Zipfian generator of
+ * Gray et al., "Quickly Generating Billion-Record Synthetic Databases".
+ * @param config: The load configuration; keys and zipf_theta are set.
+ *
+ * @return
+ */
+static void zipf_setup(load_config *config) {
+	double zeta2 = 1.0 + pow(0.5, config->zipf_theta);
+	unsigned long i;
+
+	config->zipf_zetan = 0;
+	for (i = 1; i <= config->keys; i++)
+		config->zipf_zetan += 1.0 / pow((double) i, config->zipf_theta);
+	config->zipf_eta = (1.0 - pow(2.0 / config->keys, 1.0 - config->zipf_theta)) / (1.0 - zeta2 / config->zipf_zetan);
+}
+
+/**
+ * @name next_key - Draws a key number from the configured distribution.
+ * @param worker: The calling thread.
+ *
+ * @return The key number, below config->keys.
+ */
+static unsigned long next_key(load_worker *worker) {
+	const load_config *config = worker->config;
+	unsigned long hot_keys, key;
+	double u, uz;
 
-	for (i = 0; i < REQUESTS_PER_THREAD; i++) {
+	switch (config->distribution) {
+		case DIST_ZIPF:
+			u = next_uniform(&worker->rng);
+			uz = u * config->zipf_zetan;
+			if (uz < 1.0)
+				return 0;
+			if (uz < 1.0 + pow(0.5, config->zipf_theta))
+				return 1;
+			key = (unsigned long) (config->keys * pow(config->zipf_eta * u - config->zipf_eta + 1.0, 1.0 / (1.0 - config->zipf_theta)));
+			return (key < config->keys) ? key : config->keys - 1;
 
-		request_type = rand() % 2;
+		case DIST_HOTSET:
+			hot_keys = (unsigned long) (config->keys * config->hot_fraction);
+			if (hot_keys == 0)
+				hot_keys = 1;
+			if (hot_keys >= config->keys || next_uniform(&worker->rng) < config->hot_probability)
+				return next_random(&worker->rng) % hot_keys;
+			return hot_keys + next_random(&worker->rng) % (config->keys - hot_keys);
 
-		if (request_type) {
+		default:
+			return next_random(&worker->rng) % config->keys;
+	}
+}
 
-			// GET Request.
-			memset(snd_buffer, 0, BUF_SIZE);
-			
-			random_station = rand() % (MAX_STATION_ID + 1);
-			
-			sprintf(snd_buffer, "GET:station.%d", random_station);
-	    	printf("Operation: %s\n", snd_buffer);
-			talk(server_addr, snd_buffer);
+/**
+ * @name read_all - Reads exactly 'size' bytes from a socket.
+ * @param socket_fd: The socket descriptor.
+ * @param buf: Receives the data.
+ * @param size: The number of bytes to read.
+ *
+ * @return 0 on success, -1 on error or end of stream.
+ */
+static int read_all(int socket_fd, void *buf, size_t size) {
+	char *ptr = (char *) buf;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = read(socket_fd, ptr, size)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * @name classify_reply - Tells the outcome of a request from its reply.
+ * @param reply: The reply, NUL-terminated.
+ *
+ * @return REPLY_OK, REPLY_MISS, REPLY_BUSY or REPLY_FAILED.
+ */
+static int classify_reply(const char *reply) {
+
+	if (!strncmp(reply, "GET OK", 6) || !strncmp(reply, "PUT OK", 6) || !strncmp(reply, "GET LARGE", 9))
+		return REPLY_OK;
+	if (!strncmp(reply, "GET ERROR", 9))
+		return REPLY_MISS;
+	if (!strncmp(reply, "BUSY", 4))
+		return REPLY_BUSY;
+	return REPLY_FAILED;
+}
+
+/**
+ * @name send_request - Sends one request on a new connection and waits for
+ * the reply, without printing anything.
+ * @param server_addr: The server address.
+ * @param request: The request.
+ * @param length: Its length.
+ *
+ * @return REPLY_OK, REPLY_MISS, REPLY_BUSY or REPLY_FAILED.
+ */
+static int send_request(const server_address *server_addr, const char *request, int length) {
+	char reply[BUF_SIZE];
+	int socket_fd, size, result = REPLY_FAILED;
+
+	if ((socket_fd = socket(server_addr->addr.ss_family, SOCK_STREAM, 0)) == -1)
+		return REPLY_FAILED;
+	if (connect(socket_fd, (const struct sockaddr *) &server_addr->addr, server_addr->length) == -1)
+		goto out;
+
+	if (write_str_to_socket(socket_fd, (char *) request, length) != length)
+		goto out;
+	if (read_all(socket_fd, &size, sizeof(size)) || size < 0 || size >= BUF_SIZE || read_all(socket_fd, reply, size))
+		goto out;
+	reply[size] = '\0';
+	result = classify_reply(reply);
+
+out:
+	close(socket_fd);
+	return result;
+}
+
+/**
+ * @name stream_put - Stores a large value with PUT_LARGE. The value is sent
+ * in chunks once the server has answered PUT CONTINUE.
+ * @param socket_fd: A connection to the server.
+ * @param key: The key.
+ * @param length: The length of the value.
+ * @param in: The file holding the value, or NULL to send 'chunk' over and over.
+ * @param chunk: Buffer of STREAM_CHUNK_SIZE bytes.
+ * @param reply: Receives the final reply, BUF_SIZE bytes.
+ *
+ * @return 0 if the server replied, -1 on error.
+ */
+static int stream_put(int socket_fd, const char *key, uint64_t length, FILE *in, char *chunk, char *reply) {
+	char request[BUF_SIZE];
+	uint64_t sent;
+	int n;
+
+	n = snprintf(request, sizeof(request), "PUT_LARGE:%s:%llu", key, (unsigned long long) length);
+	if (n >= BUF_SIZE || write_str_to_socket(socket_fd, request, n) != n || !read_str_from_socket(socket_fd, reply, BUF_SIZE))
+		return -1;
+	// Refused, e.g. too long or BUSY; the value is not sent.
+	if (strncmp(reply, "PUT CONTINUE", 12))
+		return 0;
+
+	for (sent = 0; sent < length; sent += n) {
+		n = (length - sent > STREAM_CHUNK_SIZE) ? STREAM_CHUNK_SIZE : (int) (length - sent);
+		if (in && fread(chunk, 1, n, in) != (size_t) n)
+			return -1;
+		if (write_str_to_socket(socket_fd, chunk, n) != n)
+			return -1;
+	}
+	return read_str_from_socket(socket_fd, reply, BUF_SIZE) ? 0 : -1;
+}
+
+/**
+ * @name stream_get - Fetches a value of any length with GET_LARGE. The
+ * value follows the reply in chunks.
+ * @param socket_fd: A connection to the server.
+ * @param key: The key.
+ * @param out: The file receiving the value, or NULL to discard it.
+ * @param chunk: Buffer of STREAM_CHUNK_SIZE + 1 bytes.
+ * @param reply: Receives the reply, BUF_SIZE bytes.
+ * @param length: Receives the length of the value.
+ *
+ * @return 0 if the server replied and sent the whole value, -1 on error.
+ */
+static int stream_get(int socket_fd, const char *key, FILE *out, char *chunk, char *reply, uint64_t *length) {
+	char request[BUF_SIZE];
+	uint64_t received = 0;
+	int n;
+
+	*length = 0;
+	n = snprintf(request, sizeof(request), "GET_LARGE:%s", key);
+	if (n >= BUF_SIZE || write_str_to_socket(socket_fd, request, n) != n || !read_str_from_socket(socket_fd, reply, BUF_SIZE))
+		return -1;
+	// A miss or BUSY; no value follows.
+	if (strncmp(reply, "GET OK: ", 8))
+		return 0;
+
+	*length = strtoull(reply + 8, NULL, 10);
+	while (received < *length) {
+		if (!(n = read_str_from_socket(socket_fd, chunk, STREAM_CHUNK_SIZE + 1)) || (uint64_t) n > *length - received)
+			return -1;
+		if (out && fwrite(chunk, 1, n, out) != (size_t) n)
+			return -1;
+		received += n;
+	}
+	return 0;
+}
+
+/**
+ * @name transfer_file - Serves -o PUT:key or -o GET:key with -f: stores a
+ * file as the key's value, or writes the key's value to a file, and prints
+ * the reply. A GET writes to path.part and renames it to path only once
+ * the whole value has arrived, so a failed GET leaves the file alone.
+ * @param server_addr: The server address.
+ * @param request: The operation, PUT:key or GET:key.
+ * @param path: The file.
+ *
+ * @return
+ */
+static void transfer_file(const server_address *server_addr, const char *request, const char *path) {
+	char reply[BUF_SIZE], part[PATH_MAX], *chunk;
+	const char *key = request + 4;
+	struct stat st;
+	uint64_t length;
+	int socket_fd, is_put, rc;
+	FILE *f;
+
+	is_put = !strncmp(request, "PUT:", 4);
+	if ((!is_put && strncmp(request, "GET:", 4)) || !*key || strchr(key, ':')) {
+		fprintf(stderr, "Error: -f needs -o PUT:key or -o GET:key.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (snprintf(part, sizeof(part), "%s.part", path) >= (int) sizeof(part)) {
+		fprintf(stderr, "Error: '%s' is too long a path.\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (!(f = fopen(is_put ? path : part, is_put ? "rb" : "wb")))
+		ERROR("fopen()");
+	if (is_put && (fstat(fileno(f), &st) || st.st_size < 1 || st.st_size > MAX_LARGE_VALUE_SIZE)) {
+		fprintf(stderr, "Error: '%s' must hold 1 to %d bytes.\n", path, MAX_LARGE_VALUE_SIZE);
+		exit(EXIT_FAILURE);
+	}
+	if (!(chunk = (char *) malloc(STREAM_CHUNK_SIZE + 1)))
+		ERROR("malloc()");
+
+	if ((socket_fd = socket(server_addr->addr.ss_family, SOCK_STREAM, 0)) == -1)
+		ERROR("socket()");
+	if (connect(socket_fd, (const struct sockaddr *) &server_addr->addr, server_addr->length) == -1)
+		ERROR("connect()");
+
+	if (is_put)
+		rc = stream_put(socket_fd, key, st.st_size, f, chunk, reply);
+	else {
+		rc = stream_get(socket_fd, key, f, chunk, reply, &length);
+		if (fclose(f) && !rc)
+			rc = -1;
+		f = NULL;
+		if (rc || strncmp(reply, "GET OK", 6))
+			unlink(part);
+		else if (rename(part, path) == -1) {
+			perror("rename()");
+			unlink(part);
+			rc = -1;
+		}
+	}
+
+	printf("Result: ");
+	if (rc)
+		printf("Transfer failed.\n");
+	else if (!is_put && !strncmp(reply, "GET OK", 6))
+		printf("GET OK: %llu bytes written to %s\n", (unsigned long long) length, path);
+	else
+		printf("%s", reply);
+	printf("\n");
+
+	close(socket_fd);
+	if (f)
+		fclose(f);
+	free(chunk);
+}
+
+/**
+ * @name send_large_request - Draws the next request of a thread whose
+ * values do not fit in one frame, and sends it as a PUT_LARGE or GET_LARGE
+ * on a new connection.
+ * @param worker: The calling thread.
+ * @param buf: STREAM_CHUNK_SIZE bytes of value, then STREAM_CHUNK_SIZE + 1
+ * bytes for receiving.
+ * @param is_put: Set to 1 for a PUT, 0 for a GET.
+ *
+ * @return REPLY_OK, REPLY_MISS, REPLY_BUSY or REPLY_FAILED.
+ */
+static int send_large_request(load_worker *worker, char *buf, int *is_put) {
+	const server_address *server_addr = &worker->config->server_addr;
+	char key[BUF_SIZE], reply[BUF_SIZE];
+	uint64_t length;
+	int socket_fd, rc = -1;
+
+	*is_put = (int) (next_random(&worker->rng) % 100) < worker->config->write_percent;
+	sprintf(key, "station.%lu", next_key(worker));
+
+	if ((socket_fd = socket(server_addr->addr.ss_family, SOCK_STREAM, 0)) == -1)
+		return REPLY_FAILED;
+	if (connect(socket_fd, (const struct sockaddr *) &server_addr->addr, server_addr->length) == 0) {
+		if (*is_put)
+			rc = stream_put(socket_fd, key, worker->config->value_size, NULL, buf, reply);
+		else
+			rc = stream_get(socket_fd, key, NULL, buf + STREAM_CHUNK_SIZE, reply, &length);
+	}
+	close(socket_fd);
+
+	return rc ? REPLY_FAILED : classify_reply(reply);
+}
+
+/**
+ * @name make_request - Draws the next request of a thread.
+ * @param worker: The calling thread.
+ * @param value: The value of PUT requests.
+ * @param buf: Receives the request, at least BUF_SIZE bytes.
+ * @param is_put: Set to 1 for a PUT, 0 for a GET.
+ *
+ * @return The length of the request.
+ */
+static int make_request(load_worker *worker, const char *value, char *buf, int *is_put) {
+
+	*is_put = (int) (next_random(&worker->rng) % 100) < worker->config->write_percent;
+	if (*is_put)
+		return sprintf(buf, "PUT:station.%lu:%s", next_key(worker), value);
+	return sprintf(buf, "GET:station.%lu", next_key(worker));
+}
+
+/**
+ * @name record_reply - Counts a finished request and records its latency.
+ * @param worker: The calling thread.
+ * @param is_put: Whether it was a PUT.
+ * @param result: REPLY_OK, REPLY_MISS, REPLY_BUSY or REPLY_FAILED.
+ * @param due: When it was due to be sent.
+ * @param sent: When it was sent.
+ * @param done: When its reply arrived.
+ *
+ * @return
+ */
+static void record_reply(load_worker *worker, int is_put, int result, uint64_t due, uint64_t sent, uint64_t done) {
+
+	worker->requests[is_put]++;
+	if (result == REPLY_MISS)
+		worker->misses++;
+	else if (result == REPLY_FAILED)
+		worker->failures++;
+	else if (result == REPLY_BUSY) {
+		// Shed requests say nothing about the latency of served ones.
+		worker->busy++;
+		return;
+	}
+	if (result != REPLY_FAILED)
+		worker->served++;
+	histogram_record(&worker->service, done - sent);
+	histogram_record(&worker->response, done - due);
+}
+
+/**
+ * @name random_value - Fills the value a thread sends with PUT requests.
+ * @param worker: The calling thread.
+ * @param value: Receives config->value_size letters and a terminator.
+ *
+ * @return
+ */
+static void random_value(load_worker *worker, char *value) {
+	int i;
+
+	for (i = 0; i < worker->config->value_size; i++)
+		value[i] = 'a' + (char) (next_random(&worker->rng) % 26);
+	value[worker->config->value_size] = '\0';
+}
+
+/**
+ * @name load_thread - Sends requests until the configured duration is over.
+ *
+ * In open loop every thread has a fixed schedule of rate / concurrency
+ * requests per second. A request that cannot be sent on time, because the
+ * previous one is still waiting for its reply, is sent late and its
+ * response time is counted from when it was due. Otherwise a stalled server
+ * would hold back the requests that should measure the stall (coordinated
+ * omission). In closed loop there is no schedule, and response and service
+ * times are the same.
+ * @param arg: The load_worker of the thread.
+ *
+ * @return NULL
+ */
+static void *load_thread(void *arg) {
+	load_worker *worker = (load_worker *) arg;
+	const load_config *config = worker->config;
+	char snd_buffer[BUF_SIZE], value[MAX_VALUE_SIZE + 1], *large = NULL;
+	uint64_t start, end, interval = 0, due, sent, n;
+	int is_put, length, result, i;
+
+	// A value too long for one frame is streamed as one chunk of letters sent over and over.
+	if (config->value_size > MAX_VALUE_SIZE) {
+		if (!(large = (char *) malloc(2 * STREAM_CHUNK_SIZE + 1))) {
+			perror("malloc()");
+			exit(1);
+		}
+		for (i = 0; i < STREAM_CHUNK_SIZE; i++)
+			large[i] = 'a' + (char) (next_random(&worker->rng) % 26);
+	}
+	else
+		random_value(worker, value);
+
+	start = now();
+	end = start + (uint64_t) (config->duration * BILLION);
+	if (config->rate > 0) {
+		interval = (uint64_t) ((double) BILLION * config->concurrency / config->rate);
+		// Spread the threads' schedules over one interval.
+		start += interval * worker->id / config->concurrency;
+	}
+
+	for (n = 0; ; n++) {
+		if (interval) {
+			due = start + n * interval;
+			if (due >= end)
+				break;
+			if (due > now())
+				sleep_until(due);
+			sent = now();
 		}
 		else {
+			due = sent = now();
+			if (sent >= end)
+				break;
+		}
 
-			// PUT Request.
-			memset(snd_buffer, 0, BUF_SIZE);
-			
-			value = rand() % 65 + (-20);
-	    	random_station = rand() % (MAX_STATION_ID + 1);
-			
-			sprintf(snd_buffer, "PUT:station.%d:%d", random_station, value);
-	    	printf("Operation: %s\n", snd_buffer);
-			talk(server_addr, snd_buffer);
+		if (large)
+			result = send_large_request(worker, large, &is_put);
+		else {
+			length = make_request(worker, value, snd_buffer, &is_put);
+			result = send_request(&config->server_addr, snd_buffer, length);
 		}
+		record_reply(worker, is_put, result, due, sent, now());
 	}
 
-	return EXIT_SUCCESS;
+	free(large);
+	return NULL;
 }
 
 /**
- * @name main - The main routine.
+ * @name connection_open - Starts a non-blocking connect for an event
+ * driven connection.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection, closed.
+ *
+ * @return 0 on success, -1 on error.
  */
-int main(int argc, char **argv) {
+static int connection_open(event_loop *loop, load_connection *c) {
+	const server_address *server_addr = &loop->worker->config->server_addr;
+	struct epoll_event event;
+	int nodelay = 1;
 
-	char *host = NULL;
-	char *request = NULL;
-	int mode = 0;
-	int option = 0;
-	int count = ITER_COUNT;
-	char snd_buffer[BUF_SIZE];
-	int station, value;
-	struct sockaddr_in server_addr;
-	struct hostent *host_info;
+	memset(c->pending, 0, sizeof(c->pending));
+	c->connected = c->first = c->in_flight = 0;
+	c->out_start = c->out_end = c->in_length = 0;
 
-	pthread_t thread_id[NUMBER_OF_THREADS];
-	int i, thread_check;
-	
-	struct timespec start, finish;
-	long seconds, nanoseconds;
-	long total_time;
+	if ((c->fd = socket(server_addr->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		return -1;
+	// Pipelined requests go out as soon as they are made.
+	if (server_addr->addr.ss_family == AF_INET)
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (connect(c->fd, (const struct sockaddr *) &server_addr->addr, server_addr->length) == -1 && errno != EINPROGRESS)
+		goto error;
 
-	clock_t start_sec, end_sec;
-	double cpu_time_used;
-	start_sec = clock();
+	// Writable once connected.
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = c;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+		goto error;
+	c->want_write = 1;
+	return 0;
 
-	if (MODE == 0) {
+error:
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+}
 
-		// Parse user parameters.
-		while ((option = getopt(argc, argv,"i:hgpo:a:")) != -1) {
-			switch (option) {
-				case 'h':
-					print_usage();
-					exit(0);
-				case 'a':
-					host = optarg;
-					printf("Host: %s\n", host);
-					break;
-				case 'i':
-					count = atoi(optarg);
-					break;
-				case 'g':
-					if (mode) {
-						fprintf(stderr, "You can only specify one of the following: -g, -p, -o\n");
-						exit(EXIT_FAILURE);
-					}
-					mode = GET_MODE;
-					break;
-				case 'p': 
-					if (mode) {
-						fprintf(stderr, "You can only specify one of the following: -g, -p, -o\n");
-						exit(EXIT_FAILURE);
-					}
-					mode = PUT_MODE;
-					break;
-				case 'o':
-					if (mode) {
-						fprintf(stderr, "You can only specify one of the following: -r, -w, -o\n");
-						exit(EXIT_FAILURE);
-					}
-					mode = USER_MODE;
-					request = optarg;
-					break;
-				default:
-					print_usage();
-					exit(EXIT_FAILURE);
+/**
+ * @name connection_abandon - Counts the unanswered requests of a
+ * connection as failed.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection.
+ *
+ * @return
+ */
+static void connection_abandon(event_loop *loop, load_connection *c) {
+
+	for (; c->in_flight > 0; c->in_flight--) {
+		loop->worker->requests[c->pending[c->first].is_put]++;
+		loop->worker->failures++;
+		c->first = (c->first + 1) % MAX_PIPELINE;
+		loop->in_flight--;
+	}
+}
+
+/**
+ * @name connection_fail - Closes a broken connection, counts its
+ * unanswered requests as failed and schedules a reconnect.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection.
+ * @param when: The current time.
+ *
+ * @return
+ */
+static void connection_fail(event_loop *loop, load_connection *c, uint64_t when) {
+
+	connection_abandon(loop, c);
+	c->connected = 0;
+	if (c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+	c->retry_at = when + (uint64_t) RECONNECT_MS * 1000000;
+}
+
+/**
+ * @name connection_ready - Puts a connection on the stack of connections
+ * that can take another request.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection.
+ *
+ * @return
+ */
+static void connection_ready(event_loop *loop, load_connection *c) {
+
+	if (!c->ready && c->connected && c->in_flight < loop->worker->config->pipeline) {
+		c->ready = 1;
+		loop->ready[loop->ready_count++] = c;
+	}
+}
+
+/**
+ * @name next_ready - Takes a connection that can take another request.
+ * @param loop: The calling thread's event loop.
+ *
+ * @return The connection, or NULL if every connection is busy or down.
+ */
+static load_connection *next_ready(event_loop *loop) {
+	load_connection *c;
+
+	while (loop->ready_count > 0) {
+		c = loop->ready[loop->ready_count - 1];
+		if (c->connected && c->in_flight < loop->worker->config->pipeline)
+			return c;
+		c->ready = 0;
+		loop->ready_count--;
+	}
+	return NULL;
+}
+
+/**
+ * @name connection_flush - Writes as much of the pending requests of a
+ * connection as the socket takes, watching for writability if some remain.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int connection_flush(event_loop *loop, load_connection *c) {
+	struct epoll_event event;
+	ssize_t n;
+
+	while (c->out_start < c->out_end) {
+		if ((n = send(c->fd, c->out + c->out_start, c->out_end - c->out_start, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			break;
+		}
+		c->out_start += n;
+	}
+	if (c->out_start == c->out_end)
+		c->out_start = c->out_end = 0;
+
+	if (c->want_write != (c->out_end > 0)) {
+		c->want_write = (c->out_end > 0);
+		event.events = EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+		event.data.ptr = c;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &event) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * @name connection_send - Sends the thread's next request on a connection.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection, which can take another request.
+ * @param due: When the request is due.
+ * @param when: The current time.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int connection_send(event_loop *loop, load_connection *c, uint64_t due, uint64_t when) {
+	load_pending *pending;
+	int length, is_put;
+
+	// Make room behind the requests the socket has not taken yet.
+	if (c->out_start > 0) {
+		memmove(c->out, c->out + c->out_start, c->out_end - c->out_start);
+		c->out_end -= c->out_start;
+		c->out_start = 0;
+	}
+
+	// Same framing as write_str_to_socket(): the length, then the data.
+	length = make_request(loop->worker, loop->value, c->out + c->out_end + sizeof(length), &is_put);
+	memcpy(c->out + c->out_end, &length, sizeof(length));
+	c->out_end += sizeof(length) + length;
+
+	pending = &c->pending[(c->first + c->in_flight) % MAX_PIPELINE];
+	pending->due = due;
+	pending->sent = when;
+	pending->is_put = is_put;
+	c->in_flight++;
+	loop->in_flight++;
+
+	return connection_flush(loop, c);
+}
+
+/**
+ * @name connection_receive - Reads the replies that arrived on a
+ * connection and completes their requests, oldest first.
+ * @param loop: The calling thread's event loop.
+ * @param c: The connection.
+ * @param when: The current time.
+ *
+ * @return 0 on success, -1 on error or when the server closed the connection.
+ */
+static int connection_receive(event_loop *loop, load_connection *c, uint64_t when) {
+	load_pending *pending;
+	char reply[BUF_SIZE];
+	ssize_t n;
+	int size;
+
+	for (;;) {
+		if ((n = recv(c->fd, c->in + c->in_length, sizeof(c->in) - c->in_length, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		if (n == 0)
+			return -1;
+		c->in_length += n;
+
+		while (c->in_length >= sizeof(size)) {
+			memcpy(&size, c->in, sizeof(size));
+			if (size < 0 || size >= BUF_SIZE || c->in_flight == 0)
+				return -1;
+			if (c->in_length < sizeof(size) + size)
+				break;
+
+			memcpy(reply, c->in + sizeof(size), size);
+			reply[size] = '\0';
+			pending = &c->pending[c->first];
+			c->first = (c->first + 1) % MAX_PIPELINE;
+			c->in_flight--;
+			loop->in_flight--;
+			record_reply(loop->worker, pending->is_put, classify_reply(reply), pending->due, pending->sent, when);
+
+			c->in_length -= sizeof(size) + size;
+			memmove(c->in, c->in + sizeof(size) + size, c->in_length);
+		}
+		connection_ready(loop, c);
+	}
+}
+
+/**
+ * @name event_thread - Drives config->connections / config->concurrency
+ * persistent connections from one thread with epoll, with up to
+ * config->pipeline requests in flight on each.
+ *
+ * In closed loop every connection is kept full. In open loop the thread
+ * has a fixed schedule of rate / concurrency requests per second; a
+ * request that finds every connection full waits until one frees up and
+ * its response time is counted from when it was due, as in load_thread().
+ * Connections that break are reopened after RECONNECT_MS. Requests still
+ * unanswered DRAIN_SECONDS after the end count as failed; scheduled
+ * requests no connection could take before the end count as unsent.
+ * @param arg: The load_worker of the thread.
+ *
+ * @return NULL
+ */
+static void *event_thread(void *arg) {
+	load_worker *worker = (load_worker *) arg;
+	const load_config *config = worker->config;
+	struct epoll_event events[MAX_EVENTS];
+	struct itimerspec timer;
+	event_loop loop;
+	load_connection *c;
+	uint64_t start, end, give_up, interval = 0, due = 0, next = 0, last_retry = 0, when, expirations;
+	int count, i, ready, done, error;
+	size_t frame_size;
+	socklen_t length;
+
+	memset(&loop, 0, sizeof(loop));
+	loop.worker = worker;
+	random_value(worker, loop.value);
+
+	// Share the connections out among the threads.
+	count = config->connections / config->concurrency + (worker->id < config->connections % config->concurrency);
+	loop.connections = (load_connection *) calloc(count, sizeof(load_connection));
+	loop.ready = (load_connection **) calloc(count, sizeof(load_connection *));
+	frame_size = sizeof(int) + REQUEST_OVERHEAD + config->value_size;
+	loop.out = (char *) malloc((size_t) count * config->pipeline * frame_size);
+	if (!loop.connections || !loop.ready || !loop.out) {
+		fprintf(stderr, "Error: Cannot allocate %d connections.\n", count);
+		exit(1);
+	}
+	if ((loop.epoll_fd = epoll_create1(0)) == -1 || (loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1)
+		ERROR("event_thread()");
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = NULL;
+	if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.timer_fd, &events[0]) == -1)
+		ERROR("epoll_ctl()");
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		c = &loop.connections[i];
+		c->out = loop.out + (size_t) i * config->pipeline * frame_size;
+		if (connection_open(&loop, c))
+			connection_fail(&loop, c, start);
+	}
+
+	end = start + (uint64_t) (config->duration * BILLION);
+	give_up = end + (uint64_t) DRAIN_SECONDS * BILLION;
+	if (config->rate > 0) {
+		interval = (uint64_t) ((double) BILLION * config->concurrency / config->rate);
+		// Spread the threads' schedules over one interval.
+		start += interval * worker->id / config->concurrency;
+	}
+
+	for (;;) {
+		when = now();
+		if (when >= give_up)
+			break;
+
+		// Reopen broken connections now and then.
+		if (when - last_retry >= (uint64_t) RECONNECT_MS * 1000000) {
+			last_retry = when;
+			for (i = 0; i < count; i++) {
+				c = &loop.connections[i];
+				if (c->fd == -1 && c->retry_at <= when && connection_open(&loop, c))
+					connection_fail(&loop, c, when);
 			}
 		}
 
-		// Check parameters.
-		if (!mode) {
-			fprintf(stderr, "Error: One of -g, -p, -o is required.\n\n");
-			print_usage();
-			exit(0);
+		// Send what is due on connections that can take it.
+		if (interval) {
+			while ((due = start + next * interval) < end && due <= when && (c = next_ready(&loop))) {
+				if (connection_send(&loop, c, due, when))
+					connection_fail(&loop, c, when);
+				next++;
+			}
+			// Past the end nothing more is sent, even if no connection was ready.
+			done = (due >= end || when >= end);
+		}
+		else {
+			while (when < end && (c = next_ready(&loop)))
+				if (connection_send(&loop, c, when, when))
+					connection_fail(&loop, c, when);
+			done = (when >= end);
 		}
-		if (!host) {
-			fprintf(stderr, "Error: -a <address> is required.\n\n");
-			print_usage();
-			exit(0);
+		if (done && loop.in_flight == 0)
+			break;
+
+		// Wake up for the next scheduled request.
+		if (interval && !done && due > when) {
+			memset(&timer, 0, sizeof(timer));
+			timer.it_value.tv_sec = due / BILLION;
+			timer.it_value.tv_nsec = due % BILLION;
+			timerfd_settime(loop.timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
 		}
 
-		// get the host (server) info
-		if ((host_info = gethostbyname(host)) == NULL) { 
-			ERROR("gethostbyname()"); 
+		if ((ready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, RECONNECT_MS)) == -1) {
+			if (errno == EINTR)
+				continue;
+			ERROR("epoll_wait()");
 		}
 
-		// create socket adress of server (type, IP-adress and port number)
-		bzero(&server_addr, sizeof(server_addr));
-		server_addr.sin_family = AF_INET;
-		server_addr.sin_addr = *((struct in_addr*)host_info->h_addr);
-		server_addr.sin_port = htons(SERVER_PORT);
-
-		if (mode == USER_MODE) {
-			memset(snd_buffer, 0, BUF_SIZE);
-			strncpy(snd_buffer, request, strlen(request));
-			printf("Operation: %s\n", snd_buffer);
-			talk(server_addr, snd_buffer);
-		} else {
-			while(--count>=0) {
-				for (station = 0; station <= MAX_STATION_ID; station++) {
-					memset(snd_buffer, 0, BUF_SIZE);
-					if (mode == GET_MODE) {
-						// Repeatedly GET.
-						sprintf(snd_buffer, "GET:station.%d", station);
-					} else if (mode == PUT_MODE) {
-						// Repeatedly PUT.
-						// create a random value.
-						value = rand() % 65 + (-20);
-						sprintf(snd_buffer, "PUT:station.%d:%d", station, value);
-					}
-					printf("Operation: %s\n", snd_buffer);
-					talk(server_addr, snd_buffer);
+		when = now();
+		for (i = 0; i < ready; i++) {
+			if (!(c = (load_connection *) events[i].data.ptr)) {
+				// The timer; drain its expiration count.
+				if (read(loop.timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+					ERROR("read()");
+				continue;
+			}
+			if (c->fd == -1)
+				continue;
+
+			if (!c->connected) {
+				error = 0;
+				length = sizeof(error);
+				if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error
+					|| (events[i].events & (EPOLLERR | EPOLLHUP))) {
+					connection_fail(&loop, c, when);
+					continue;
+				}
+				c->connected = 1;
+				if (connection_flush(&loop, c)) {
+					connection_fail(&loop, c, when);
+					continue;
 				}
+				connection_ready(&loop, c);
+				continue;
+			}
+
+			if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && connection_receive(&loop, c, when)) {
+				connection_fail(&loop, c, when);
+				continue;
 			}
+			if ((events[i].events & EPOLLOUT) && connection_flush(&loop, c))
+				connection_fail(&loop, c, when);
 		}
 	}
-	else {
 
-		// get the host (server) info
-		if ((host_info = gethostbyname("localhost")) == NULL) { 
-			ERROR("gethostbyname()"); 
+	// What was sent but never answered failed; what was scheduled but never sent is counted apart.
+	for (i = 0; i < count; i++)
+		connection_abandon(&loop, &loop.connections[i]);
+	if (interval)
+		while (start + next++ * interval < end)
+			worker->unsent++;
+
+	for (i = 0; i < count; i++)
+		if (loop.connections[i].fd != -1)
+			close(loop.connections[i].fd);
+	close(loop.timer_fd);
+	close(loop.epoll_fd);
+	free(loop.out);
+	free(loop.ready);
+	free(loop.connections);
+	return NULL;
+}
+
+/**
+ * @name print_latency - Prints one row of the latency table.
+ * @param name: The row name.
+ * @param h: The histogram, in nanoseconds.
+ *
+ * @return
+ */
+static void print_latency(const char *name, const histogram *h) {
+
+	printf("%-9s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+		histogram_percentile(h, 0.50) / 1000.0, histogram_percentile(h, 0.90) / 1000.0,
+		histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0,
+		h->max / 1000.0, histogram_mean(h) / 1000.0);
+}
+
+/**
+ * @name print_latency_json - Prints the percentiles of a histogram as a
+ * JSON object member.
+ * @param name: The member name.
+ * @param h: The histogram, in nanoseconds.
+ *
+ * @return
+ */
+static void print_latency_json(const char *name, const histogram *h) {
+
+	printf("\"%s\":{\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"mean_us\":%.1f}", name,
+		histogram_percentile(h, 0.50) / 1000.0, histogram_percentile(h, 0.90) / 1000.0,
+		histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0,
+		h->max / 1000.0, histogram_mean(h) / 1000.0);
+}
+
+/**
+ * @name parse_distribution - Parses the argument of -d.
+ * @param arg: uniform, zipf[:theta] or hotset[:fraction:probability].
+ * @param config: Receives the distribution and its parameters.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int parse_distribution(const char *arg, load_config *config) {
+
+	if (!strcmp(arg, "uniform")) {
+		config->distribution = DIST_UNIFORM;
+		return 0;
+	}
+	if (!strncmp(arg, "zipf", 4)) {
+		config->distribution = DIST_ZIPF;
+		if (arg[4] == ':')
+			config->zipf_theta = atof(arg + 5);
+		else if (arg[4])
+			return -1;
+		return (config->zipf_theta > 0 && config->zipf_theta < 1) ? 0 : -1;
+	}
+	if (!strncmp(arg, "hotset", 6)) {
+		config->distribution = DIST_HOTSET;
+		if (arg[6] == ':') {
+			if (sscanf(arg + 7, "%lf:%lf", &config->hot_fraction, &config->hot_probability) != 2)
+				return -1;
 		}
+		else if (arg[6])
+			return -1;
+		return (config->hot_fraction > 0 && config->hot_fraction <= 1
+			&& config->hot_probability >= 0 && config->hot_probability <= 1) ? 0 : -1;
+	}
+	return -1;
+}
 
-		// create socket adress of server (type, IP-adress and port number)
-		bzero(&server_addr, sizeof(server_addr));
-		server_addr.sin_family = AF_INET;
-		server_addr.sin_addr = *((struct in_addr*)host_info->h_addr);
-		server_addr.sin_port = htons(SERVER_PORT);
+/**
+ * @name run_load - Runs the load generator and prints its report.
+ * @param config: The load configuration.
+ *
+ * @return
+ */
+static void run_load(load_config *config) {
+	static const char *distribution_names[] = { "uniform", "zipf", "hotset" };
+	load_worker *workers;
+	histogram service, response;
+	uint64_t requests[2] = { 0, 0 }, misses = 0, failures = 0, busy = 0, served = 0, unsent = 0, start, elapsed;
+	double seconds;
+	struct rlimit files;
+	int i;
+
+	if (config->distribution == DIST_ZIPF)
+		zipf_setup(config);
 
-		if (clock_gettime(CLOCK_REALTIME, &start) == -1) {
+	// Every connection is a descriptor; raise the soft limit as far as allowed.
+	if (config->event_driven && getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	if (!(workers = (load_worker *) calloc(config->concurrency, sizeof(load_worker)))) {
+		perror("calloc()");
+		exit(1);
+	}
 
-			perror("clock_gettime()");
+	start = now();
+	for (i = 0; i < config->concurrency; i++) {
+		workers[i].id = i;
+		workers[i].config = config;
+		workers[i].rng = (start ^ ((uint64_t) (i + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+		if (pthread_create(&workers[i].thread_id, NULL, config->event_driven ? event_thread : load_thread, &workers[i]) != 0) {
+			perror("pthread_create()");
 			exit(1);
 		}
+	}
 
-		for (i = 0; i < NUMBER_OF_THREADS; i++) {
+	histogram_reset(&service);
+	histogram_reset(&response);
+	for (i = 0; i < config->concurrency; i++) {
+		pthread_join(workers[i].thread_id, NULL);
+		requests[0] += workers[i].requests[0];
+		requests[1] += workers[i].requests[1];
+		misses += workers[i].misses;
+		failures += workers[i].failures;
+		busy += workers[i].busy;
+		served += workers[i].served;
+		unsent += workers[i].unsent;
+		histogram_merge(&service, &workers[i].service);
+		histogram_merge(&response, &workers[i].response);
+	}
+	elapsed = now() - start;
+	seconds = (double) elapsed / BILLION;
 
-			thread_check = pthread_create(&thread_id[i], NULL, func, (void *) &server_addr);
-			if (thread_check != 0) {
+	if (config->json) {
+		printf("{\"loop\":\"%s\",\"threads\":%d,\"event_driven\":%d,\"connections\":%d,\"pipeline\":%d,"
+			"\"rate\":%.1f,\"write_percent\":%d,\"distribution\":\"%s\",\"keys\":%lu,\"value_size\":%d,"
+			"\"requests\":%llu,\"gets\":%llu,\"puts\":%llu,\"misses\":%llu,\"failures\":%llu,\"busy\":%llu,"
+			"\"unsent\":%llu,\"seconds\":%.3f,\"throughput\":%.1f,\"goodput\":%.1f,",
+			(config->rate > 0) ? "open" : "closed", config->concurrency, config->event_driven,
+			config->event_driven ? config->connections : config->concurrency, config->pipeline,
+			config->rate, config->write_percent, distribution_names[config->distribution], config->keys, config->value_size,
+			(unsigned long long) (requests[0] + requests[1]), (unsigned long long) requests[0],
+			(unsigned long long) requests[1], (unsigned long long) misses, (unsigned long long) failures,
+			(unsigned long long) busy, (unsigned long long) unsent, seconds, (requests[0] + requests[1]) / seconds,
+			served / seconds);
+		print_latency_json("service", &service);
+		printf(",");
+		print_latency_json("response", &response);
+		printf("}\n");
+		free(workers);
+		return;
+	}
 
-				perror("pthread_create()");
-				exit(1);
-			}
-		}
+	printf("%s loop, %d threads", (config->rate > 0) ? "Open" : "Closed", config->concurrency);
+	if (config->event_driven)
+		printf(", %d connections, %d requests in flight on each", config->connections, config->pipeline);
+	if (config->rate > 0)
+		printf(", target %.0f requests/s", config->rate);
+	printf(", %d%% PUT, %s keys over %lu, %d byte values\n", config->write_percent,
+		distribution_names[config->distribution], config->keys, config->value_size);
+	printf("Requests: %llu (GET %llu, PUT %llu), GET misses %llu, failures %llu, BUSY %llu\n",
+		(unsigned long long) (requests[0] + requests[1]), (unsigned long long) requests[0],
+		(unsigned long long) requests[1], (unsigned long long) misses, (unsigned long long) failures,
+		(unsigned long long) busy);
+	if (unsent)
+		printf("Unsent: %llu scheduled requests found no connection before the end\n", (unsigned long long) unsent);
+	printf("Throughput: %.1f requests/s over %.2f s", (requests[0] + requests[1]) / seconds, seconds);
+	if (failures || busy)
+		printf(", %.1f served", served / seconds);
+	printf("\n");
+	printf("\nLatency (us)    p50       p90       p99     p99.9       max      mean\n");
+	print_latency("service", &service);
+	if (config->rate > 0)
+		print_latency("response", &response);
 
-		for (i = 0; i < NUMBER_OF_THREADS; i++) {
+	free(workers);
+}
 
-			pthread_join(thread_id[i], NULL);
-		}
+/**
+ * @name main - The main routine.
+ */
+int main(int argc, char **argv) {
 
-		if (clock_gettime(CLOCK_REALTIME, &finish) == -1) {
+	char *host = "localhost";
+	char *unix_path = NULL;
+	char *request = NULL;
+	char *file_path = NULL;
+	int mode = LOAD_MODE;
+	int option = 0;
+	int count = ITER_COUNT;
+	char snd_buffer[BUF_SIZE];
+	int station, value;
+	server_address server_addr;
+	struct sockaddr_in *tcp_addr;
+	struct sockaddr_un *unix_addr;
+	struct hostent *host_info;
+	load_config config;
 
-			perror("clock_gettime()");
-			exit(1);
+	memset(&config, 0, sizeof(config));
+	config.concurrency = DEFAULT_CONCURRENCY;
+	config.duration = DEFAULT_DURATION;
+	config.write_percent = DEFAULT_WRITE_PERCENT;
+	config.keys = DEFAULT_KEYS;
+	config.distribution = DIST_UNIFORM;
+	config.zipf_theta = DEFAULT_ZIPF_THETA;
+	config.hot_fraction = DEFAULT_HOT_FRACTION;
+	config.hot_probability = DEFAULT_HOT_PROBABILITY;
+	config.value_size = DEFAULT_VALUE_SIZE;
+	config.connections = DEFAULT_CONNECTIONS;
+	config.pipeline = 1;
+
+	// Parse user parameters.
+	while ((option = getopt(argc, argv,"i:hgpo:a:u:f:c:r:t:w:k:d:v:en:P:j")) != -1) {
+		switch (option) {
+			case 'h':
+				print_usage();
+				exit(0);
+			case 'a':
+				host = optarg;
+				printf("Host: %s\n", host);
+				break;
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 'f':
+				file_path = optarg;
+				break;
+			case 'i':
+				count = atoi(optarg);
+				break;
+			case 'g':
+				if (mode != LOAD_MODE) {
+					fprintf(stderr, "You can only specify one of the following: -g, -p, -o\n");
+					exit(EXIT_FAILURE);
+				}
+				mode = GET_MODE;
+				break;
+			case 'p':
+				if (mode != LOAD_MODE) {
+					fprintf(stderr, "You can only specify one of the following: -g, -p, -o\n");
+					exit(EXIT_FAILURE);
+				}
+				mode = PUT_MODE;
+				break;
+			case 'o':
+				if (mode != LOAD_MODE) {
+					fprintf(stderr, "You can only specify one of the following: -g, -p, -o\n");
+					exit(EXIT_FAILURE);
+				}
+				mode = USER_MODE;
+				request = optarg;
+				break;
+			case 'c':
+				config.concurrency = atoi(optarg);
+				break;
+			case 'r':
+				config.rate = atof(optarg);
+				break;
+			case 't':
+				config.duration = atof(optarg);
+				break;
+			case 'w':
+				config.write_percent = atoi(optarg);
+				break;
+			case 'k':
+				config.keys = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				if (parse_distribution(optarg, &config)) {
+					fprintf(stderr, "Error: Invalid key distribution '%s'.\n\n", optarg);
+					print_usage();
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'v':
+				config.value_size = atoi(optarg);
+				break;
+			case 'e':
+				config.event_driven = 1;
+				break;
+			case 'n':
+				config.connections = atoi(optarg);
+				break;
+			case 'P':
+				config.pipeline = atoi(optarg);
+				break;
+			case 'j':
+				config.json = 1;
+				break;
+			default:
+				print_usage();
+				exit(EXIT_FAILURE);
 		}
+	}
+
+	// Check parameters.
+	if (config.concurrency < 1 || config.rate < 0 || config.duration <= 0 || config.keys < 1
+		|| config.write_percent < 0 || config.write_percent > 100
+		|| config.value_size < 1 || config.value_size > (config.event_driven ? MAX_VALUE_SIZE : MAX_LARGE_VALUE_SIZE)
+		|| config.pipeline < 1 || config.pipeline > MAX_PIPELINE
+		|| (config.event_driven && config.connections < config.concurrency)) {
+		fprintf(stderr, "Error: Invalid load parameters.\n\n");
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+	if (file_path && mode != USER_MODE) {
+		fprintf(stderr, "Error: -f needs -o PUT:key or -o GET:key.\n\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config.distribution == DIST_ZIPF && config.keys < 2) {
+		fprintf(stderr, "Error: The Zipfian distribution needs at least 2 keys.\n\n");
+		exit(EXIT_FAILURE);
+	}
 
-		seconds = finish.tv_sec - start.tv_sec;
-		nanoseconds = finish.tv_nsec - start.tv_nsec;
+	bzero(&server_addr, sizeof(server_addr));
+	if (unix_path) {
+		// A server on this host, reached without the TCP/IP stack.
+		unix_addr = (struct sockaddr_un *) &server_addr.addr;
+		if (strlen(unix_path) >= sizeof(unix_addr->sun_path)) {
+			fprintf(stderr, "Error: Socket path '%s' is too long.\n", unix_path);
+			exit(EXIT_FAILURE);
+		}
+		unix_addr->sun_family = AF_UNIX;
+		strcpy(unix_addr->sun_path, unix_path);
+		server_addr.length = sizeof(struct sockaddr_un);
+	} else {
+		// get the host (server) info
+		if ((host_info = gethostbyname(host)) == NULL) {
+			ERROR("gethostbyname()");
+		}
 
-		total_time = ((long)seconds * (long)1000000000) + (long)nanoseconds;
-		printf("Total time (nanosec): %.0ld\n", total_time);
+		// create socket adress of server (type, IP-adress and port number)
+		tcp_addr = (struct sockaddr_in *) &server_addr.addr;
+		tcp_addr->sin_family = AF_INET;
+		tcp_addr->sin_addr = *((struct in_addr*)host_info->h_addr);
+		tcp_addr->sin_port = htons(SERVER_PORT);
+		server_addr.length = sizeof(struct sockaddr_in);
+	}
 
-		end_sec = clock();
-		cpu_time_used = ((double) (end_sec - start_sec)) / CLOCKS_PER_SEC;
-		fprintf(stderr, "Total time (seconds) %.4f\n", cpu_time_used);
+	if (mode == LOAD_MODE) {
+		config.server_addr = server_addr;
+		run_load(&config);
+	} else if (mode == USER_MODE && file_path) {
+		printf("Operation: %s, file %s\n", request, file_path);
+		transfer_file(&server_addr, request, file_path);
+	} else if (mode == USER_MODE) {
+		memset(snd_buffer, 0, BUF_SIZE);
+		strncpy(snd_buffer, request, BUF_SIZE - 1);
+		printf("Operation: %s\n", snd_buffer);
+		talk(&server_addr, snd_buffer);
+	} else {
+		while(--count>=0) {
+			for (station = 0; station <= MAX_STATION_ID; station++) {
+				memset(snd_buffer, 0, BUF_SIZE);
+				if (mode == GET_MODE) {
+					// Repeatedly GET.
+					sprintf(snd_buffer, "GET:station.%d", station);
+				} else if (mode == PUT_MODE) {
+					// Repeatedly PUT.
+					// create a random value.
+					value = rand() % 65 + (-20);
+					sprintf(snd_buffer, "PUT:station.%d:%d", station, value);
+				}
+				printf("Operation: %s\n", snd_buffer);
+				talk(&server_addr, snd_buffer);
+			}
+		}
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
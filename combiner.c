@@ -0,0 +1,167 @@
+/* combiner.c
+
+	Flat combining of concurrent writes.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "combiner.h"
+
+/**
+ * @name combiner_clock - Reads the monotonic clock.
+ *
+ * @return Nanoseconds.
+ */
+static uint64_t combiner_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @name combiner_init - Initializes the combiner.
+ * @param c: The combiner.
+ * @param key_size: Size of every key in bytes.
+ * @param value_size: Size of every value in bytes.
+ * @param apply: Applies a batch.
+ * @param arg: Passed to apply.
+ *
+ * @return
+ */
+void combiner_init(combiner *c, size_t key_size, size_t value_size, combiner_apply apply, void *arg) {
+
+	memset(c, 0, sizeof(combiner));
+	c->key_size = key_size;
+	c->value_size = value_size;
+	c->apply = apply;
+	c->arg = arg;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->done_cond, NULL);
+}
+
+/**
+ * @name combiner_destroy - Releases the lock and the batch buffer.
+ * @param c: The combiner, with no write in flight.
+ *
+ * @return
+ */
+void combiner_destroy(combiner *c) {
+
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->done_cond);
+	free(c->entries);
+	c->entries = NULL;
+	c->capacity = 0;
+}
+
+/**
+ * @name combiner_build - Copies a batch into the batch buffer. A pair
+ * whose key is already in the buffer replaces the older value, so every
+ * key is written once.
+ * @param c: The combiner, held by the caller as the combiner.
+ * @param batch: The published requests, oldest first.
+ * @param size: The number of requests.
+ * @param count: Receives the number of distinct keys.
+ *
+ * @return 0 on success, -1 if the buffer cannot grow.
+ */
+static int combiner_build(combiner *c, combiner_request *batch, size_t size, size_t *count) {
+	size_t entry_size = c->key_size + c->value_size;
+	combiner_request *r;
+	size_t n = 0, i;
+	char *grown;
+
+	if (size > c->capacity) {
+		if (!(grown = (char *) realloc(c->entries, size * entry_size)))
+			return -1;
+		c->entries = grown;
+		c->capacity = size;
+	}
+
+	for (r = batch; r; r = r->next) {
+		for (i = 0; i < n; i++) {
+			if (!memcmp(c->entries + i * entry_size, r->key, c->key_size))
+				break;
+		}
+		if (i == n) {
+			memcpy(c->entries + i * entry_size, r->key, c->key_size);
+			n++;
+		}
+		memcpy(c->entries + i * entry_size + c->key_size, r->value, c->value_size);
+	}
+	*count = n;
+	return 0;
+}
+
+/**
+ * @name combiner_submit - Writes a pair through the next batch.
+ * @param c: The combiner.
+ * @param key: The key.
+ * @param value: The value.
+ * @param lock_wait: Receives the nanoseconds spent waiting for a batch to
+ * take the pair, and for the locks that batch waited for.
+ *
+ * @return The result of the batch: 0 on success, nonzero on error.
+ */
+int combiner_submit(combiner *c, const void *key, const void *value, uint64_t *lock_wait) {
+	combiner_request me, *batch = NULL, *r, *next;
+	size_t size = 0, count;
+	uint64_t now, apply_wait = 0;
+	int result;
+
+	me.key = key;
+	me.value = value;
+	me.done = 0;
+	me.result = 0;
+	// Until taken, lock_wait holds when the pair was published.
+	me.lock_wait = combiner_clock();
+
+	pthread_mutex_lock(&c->lock);
+	me.next = c->published;
+	c->published = &me;
+	__atomic_add_fetch(&c->requests, 1, __ATOMIC_RELAXED);
+	while (!me.done && c->combining)
+		pthread_cond_wait(&c->done_cond, &c->lock);
+	if (me.done) {
+		pthread_mutex_unlock(&c->lock);
+		*lock_wait = me.lock_wait;
+		return me.result;
+	}
+
+	// Nobody is combining and our pair is still published: apply everything
+	// published so far, ours included.
+	c->combining = 1;
+	// Reverse to arrival order.
+	now = combiner_clock();
+	for (r = c->published; r; r = next) {
+		next = r->next;
+		r->next = batch;
+		r->lock_wait = (now > r->lock_wait) ? now - r->lock_wait : 0;
+		batch = r;
+		size++;
+	}
+	c->published = NULL;
+	__atomic_add_fetch(&c->batches, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&c->lock);
+
+	if (combiner_build(c, batch, size, &count))
+		result = -1;
+	else
+		result = c->apply(c->arg, c->entries, count, &apply_wait);
+
+	pthread_mutex_lock(&c->lock);
+	for (r = batch; r; r = next) {
+		next = r->next;
+		r->lock_wait += apply_wait;
+		r->result = result;
+		r->done = 1;
+	}
+	c->combining = 0;
+	pthread_cond_broadcast(&c->done_cond);
+	pthread_mutex_unlock(&c->lock);
+
+	*lock_wait = me.lock_wait;
+	return result;
+}
@@ -0,0 +1,62 @@
+/* combiner.h
+
+	Flat combining of concurrent writes.
+
+	Every writer publishes its key/value pair on a shared list. The thread
+	that finds no combiner at work becomes the combiner: it takes all the
+	pairs published so far, applies them in one batch with a single call
+	of the apply function (one writer lock, one flush) and hands the result
+	back to each of their writers. The others sleep until their pair has
+	been applied; if it was published too late for the running batch, one
+	of them combines the next one.
+*/
+
+#ifndef COMBINER_H
+#define COMBINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Applies 'count' pairs, each key_size bytes of key followed by value_size
+// bytes of value, in order; a later copy of a key wins. Sets '*lock_wait' to
+// the nanoseconds spent waiting for locks. Returns 0 on success.
+typedef int (*combiner_apply)(void *arg, const void *entries, size_t count, uint64_t *lock_wait);
+
+typedef struct combiner_request {
+	struct combiner_request *next;		// Published list, newest first.
+	const void *key;
+	const void *value;
+	uint64_t lock_wait;			// From publishing until taken into a batch, then plus the batch's.
+	int done;
+	int result;
+} combiner_request;
+
+typedef struct combiner {
+	size_t key_size;
+	size_t value_size;
+	combiner_apply apply;
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;		// Broadcast when a batch has been applied.
+	combiner_request *published;		// Waiting for the next batch.
+	int combining;				// A batch is being applied.
+	char *entries;				// The combiner's batch buffer.
+	size_t capacity;			// Pairs that fit in 'entries'.
+	uint64_t batches;			// Batches applied; read with __atomic_load_n().
+	uint64_t requests;			// Pairs submitted; read with __atomic_load_n().
+} combiner;
+
+// initialize for keys and values of the given sizes, applied by 'apply'.
+void combiner_init(combiner *c, size_t key_size, size_t value_size, combiner_apply apply, void *arg);
+
+// release the lock and the batch buffer. No write may be in flight.
+void combiner_destroy(combiner *c);
+
+// write 'key' and 'value' through the next batch and return the batch's
+// result. The pair is copied before the call returns. '*lock_wait' receives
+// the nanoseconds spent waiting for a batch to take the pair, and for the
+// locks that batch waited for.
+int combiner_submit(combiner *c, const void *key, const void *value, uint64_t *lock_wait);
+
+#endif
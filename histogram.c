@@ -0,0 +1,172 @@
+/* histogram.c
+
+	Log-bucketed latency histogram in the style of HdrHistogram.
+*/
+
+#include <string.h>
+#include "histogram.h"
+
+// Only the thread that owns a histogram records into it, while others may
+// read it; the same single-writer update as STAT_ADD in stats.h.
+#define HISTOGRAM_ADD(field, n) \
+	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define HISTOGRAM_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * @name histogram_index - Maps a value to its bucket.
+ * @param value: The value.
+ *
+ * @return The bucket index.
+ */
+static int histogram_index(uint64_t value) {
+	int exponent;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (int) value;
+
+	exponent = 63 - __builtin_clzll(value);		// value lies in [2^exponent, 2^(exponent + 1)).
+	return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+		+ (int) ((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * @name histogram_highest_value - Returns the largest value of a bucket.
+ * @param index: The bucket index.
+ *
+ * @return The largest value that maps to the bucket.
+ */
+static uint64_t histogram_highest_value(int index) {
+	int shift;
+	uint64_t sub;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return (uint64_t) index;
+
+	shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+	sub = (uint64_t) (index % HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * @name histogram_reset - Clears all counters.
+ * @param h: The histogram.
+ *
+ * @return
+ */
+void histogram_reset(histogram *h) {
+
+	memset(h, 0, sizeof(histogram));
+}
+
+/**
+ * @name histogram_record - Records one value.
+ * @param h: The histogram.
+ * @param value: The value, e.g. a latency in nanoseconds.
+ *
+ * @return
+ */
+void histogram_record(histogram *h, uint64_t value) {
+
+	HISTOGRAM_ADD(h->counts[histogram_index(value)], 1);
+	HISTOGRAM_ADD(h->count, 1);
+	HISTOGRAM_ADD(h->sum, value);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @name histogram_record_shared - Records one value into a histogram that
+ * several threads record into.
+ * @param h: The histogram.
+ * @param value: The value, e.g. a latency in nanoseconds.
+ *
+ * @return
+ */
+void histogram_record_shared(histogram *h, uint64_t value) {
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->counts[histogram_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * @name histogram_merge - Adds the counters of one histogram to another.
+ * @param into: The histogram receiving the counters.
+ * @param from: The histogram to add, possibly being recorded into.
+ *
+ * @return
+ */
+void histogram_merge(histogram *into, const histogram *from) {
+	uint64_t max = HISTOGRAM_READ(from->max);
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		into->counts[i] += HISTOGRAM_READ(from->counts[i]);
+	into->count += HISTOGRAM_READ(from->count);
+	into->sum += HISTOGRAM_READ(from->sum);
+	if (max > into->max)
+		into->max = max;
+}
+
+/**
+ * @name histogram_percentile - Computes a percentile.
+ * @param h: The histogram.
+ * @param p: The fraction of values, between 0 and 1.
+ *
+ * @return The value below which fraction p of the recorded values fall.
+ */
+uint64_t histogram_percentile(const histogram *h, double p) {
+	uint64_t total = 0, seen = 0, target, value;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += h->counts[i];
+	if (!total)
+		return 0;
+
+	target = (uint64_t) (p * (double) total + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > total)
+		target = total;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= target) {
+			value = histogram_highest_value(i);
+			return (value > h->max) ? h->max : value;
+		}
+	}
+	return h->max;
+}
+
+/**
+ * @name histogram_count_at_most - Counts the values at or below a bound,
+ * e.g. for a cumulative "le" bucket.
+ * @param h: The histogram.
+ * @param value: The bound.
+ *
+ * @return The number of values in buckets whose highest value is at most 'value'.
+ */
+uint64_t histogram_count_at_most(const histogram *h, uint64_t value) {
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS && histogram_highest_value(i) <= value; i++)
+		count += h->counts[i];
+	return count;
+}
+
+/**
+ * @name histogram_mean - Computes the mean.
+ * @param h: The histogram.
+ *
+ * @return The mean of the recorded values, 0 if there are none.
+ */
+double histogram_mean(const histogram *h) {
+
+	return h->count ? (double) h->sum / (double) h->count : 0.0;
+}
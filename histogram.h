@@ -0,0 +1,49 @@
+/* histogram.h
+
+	Log-bucketed latency histogram in the style of HdrHistogram.
+
+	Every power of two is split into HISTOGRAM_SUB_BUCKETS linear
+	sub-buckets, so any recorded value is reported within 1/32 (about 3%)
+	of its true value from 1 ns to 2^64 ns with a fixed 15 KB of counters.
+	A histogram normally has a single writer; readers may merge it
+	concurrently. histogram_record_shared() lets several threads record.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram;
+
+// clear all counters.
+void histogram_reset(histogram *h);
+
+// record one value. Only one thread may record into a histogram.
+void histogram_record(histogram *h, uint64_t value);
+
+// record one value with atomic adds; any number of threads may record.
+void histogram_record_shared(histogram *h, uint64_t value);
+
+// add the counters of 'from' to 'into'.
+void histogram_merge(histogram *into, const histogram *from);
+
+// value below which fraction 'p' (0..1) of the recorded values fall.
+uint64_t histogram_percentile(const histogram *h, double p);
+
+// number of recorded values whose bucket lies entirely at or below 'value'.
+uint64_t histogram_count_at_most(const histogram *h, uint64_t value);
+
+// mean of the recorded values.
+double histogram_mean(const histogram *h);
+
+#endif
@@ -13,12 +13,33 @@
 
 #define _FILE_OFFSET_BITS 64
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#define KISSDB_HAVE_DIRECT
+#endif
+
+#ifndef _WIN32
+#define KISSDB_HAVE_SNAPSHOT
+#define KISSDB_HAVE_EXTENTS
+#endif
+
 #include "kissdb.h"
+#include "probes.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifdef KISSDB_HAVE_DIRECT
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef _WIN32
 #define fseeko _fseeki64
 #define ftello _ftelli64
@@ -36,18 +57,401 @@ static uint64_t KISSDB_hash(const void *b,unsigned long len)
 	return hash;
 }
 
-int KISSDB_open(
-	KISSDB *db,
-	const char *path,
-	int mode,
-	unsigned long hash_table_size,
-	unsigned long key_size,
-	unsigned long value_size)
+#ifdef KISSDB_HAVE_DIRECT
+
+/* Buffer pool used in O_DIRECT mode. Frames are found through a chained
+ * hash on block number and replaced with the clock algorithm. A pinned
+ * frame is never evicted; threads that find every frame pinned wait on
+ * 'unpinned'. Dirty frames are written back on eviction and on flush. */
+
+#define KISSDB_NO_BLOCK ((uint64_t)-1)
+
+struct KISSDB_Frame {
+	uint64_t block;
+	long next;
+	unsigned long pins;
+	int dirty;
+	int ref;
+};
+
+struct KISSDB_BufferPool {
+	pthread_mutex_t lock;
+	pthread_cond_t unpinned;
+	uint8_t *blocks;
+	struct KISSDB_Frame *frames;
+	long *buckets;
+	unsigned long num_frames;
+	unsigned long hand;
+	uint64_t disk_size; /* bytes present in the file itself, may exceed db->file_size by block padding */
+	int extent_fd; /* the same file without O_DIRECT: extents bypass the pool */
+};
+
+static struct KISSDB_BufferPool *KISSDB_pool_create(unsigned long num_frames,uint64_t disk_size)
 {
-	uint64_t tmp;
-	uint8_t tmp2[4];
-	uint64_t *httmp;
-	uint64_t *hash_tables_rea;
+	struct KISSDB_BufferPool *p;
+	void *blocks;
+	unsigned long i;
+
+	p = calloc(1,sizeof(struct KISSDB_BufferPool));
+	if (!p)
+		return (struct KISSDB_BufferPool *)0;
+	if (posix_memalign(&blocks,KISSDB_BLOCK_SIZE,(size_t)num_frames * KISSDB_BLOCK_SIZE)) {
+		free(p);
+		return (struct KISSDB_BufferPool *)0;
+	}
+	p->blocks = (uint8_t *)blocks;
+	p->frames = malloc(sizeof(struct KISSDB_Frame) * num_frames);
+	p->buckets = malloc(sizeof(long) * num_frames);
+	if ((!p->frames)||(!p->buckets)) {
+		free(p->frames);
+		free(p->buckets);
+		free(p->blocks);
+		free(p);
+		return (struct KISSDB_BufferPool *)0;
+	}
+	for(i=0;i<num_frames;++i) {
+		p->frames[i].block = KISSDB_NO_BLOCK;
+		p->frames[i].next = -1;
+		p->frames[i].pins = 0;
+		p->frames[i].dirty = 0;
+		p->frames[i].ref = 0;
+		p->buckets[i] = -1;
+	}
+	p->num_frames = num_frames;
+	p->hand = 0;
+	p->disk_size = disk_size;
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->unpinned,NULL);
+	return p;
+}
+
+static void KISSDB_pool_destroy(struct KISSDB_BufferPool *p)
+{
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->unpinned);
+	free(p->frames);
+	free(p->buckets);
+	free(p->blocks);
+	free(p);
+}
+
+static void KISSDB_pool_unlink(struct KISSDB_BufferPool *p,long f)
+{
+	long *link = &(p->buckets[p->frames[f].block % p->num_frames]);
+	while (*link != f)
+		link = &(p->frames[*link].next);
+	*link = p->frames[f].next;
+	p->frames[f].next = -1;
+	p->frames[f].block = KISSDB_NO_BLOCK;
+}
+
+/* Called with the pool lock held. */
+static int KISSDB_pool_writeback(KISSDB *db,long f)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	uint64_t offset = p->frames[f].block * KISSDB_BLOCK_SIZE;
+
+	if (pwrite(db->fd,p->blocks + ((uint64_t)f * KISSDB_BLOCK_SIZE),KISSDB_BLOCK_SIZE,(off_t)offset) != KISSDB_BLOCK_SIZE)
+		return KISSDB_ERROR_IO;
+	if ((offset + KISSDB_BLOCK_SIZE) > p->disk_size)
+		p->disk_size = offset + KISSDB_BLOCK_SIZE;
+	p->frames[f].dirty = 0;
+	return 0;
+}
+
+/* Pin a block, loading it if it is not resident. Called with the pool
+ * lock held; returns the frame index or a negative error. */
+static long KISSDB_pool_pin(KISSDB *db,uint64_t block)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	uint8_t *buf;
+	uint64_t offset;
+	unsigned long i;
+	ssize_t n;
+	long f;
+
+	for(;;) {
+		f = p->buckets[block % p->num_frames];
+		while ((f >= 0)&&(p->frames[f].block != block))
+			f = p->frames[f].next;
+		if (f >= 0) {
+			++p->frames[f].pins;
+			p->frames[f].ref = 1;
+			return f;
+		}
+
+		/* two sweeps give every unpinned frame the chance to lose its reference bit */
+		for(i=0;i<(p->num_frames * 2);++i) {
+			f = (long)p->hand;
+			p->hand = (p->hand + 1) % p->num_frames;
+			if (p->frames[f].pins)
+				continue;
+			if (p->frames[f].ref) {
+				p->frames[f].ref = 0;
+				continue;
+			}
+			goto pool_pin_victim_found;
+		}
+		pthread_cond_wait(&p->unpinned,&p->lock);
+	}
+
+pool_pin_victim_found:
+	if ((p->frames[f].dirty)&&(KISSDB_pool_writeback(db,f)))
+		return KISSDB_ERROR_IO;
+	if (p->frames[f].block != KISSDB_NO_BLOCK)
+		KISSDB_pool_unlink(p,f);
+
+	buf = p->blocks + ((uint64_t)f * KISSDB_BLOCK_SIZE);
+	offset = block * KISSDB_BLOCK_SIZE;
+	if (offset < p->disk_size) {
+		n = pread(db->fd,buf,KISSDB_BLOCK_SIZE,(off_t)offset);
+		if (n < 0)
+			return KISSDB_ERROR_IO;
+		if (n < KISSDB_BLOCK_SIZE)
+			memset(buf + n,0,KISSDB_BLOCK_SIZE - (size_t)n);
+	} else memset(buf,0,KISSDB_BLOCK_SIZE);
+
+	p->frames[f].block = block;
+	p->frames[f].next = p->buckets[block % p->num_frames];
+	p->buckets[block % p->num_frames] = f;
+	p->frames[f].pins = 1;
+	p->frames[f].ref = 1;
+	p->frames[f].dirty = 0;
+	return f;
+}
+
+static void KISSDB_pool_unpin(struct KISSDB_BufferPool *p,long f)
+{
+	if (!--p->frames[f].pins)
+		pthread_cond_signal(&p->unpinned);
+}
+
+static int KISSDB_pool_read(KISSDB *db,uint64_t offset,void *buf,unsigned long len)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	uint8_t *out = (uint8_t *)buf;
+	unsigned long within,n;
+	long f;
+
+	pthread_mutex_lock(&p->lock);
+	if ((offset + len) > db->file_size) {
+		pthread_mutex_unlock(&p->lock);
+		return 1;
+	}
+	while (len) {
+		within = (unsigned long)(offset % KISSDB_BLOCK_SIZE);
+		n = KISSDB_BLOCK_SIZE - within;
+		if (n > len)
+			n = len;
+		if ((f = KISSDB_pool_pin(db,offset / KISSDB_BLOCK_SIZE)) < 0) {
+			pthread_mutex_unlock(&p->lock);
+			return (int)f;
+		}
+		/* the pin keeps the frame resident while we copy without the lock */
+		pthread_mutex_unlock(&p->lock);
+		memcpy(out,p->blocks + ((uint64_t)f * KISSDB_BLOCK_SIZE) + within,n);
+		pthread_mutex_lock(&p->lock);
+		KISSDB_pool_unpin(p,f);
+		out += n;
+		offset += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+static int KISSDB_pool_write(KISSDB *db,uint64_t offset,const void *buf,unsigned long len)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	const uint8_t *in = (const uint8_t *)buf;
+	unsigned long within,n;
+	long f;
+
+	pthread_mutex_lock(&p->lock);
+	while (len) {
+		within = (unsigned long)(offset % KISSDB_BLOCK_SIZE);
+		n = KISSDB_BLOCK_SIZE - within;
+		if (n > len)
+			n = len;
+		if ((f = KISSDB_pool_pin(db,offset / KISSDB_BLOCK_SIZE)) < 0) {
+			pthread_mutex_unlock(&p->lock);
+			return (int)f;
+		}
+		memcpy(p->blocks + ((uint64_t)f * KISSDB_BLOCK_SIZE) + within,in,n);
+		p->frames[f].dirty = 1;
+		KISSDB_pool_unpin(p,f);
+		in += n;
+		offset += n;
+		len -= n;
+		if (offset > db->file_size)
+			db->file_size = offset;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/* Write back every dirty frame and trim the block padding off the file. */
+static int KISSDB_pool_flush(KISSDB *db)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	unsigned long f;
+	int r = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for(f=0;f<p->num_frames;++f) {
+		if ((p->frames[f].dirty)&&(KISSDB_pool_writeback(db,(long)f)))
+			r = KISSDB_ERROR_IO;
+	}
+	if ((!r)&&(p->disk_size != db->file_size)) {
+		if (ftruncate(db->fd,(off_t)db->file_size))
+			r = KISSDB_ERROR_IO;
+		else p->disk_size = db->file_size;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return r;
+}
+
+#endif /* KISSDB_HAVE_DIRECT */
+
+/* Positioned I/O used by everything below, so that the stdio and the
+ * O_DIRECT back ends share one implementation of the file format.
+ * Reads return 0 on success, 1 on a short read, negative on error. */
+
+static int KISSDB_read_at(KISSDB *db,uint64_t offset,void *buf,unsigned long len)
+{
+	PROBE2(kissdb,read,offset,len);
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool)
+		return KISSDB_pool_read(db,offset,buf,len);
+#endif
+	if (fseeko(db->f,offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fread(buf,len,1,db->f) != 1)
+		return (ferror(db->f)) ? KISSDB_ERROR_IO : 1;
+	return 0;
+}
+
+static int KISSDB_write_at(KISSDB *db,uint64_t offset,const void *buf,unsigned long len)
+{
+	PROBE2(kissdb,write,offset,len);
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool)
+		return KISSDB_pool_write(db,offset,buf,len);
+#endif
+	if (fseeko(db->f,offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fwrite(buf,len,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	return 0;
+}
+
+/* Key and value are contiguous on disk; write both after a single seek. */
+static int KISSDB_write_record(KISSDB *db,uint64_t offset,const void *key,const void *value)
+{
+	PROBE2(kissdb,write,offset,db->key_size + db->value_size);
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool) {
+		if (KISSDB_pool_write(db,offset,key,db->key_size))
+			return KISSDB_ERROR_IO;
+		return KISSDB_pool_write(db,offset + db->key_size,value,db->value_size);
+	}
+#endif
+	if (fseeko(db->f,offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fwrite(key,db->key_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	if (fwrite(value,db->value_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	return 0;
+}
+
+static int KISSDB_end_offset(KISSDB *db,uint64_t *endoffset)
+{
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool) {
+		pthread_mutex_lock(&db->pool->lock);
+		*endoffset = db->file_size;
+		pthread_mutex_unlock(&db->pool->lock);
+		return 0;
+	}
+#endif
+	if (fseeko(db->f,0,SEEK_END))
+		return KISSDB_ERROR_IO;
+	*endoffset = (uint64_t)ftello(db->f);
+	return 0;
+}
+
+/* Called after every update. The pool is write-back: its dirty blocks
+ * reach the file on eviction and on KISSDB_close(). */
+static void KISSDB_flush_updates(KISSDB *db)
+{
+	if (db->f)
+		fflush(db->f);
+}
+
+/* Release resources without writing anything back (error paths). */
+static void KISSDB_snapshot_free(KISSDB *db);
+static int KISSDB_extent_space_create(KISSDB *db);
+static void KISSDB_extent_space_free(KISSDB *db);
+static void KISSDB_extent_replaced(KISSDB *db,const void *oldv,const void *newv);
+
+static void KISSDB_release(KISSDB *db)
+{
+	KISSDB_snapshot_free(db);
+	KISSDB_extent_space_free(db);
+	if (db->hash_tables)
+		free(db->hash_tables);
+	if (db->f)
+		fclose(db->f);
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool) {
+		close(db->pool->extent_fd);
+		KISSDB_pool_destroy(db->pool);
+		close(db->fd);
+	}
+#endif
+	memset(db,0,sizeof(KISSDB));
+}
+
+static int KISSDB_open_file(KISSDB *db,const char *path,int mode,unsigned long pool_blocks)
+{
+#ifdef KISSDB_HAVE_DIRECT
+	struct stat st;
+	int flags;
+
+	if (pool_blocks) {
+		switch(mode) {
+			case KISSDB_OPEN_MODE_RDONLY: flags = O_RDONLY; break;
+			case KISSDB_OPEN_MODE_RDWR: flags = O_RDWR; break;
+			case KISSDB_OPEN_MODE_RWCREAT: flags = O_RDWR | O_CREAT; break;
+			case KISSDB_OPEN_MODE_RWREPLACE: flags = O_RDWR | O_CREAT | O_TRUNC; break;
+			default: return KISSDB_ERROR_INVALID_PARAMETERS;
+		}
+		db->fd = open(path,flags | O_DIRECT,0644);
+		if (db->fd < 0)
+			return KISSDB_ERROR_IO;
+		if (fstat(db->fd,&st)) {
+			close(db->fd);
+			return KISSDB_ERROR_IO;
+		}
+		db->file_size = (uint64_t)st.st_size;
+		db->pool = KISSDB_pool_create(pool_blocks,db->file_size);
+		if (!db->pool) {
+			close(db->fd);
+			return KISSDB_ERROR_MALLOC;
+		}
+		db->pool->extent_fd = open(path,flags & ~(O_CREAT | O_TRUNC));
+		if (db->pool->extent_fd < 0) {
+			KISSDB_pool_destroy(db->pool);
+			close(db->fd);
+			return KISSDB_ERROR_IO;
+		}
+		return 0;
+	}
+#else
+	if (pool_blocks)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+#endif
 
 #ifdef _WIN32
 	db->f = (FILE *)0;
@@ -67,50 +471,81 @@ int KISSDB_open(
 		if (!db->f)
 			return KISSDB_ERROR_IO;
 	}
+	return 0;
+}
 
-	if (fseeko(db->f,0,SEEK_END)) {
-		fclose(db->f);
+int KISSDB_open(
+	KISSDB *db,
+	const char *path,
+	int mode,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	return KISSDB_open_direct(db,path,mode,hash_table_size,key_size,value_size,0);
+}
+
+int KISSDB_open_direct(
+	KISSDB *db,
+	const char *path,
+	int mode,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size,
+	unsigned long pool_blocks)
+{
+	uint64_t tmp;
+	uint8_t tmp2[4];
+	uint64_t *httmp;
+	uint64_t *hash_tables_rea;
+	uint64_t offset;
+	int r;
+
+	memset(db,0,sizeof(KISSDB));
+	if ((r = KISSDB_open_file(db,path,mode,pool_blocks)))
+		return r;
+
+	if (KISSDB_end_offset(db,&offset)) {
+		KISSDB_release(db);
 		return KISSDB_ERROR_IO;
 	}
-	if (ftello(db->f) < KISSDB_HEADER_SIZE) {
+	if (offset < KISSDB_HEADER_SIZE) {
 		/* write header if not already present */
 		if ((hash_table_size)&&(key_size)&&(value_size)) {
-			if (fseeko(db->f,0,SEEK_SET)) { fclose(db->f); return KISSDB_ERROR_IO; }
 			tmp2[0] = 'K'; tmp2[1] = 'd'; tmp2[2] = 'B'; tmp2[3] = KISSDB_VERSION;
-			if (fwrite(tmp2,4,1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+			if (KISSDB_write_at(db,0,tmp2,4)) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 			tmp = hash_table_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+			if (KISSDB_write_at(db,4,&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 			tmp = key_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+			if (KISSDB_write_at(db,4 + sizeof(uint64_t),&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 			tmp = value_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-			fflush(db->f);
+			if (KISSDB_write_at(db,4 + (sizeof(uint64_t) * 2),&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
+			KISSDB_flush_updates(db);
 		} else {
-			fclose(db->f);
+			KISSDB_release(db);
 			return KISSDB_ERROR_INVALID_PARAMETERS;
 		}
 	} else {
-		if (fseeko(db->f,0,SEEK_SET)) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if (fread(tmp2,4,1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+		if (KISSDB_read_at(db,0,tmp2,4)) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 		if ((tmp2[0] != 'K')||(tmp2[1] != 'd')||(tmp2[2] != 'B')||(tmp2[3] != KISSDB_VERSION)) {
-			fclose(db->f);
+			KISSDB_release(db);
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+		if (KISSDB_read_at(db,4,&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 		if (!tmp) {
-			fclose(db->f);
+			KISSDB_release(db);
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
 		hash_table_size = (unsigned long)tmp;
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+		if (KISSDB_read_at(db,4 + sizeof(uint64_t),&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 		if (!tmp) {
-			fclose(db->f);
+			KISSDB_release(db);
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
 		key_size = (unsigned long)tmp;
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
+		if (KISSDB_read_at(db,4 + (sizeof(uint64_t) * 2),&tmp,sizeof(uint64_t))) { KISSDB_release(db); return KISSDB_ERROR_IO; }
 		if (!tmp) {
-			fclose(db->f);
+			KISSDB_release(db);
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
 		value_size = (unsigned long)tmp;
@@ -123,15 +558,16 @@ int KISSDB_open(
 
 	httmp = malloc(db->hash_table_size_bytes);
 	if (!httmp) {
-		fclose(db->f);
+		KISSDB_release(db);
 		return KISSDB_ERROR_MALLOC;
 	}
 	db->num_hash_tables = 0;
 	db->hash_tables = (uint64_t *)0;
-	while (fread(httmp,db->hash_table_size_bytes,1,db->f) == 1) {
+	offset = KISSDB_HEADER_SIZE;
+	while (KISSDB_read_at(db,offset,httmp,db->hash_table_size_bytes) == 0) {
 		hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1));
 		if (!hash_tables_rea) {
-			KISSDB_close(db);
+			KISSDB_release(db);
 			free(httmp);
 			return KISSDB_ERROR_MALLOC;
 		}
@@ -139,58 +575,94 @@ int KISSDB_open(
 
 		memcpy(((uint8_t *)db->hash_tables) + (db->hash_table_size_bytes * db->num_hash_tables),httmp,db->hash_table_size_bytes);
 		++db->num_hash_tables;
-		if (httmp[db->hash_table_size]) {
-			if (fseeko(db->f,httmp[db->hash_table_size],SEEK_SET)) {
-				KISSDB_close(db);
-				free(httmp);
-				return KISSDB_ERROR_IO;
-			}
-		} else break;
+		if (httmp[db->hash_table_size])
+			offset = httmp[db->hash_table_size];
+		else break;
 	}
 	free(httmp);
 
+	if ((r = KISSDB_extent_space_create(db))) {
+		KISSDB_release(db);
+		return r;
+	}
+
+	return 0;
+}
+
+int KISSDB_sync(KISSDB *db)
+{
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool) {
+		if (KISSDB_pool_flush(db))
+			return KISSDB_ERROR_IO;
+		return (fdatasync(db->fd)) ? KISSDB_ERROR_IO : 0;
+	}
+#endif
+	if (fflush(db->f))
+		return KISSDB_ERROR_IO;
+#ifndef _WIN32
+	if (fsync(fileno(db->f)))
+		return KISSDB_ERROR_IO;
+#endif
 	return 0;
 }
 
+int KISSDB_file_size(KISSDB *db,uint64_t *size)
+{
+#ifdef KISSDB_HAVE_DIRECT
+	struct stat st;
+
+	if (!db->pool) {
+		if (fstat(fileno(db->f),&st))
+			return KISSDB_ERROR_IO;
+		*size = (uint64_t)st.st_size;
+		return 0;
+	}
+#endif
+	return KISSDB_end_offset(db,size);
+}
+
 void KISSDB_close(KISSDB *db)
 {
-	if (db->hash_tables)
-		free(db->hash_tables);
-	if (db->f)
-		fclose(db->f);
-	memset(db,0,sizeof(KISSDB));
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool)
+		KISSDB_pool_flush(db);
+#endif
+	KISSDB_release(db);
 }
 
-int KISSDB_get(KISSDB *db,const void *key,void *vbuf)
+/* Probes report the bucket and how many hash table pages were walked. */
+static int KISSDB_do_get(KISSDB *db,const void *key,void *vbuf,unsigned long *depth)
 {
 	uint8_t tmp[4096];
 	const uint8_t *kptr;
-	unsigned long klen,i;
+	unsigned long klen,i,n;
 	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
 	uint64_t offset;
 	uint64_t *cur_hash_table;
-	long n;
+	int r;
+
+	PROBE2(kissdb,get__hash,hash,db->num_hash_tables);
 
 	cur_hash_table = db->hash_tables;
 	for(i=0;i<db->num_hash_tables;++i) {
+		*depth = i + 1;
 		offset = cur_hash_table[hash];
 		if (offset) {
-			if (fseeko(db->f,offset,SEEK_SET))
-				return KISSDB_ERROR_IO;
-
 			kptr = (const uint8_t *)key;
 			klen = db->key_size;
 			while (klen) {
-				n = (long)fread(tmp,1,(klen > sizeof(tmp)) ? sizeof(tmp) : klen,db->f);
-				if (n > 0) {
-					if (memcmp(kptr,tmp,n))
-						goto get_no_match_next_hash_table;
-					kptr += n;
-					klen -= (unsigned long)n;
-				} else return 1; /* not found */
+				n = (klen > sizeof(tmp)) ? sizeof(tmp) : klen;
+				if ((r = KISSDB_read_at(db,offset,tmp,n)))
+					return (r < 0) ? KISSDB_ERROR_IO : 1; /* not found */
+				if (memcmp(kptr,tmp,n))
+					goto get_no_match_next_hash_table;
+				kptr += n;
+				klen -= n;
+				offset += n;
 			}
 
-			if (fread(vbuf,db->value_size,1,db->f) == 1)
+			if (KISSDB_read_at(db,offset,vbuf,db->value_size) == 0)
 				return 0; /* success */
 			else return KISSDB_ERROR_IO;
 		} else return 1; /* not found */
@@ -201,65 +673,78 @@ get_no_match_next_hash_table:
 	return 1; /* not found */
 }
 
-int KISSDB_put(KISSDB *db,const void *key,const void *value)
+int KISSDB_get(KISSDB *db,const void *key,void *vbuf)
+{
+	unsigned long depth = 0;
+	int r;
+
+	PROBE0(kissdb,get__start);
+	r = KISSDB_do_get(db,key,vbuf,&depth);
+	PROBE2(kissdb,get__done,depth,r);
+	return r;
+}
+
+static int KISSDB_snapshot_preserve(KISSDB *db,unsigned long page,uint64_t hash,uint64_t recoffset);
+
+static int KISSDB_do_put(KISSDB *db,const void *key,const void *value,unsigned long *depth)
 {
 	uint8_t tmp[4096];
+	uint8_t old[KISSDB_EXTENT_DESCRIPTOR_SIZE];
 	const uint8_t *kptr;
-	unsigned long klen,i;
+	unsigned long klen,i,n;
 	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
-	uint64_t offset;
+	uint64_t offset,recoffset;
 	uint64_t htoffset,lasthtoffset;
 	uint64_t endoffset;
 	uint64_t *cur_hash_table;
 	uint64_t *hash_tables_rea;
-	long n;
+
+	PROBE2(kissdb,put__hash,hash,db->num_hash_tables);
 
 	lasthtoffset = htoffset = KISSDB_HEADER_SIZE;
 	cur_hash_table = db->hash_tables;
 	for(i=0;i<db->num_hash_tables;++i) {
+		*depth = i + 1;
 		offset = cur_hash_table[hash];
 		if (offset) {
 			/* rewrite if already exists */
-			if (fseeko(db->f,offset,SEEK_SET))
-				return KISSDB_ERROR_IO;
-
+			recoffset = offset;
 			kptr = (const uint8_t *)key;
 			klen = db->key_size;
 			while (klen) {
-				n = (long)fread(tmp,1,(klen > sizeof(tmp)) ? sizeof(tmp) : klen,db->f);
-				if (n > 0) {
-					if (memcmp(kptr,tmp,n))
-						goto put_no_match_next_hash_table;
-					kptr += n;
-					klen -= (unsigned long)n;
-				}
+				n = (klen > sizeof(tmp)) ? sizeof(tmp) : klen;
+				if (KISSDB_read_at(db,offset,tmp,n))
+					return KISSDB_ERROR_IO;
+				if (memcmp(kptr,tmp,n))
+					goto put_no_match_next_hash_table;
+				kptr += n;
+				klen -= n;
+				offset += n;
 			}
 
-			/* C99 spec demands seek after fread(), required for Windows */
-			fseeko(db->f,0,SEEK_CUR);
- 
-			if (fwrite(value,db->value_size,1,db->f) == 1) {
-				fflush(db->f);
+			if (KISSDB_snapshot_preserve(db,i,hash,recoffset))
+				return KISSDB_ERROR_IO;
+			/* enough of the old value to tell whether it is an extent */
+			if ((db->value_size >= KISSDB_EXTENT_DESCRIPTOR_SIZE)&&(KISSDB_read_at(db,offset,old,sizeof(old))))
+				return KISSDB_ERROR_IO;
+			if (KISSDB_write_at(db,offset,value,db->value_size) == 0) {
+				KISSDB_flush_updates(db);
+				KISSDB_extent_replaced(db,old,value);
 				return 0; /* success */
 			} else return KISSDB_ERROR_IO;
 		} else {
 			/* add if an empty hash table slot is discovered */
-			if (fseeko(db->f,0,SEEK_END))
+			if (KISSDB_end_offset(db,&endoffset))
 				return KISSDB_ERROR_IO;
-			endoffset = ftello(db->f);
 
-			if (fwrite(key,db->key_size,1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-			if (fwrite(value,db->value_size,1,db->f) != 1)
+			if (KISSDB_write_record(db,endoffset,key,value))
 				return KISSDB_ERROR_IO;
 
-			if (fseeko(db->f,htoffset + (sizeof(uint64_t) * hash),SEEK_SET))
-				return KISSDB_ERROR_IO;
-			if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
+			if (KISSDB_write_at(db,htoffset + (sizeof(uint64_t) * hash),&endoffset,sizeof(uint64_t)))
 				return KISSDB_ERROR_IO;
 			cur_hash_table[hash] = endoffset;
 
-			fflush(db->f);
+			KISSDB_flush_updates(db);
 
 			return 0; /* success */
 		}
@@ -270,9 +755,9 @@ put_no_match_next_hash_table:
 	}
 
 	/* if no existing slots, add a new page of hash table entries */
-	if (fseeko(db->f,0,SEEK_END))
+	*depth = db->num_hash_tables + 1;
+	if (KISSDB_end_offset(db,&endoffset))
 		return KISSDB_ERROR_IO;
-	endoffset = ftello(db->f);
 
 	hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1));
 	if (!hash_tables_rea)
@@ -283,29 +768,36 @@ put_no_match_next_hash_table:
 
 	cur_hash_table[hash] = endoffset + db->hash_table_size_bytes; /* where new entry will go */
 
-	if (fwrite(cur_hash_table,db->hash_table_size_bytes,1,db->f) != 1)
+	if (KISSDB_write_at(db,endoffset,cur_hash_table,db->hash_table_size_bytes))
 		return KISSDB_ERROR_IO;
 
-	if (fwrite(key,db->key_size,1,db->f) != 1)
-		return KISSDB_ERROR_IO;
-	if (fwrite(value,db->value_size,1,db->f) != 1)
+	if (KISSDB_write_record(db,endoffset + db->hash_table_size_bytes,key,value))
 		return KISSDB_ERROR_IO;
 
 	if (db->num_hash_tables) {
-		if (fseeko(db->f,lasthtoffset + (sizeof(uint64_t) * db->hash_table_size),SEEK_SET))
-			return KISSDB_ERROR_IO;
-		if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
+		if (KISSDB_write_at(db,lasthtoffset + (sizeof(uint64_t) * db->hash_table_size),&endoffset,sizeof(uint64_t)))
 			return KISSDB_ERROR_IO;
 		db->hash_tables[((db->hash_table_size + 1) * (db->num_hash_tables - 1)) + db->hash_table_size] = endoffset;
 	}
 
 	++db->num_hash_tables;
 
-	fflush(db->f);
+	KISSDB_flush_updates(db);
 
 	return 0; /* success */
 }
 
+int KISSDB_put(KISSDB *db,const void *key,const void *value)
+{
+	unsigned long depth = 0;
+	int r;
+
+	PROBE0(kissdb,put__start);
+	r = KISSDB_do_put(db,key,value,&depth);
+	PROBE2(kissdb,put__done,depth,r);
+	return r;
+}
+
 void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi)
 {
 	dbi->db = db;
@@ -325,11 +817,9 @@ int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
 					return 0;
 			}
 		}
-		if (fseeko(dbi->db->f,offset,SEEK_SET))
+		if (KISSDB_read_at(dbi->db,offset,kbuf,dbi->db->key_size))
 			return KISSDB_ERROR_IO;
-		if (fread(kbuf,dbi->db->key_size,1,dbi->db->f) != 1)
-			return KISSDB_ERROR_IO;
-		if (fread(vbuf,dbi->db->value_size,1,dbi->db->f) != 1)
+		if (KISSDB_read_at(dbi->db,offset + dbi->db->key_size,vbuf,dbi->db->value_size))
 			return KISSDB_ERROR_IO;
 		if (++dbi->h_idx >= dbi->db->hash_table_size) {
 			dbi->h_idx = 0;
@@ -341,27 +831,1242 @@ int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
 	return 0;
 }
 
-#ifdef KISSDB_TEST
+/* Bulk build: entries are buffered in memory and, once they outgrow
+ * KISSDB_BUILD_RUN_BYTES, spilled to KISSDB_BUILD_PARTITIONS temporary
+ * files by key hash so that every copy of a key lands in the same run.
+ * Each run is then sorted by bucket and appended to the output. */
 
-#include <inttypes.h>
+#ifndef KISSDB_BUILD_PARTITIONS
+#define KISSDB_BUILD_PARTITIONS 64
+#endif
+#ifndef KISSDB_BUILD_RUN_BYTES
+#define KISSDB_BUILD_RUN_BYTES (64 * 1024 * 1024)
+#endif
 
-int main(int argc,char **argv)
+struct KISSDB_BuildEntry {
+	uint64_t bucket;
+	uint64_t hash;
+	unsigned long idx;
+	unsigned long key_size;
+	const uint8_t *rec;
+};
+
+struct KISSDB_Build {
+	FILE *out;
+	unsigned long hash_table_size;
+	unsigned long key_size;
+	unsigned long value_size;
+	unsigned long hash_table_size_bytes;
+	uint64_t *hash_tables;
+	unsigned long num_hash_tables;
+	uint32_t *fill;
+	uint64_t offset;
+};
+
+static int KISSDB_build_entry_cmp(const void *a,const void *b)
 {
-	uint64_t i,j;
-	uint64_t v[8];
-	KISSDB db;
-	KISSDB_Iterator dbi;
-	char got_all_values[10000];
-	int q;
+	const struct KISSDB_BuildEntry *x = (const struct KISSDB_BuildEntry *)a;
+	const struct KISSDB_BuildEntry *y = (const struct KISSDB_BuildEntry *)b;
+	int c;
 
-	printf("Opening new empty database test.db...\n");
+	if (x->bucket != y->bucket)
+		return (x->bucket < y->bucket) ? -1 : 1;
+	if (x->hash != y->hash)
+		return (x->hash < y->hash) ? -1 : 1;
+	if ((c = memcmp(x->rec,y->rec,x->key_size)))
+		return c;
+	return (x->idx < y->idx) ? -1 : ((x->idx > y->idx) ? 1 : 0);
+}
 
-	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
-		printf("KISSDB_open failed\n");
-		return 1;
+static int KISSDB_build_run(struct KISSDB_Build *b,const uint8_t *recs,unsigned long count)
+{
+	struct KISSDB_BuildEntry *e;
+	unsigned long recsize = b->key_size + b->value_size;
+	unsigned long i,j;
+	uint64_t *hash_tables_rea;
+	uint32_t page;
+
+	if (!count)
+		return 0;
+	e = malloc(sizeof(struct KISSDB_BuildEntry) * count);
+	if (!e)
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;i<count;++i) {
+		e[i].rec = recs + ((uint64_t)i * recsize);
+		e[i].hash = KISSDB_hash(e[i].rec,b->key_size);
+		e[i].bucket = e[i].hash % (uint64_t)b->hash_table_size;
+		e[i].idx = i;
+		e[i].key_size = b->key_size;
 	}
+	qsort(e,count,sizeof(struct KISSDB_BuildEntry),KISSDB_build_entry_cmp);
 
-	printf("Adding and then re-getting 10000 64-byte values...\n");
+	for(i=0;i<count;i=j+1) {
+		/* the last copy of a key carries its final value */
+		j = i;
+		while (((j + 1) < count)&&(e[j + 1].hash == e[i].hash)&&(!memcmp(e[j + 1].rec,e[i].rec,b->key_size)))
+			++j;
+
+		page = b->fill[e[j].bucket]++;
+		if (page >= b->num_hash_tables) {
+			hash_tables_rea = realloc(b->hash_tables,b->hash_table_size_bytes * (page + 1));
+			if (!hash_tables_rea) {
+				free(e);
+				return KISSDB_ERROR_MALLOC;
+			}
+			b->hash_tables = hash_tables_rea;
+			memset(((uint8_t *)b->hash_tables) + (b->hash_table_size_bytes * b->num_hash_tables),0,b->hash_table_size_bytes * ((page + 1) - b->num_hash_tables));
+			b->num_hash_tables = page + 1;
+		}
+		b->hash_tables[((b->hash_table_size + 1) * page) + e[j].bucket] = b->offset;
+
+		if (fwrite(e[j].rec,recsize,1,b->out) != 1) {
+			free(e);
+			return KISSDB_ERROR_IO;
+		}
+		b->offset += recsize;
+	}
+
+	free(e);
+	return 0;
+}
+
+int KISSDB_build(
+	const char *path,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size,
+	int (*next)(void *arg,void *kbuf,void *vbuf),
+	void *arg)
+{
+	struct KISSDB_Build b;
+	FILE *parts[KISSDB_BUILD_PARTITIONS];
+	uint8_t *run = (uint8_t *)0;
+	uint8_t *rec;
+	uint8_t tmp2[4];
+	uint64_t tmp;
+	unsigned long recsize = key_size + value_size;
+	unsigned long run_capacity,run_count = 0;
+	unsigned long long total = 0;
+	unsigned long i,p;
+	int spilled = 0;
+	int r = 0;
+
+	if ((!key_size)||(!value_size)||(!next))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	memset(&b,0,sizeof(b));
+	memset(parts,0,sizeof(parts));
+	run_capacity = KISSDB_BUILD_RUN_BYTES / recsize;
+	if (!run_capacity)
+		run_capacity = 1;
+	run = malloc((size_t)run_capacity * recsize);
+	if (!run)
+		return KISSDB_ERROR_MALLOC;
+
+	/* pass 1: read every entry, spilling to partitions once the run is full */
+	for(;;) {
+		rec = spilled ? run : run + ((uint64_t)run_count * recsize);
+		r = next(arg,rec,rec + key_size);
+		if (r <= 0)
+			break;
+		++total;
+		if (spilled) {
+			p = (unsigned long)(KISSDB_hash(rec,key_size) % KISSDB_BUILD_PARTITIONS);
+			if (fwrite(rec,recsize,1,parts[p]) != 1) { r = KISSDB_ERROR_IO; break; }
+		} else if (++run_count == run_capacity) {
+			for(p=0;p<KISSDB_BUILD_PARTITIONS;++p) {
+				if (!(parts[p] = tmpfile())) { r = KISSDB_ERROR_IO; goto build_done; }
+			}
+			for(i=0;i<run_count;++i) {
+				rec = run + ((uint64_t)i * recsize);
+				p = (unsigned long)(KISSDB_hash(rec,key_size) % KISSDB_BUILD_PARTITIONS);
+				if (fwrite(rec,recsize,1,parts[p]) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+			}
+			run_count = 0;
+			spilled = 1;
+		}
+	}
+	if (r < 0)
+		goto build_done;
+	r = 0;
+
+	/* pass 2: size the hash table and write the file front to back */
+	if (!hash_table_size)
+		hash_table_size = (total) ? (unsigned long)total : 1;
+	b.hash_table_size = hash_table_size;
+	b.key_size = key_size;
+	b.value_size = value_size;
+	b.hash_table_size_bytes = sizeof(uint64_t) * (hash_table_size + 1);
+	b.fill = calloc(hash_table_size,sizeof(uint32_t));
+	if (!b.fill) { r = KISSDB_ERROR_MALLOC; goto build_done; }
+
+	if (!(b.out = fopen(path,"w+b"))) { r = KISSDB_ERROR_IO; goto build_done; }
+	setvbuf(b.out,(char *)0,_IOFBF,1024 * 1024);
+	tmp2[0] = 'K'; tmp2[1] = 'd'; tmp2[2] = 'B'; tmp2[3] = KISSDB_VERSION;
+	if (fwrite(tmp2,4,1,b.out) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+	tmp = hash_table_size;
+	if (fwrite(&tmp,sizeof(uint64_t),1,b.out) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+	tmp = key_size;
+	if (fwrite(&tmp,sizeof(uint64_t),1,b.out) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+	tmp = value_size;
+	if (fwrite(&tmp,sizeof(uint64_t),1,b.out) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+
+	/* records go right after the first hash table page, which is filled in last */
+	b.offset = KISSDB_HEADER_SIZE + b.hash_table_size_bytes;
+	if (fseeko(b.out,b.offset,SEEK_SET)) { r = KISSDB_ERROR_IO; goto build_done; }
+
+	if (!spilled) {
+		r = KISSDB_build_run(&b,run,run_count);
+	} else {
+		free(run);
+		run = (uint8_t *)0;
+		for(p=0;(p<KISSDB_BUILD_PARTITIONS)&&(!r);++p) {
+			if (fseeko(parts[p],0,SEEK_END)) { r = KISSDB_ERROR_IO; break; }
+			run_count = (unsigned long)(ftello(parts[p]) / recsize);
+			if (!run_count)
+				continue;
+			if (!(run = malloc((size_t)run_count * recsize))) { r = KISSDB_ERROR_MALLOC; break; }
+			if (fseeko(parts[p],0,SEEK_SET)) { r = KISSDB_ERROR_IO; break; }
+			if (fread(run,recsize,run_count,parts[p]) != run_count) { r = KISSDB_ERROR_IO; break; }
+			fclose(parts[p]);
+			parts[p] = (FILE *)0;
+			r = KISSDB_build_run(&b,run,run_count);
+			free(run);
+			run = (uint8_t *)0;
+		}
+	}
+	if (r)
+		goto build_done;
+
+	if (b.num_hash_tables) {
+		/* page 0 sits after the header, pages 1.. follow the records */
+		for(i=0;i<b.num_hash_tables;++i)
+			b.hash_tables[((hash_table_size + 1) * i) + hash_table_size] = ((i + 1) < b.num_hash_tables) ? (b.offset + (b.hash_table_size_bytes * i)) : 0;
+		if (b.num_hash_tables > 1) {
+			if (fwrite(b.hash_tables + (hash_table_size + 1),b.hash_table_size_bytes,b.num_hash_tables - 1,b.out) != (b.num_hash_tables - 1)) { r = KISSDB_ERROR_IO; goto build_done; }
+		}
+		if (fseeko(b.out,KISSDB_HEADER_SIZE,SEEK_SET)) { r = KISSDB_ERROR_IO; goto build_done; }
+		if (fwrite(b.hash_tables,b.hash_table_size_bytes,1,b.out) != 1) { r = KISSDB_ERROR_IO; goto build_done; }
+	}
+	if (fflush(b.out))
+		r = KISSDB_ERROR_IO;
+
+build_done:
+	for(p=0;p<KISSDB_BUILD_PARTITIONS;++p) {
+		if (parts[p])
+			fclose(parts[p]);
+	}
+	if (b.out)
+		fclose(b.out);
+	free(b.hash_tables);
+	free(b.fill);
+	free(run);
+	return r;
+}
+
+/* Batched puts: entries are sorted by bucket like a bulk build run, new
+ * records are appended with a single write and the scattered table and
+ * value updates that remain are issued in file order, followed by one
+ * flush. Keys whose bucket is full on every page fall back to
+ * KISSDB_put(), which appends a new hash table page. */
+
+struct KISSDB_BatchWrite {
+	uint64_t offset;
+	const void *data;
+	unsigned long len;
+	uint64_t slot; /* new record offset for table updates */
+	uint64_t *entry; /* in-memory slot set to it, cleared if the batch fails */
+};
+
+static int KISSDB_batch_write_cmp(const void *a,const void *b)
+{
+	const struct KISSDB_BatchWrite *x = (const struct KISSDB_BatchWrite *)a;
+	const struct KISSDB_BatchWrite *y = (const struct KISSDB_BatchWrite *)b;
+	return (x->offset < y->offset) ? -1 : ((x->offset > y->offset) ? 1 : 0);
+}
+
+int KISSDB_put_batch(KISSDB *db,const void *entries,unsigned long count)
+{
+	struct KISSDB_BuildEntry *e = (struct KISSDB_BuildEntry *)0;
+	struct KISSDB_BatchWrite *w = (struct KISSDB_BatchWrite *)0;
+	const uint8_t **fallback = (const uint8_t **)0;
+	uint8_t *appended = (uint8_t *)0;
+	uint8_t *kbuf = (uint8_t *)0;
+	uint8_t *replaced = (uint8_t *)0;
+	const uint8_t *stored_key;
+	unsigned long recsize = db->key_size + db->value_size;
+	unsigned long i,j,k,p,nw = 0,nappended = 0,nfallback = 0,nreplaced = 0;
+	uint64_t endoffset,offset,htoffset;
+	uint64_t *cur_hash_table;
+	int r = 0,slots_written = 0;
+
+	if (!count)
+		return 0;
+	if (KISSDB_end_offset(db,&endoffset))
+		return KISSDB_ERROR_IO;
+
+	e = malloc(sizeof(struct KISSDB_BuildEntry) * count);
+	w = malloc(sizeof(struct KISSDB_BatchWrite) * count);
+	fallback = malloc(sizeof(const uint8_t *) * count);
+	appended = malloc((size_t)recsize * count);
+	kbuf = malloc(db->key_size);
+	replaced = malloc((size_t)KISSDB_EXTENT_DESCRIPTOR_SIZE * 2 * count); /* old and new value prefixes, extents freed once written */
+	if ((!e)||(!w)||(!fallback)||(!appended)||(!kbuf)||(!replaced)) {
+		r = KISSDB_ERROR_MALLOC;
+		goto put_batch_done;
+	}
+
+	for(i=0;i<count;++i) {
+		e[i].rec = ((const uint8_t *)entries) + ((uint64_t)i * recsize);
+		e[i].hash = KISSDB_hash(e[i].rec,db->key_size);
+		e[i].bucket = e[i].hash % (uint64_t)db->hash_table_size;
+		e[i].idx = i;
+		e[i].key_size = db->key_size;
+	}
+	qsort(e,count,sizeof(struct KISSDB_BuildEntry),KISSDB_build_entry_cmp);
+
+	for(i=0;i<count;i=j+1) {
+		/* the last copy of a key carries its final value */
+		j = i;
+		while (((j + 1) < count)&&(e[j + 1].hash == e[i].hash)&&(!memcmp(e[j + 1].rec,e[i].rec,db->key_size)))
+			++j;
+		if (db->value_size >= KISSDB_EXTENT_DESCRIPTOR_SIZE) {
+			for(k=i;k<j;++k) {
+				memcpy(replaced + ((uint64_t)nreplaced * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2),e[k].rec + db->key_size,KISSDB_EXTENT_DESCRIPTOR_SIZE);
+				memcpy(replaced + ((uint64_t)nreplaced * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2) + KISSDB_EXTENT_DESCRIPTOR_SIZE,e[j].rec + db->key_size,KISSDB_EXTENT_DESCRIPTOR_SIZE);
+				++nreplaced;
+			}
+		}
+
+		htoffset = KISSDB_HEADER_SIZE;
+		cur_hash_table = db->hash_tables;
+		for(p=0;p<db->num_hash_tables;++p) {
+			offset = cur_hash_table[e[j].bucket];
+			if (!offset) {
+				/* empty slot: append the record and point the slot at it */
+				offset = endoffset + ((uint64_t)nappended * recsize);
+				memcpy(appended + ((uint64_t)nappended * recsize),e[j].rec,recsize);
+				++nappended;
+				cur_hash_table[e[j].bucket] = offset;
+				w[nw].offset = htoffset + (sizeof(uint64_t) * e[j].bucket);
+				w[nw].data = (const void *)0;
+				w[nw].len = sizeof(uint64_t);
+				w[nw].slot = offset;
+				w[nw].entry = &(cur_hash_table[e[j].bucket]);
+				++nw;
+				break;
+			}
+
+			if (offset >= endoffset) {
+				stored_key = appended + (offset - endoffset); /* appended earlier in this batch */
+			} else {
+				if (KISSDB_read_at(db,offset,kbuf,db->key_size)) { r = KISSDB_ERROR_IO; goto put_batch_done; }
+				stored_key = kbuf;
+			}
+			if (!memcmp(stored_key,e[j].rec,db->key_size)) {
+				if (offset >= endoffset) {
+					/* cannot happen after de-duplication, but stay correct */
+					memcpy(appended + (offset - endoffset) + db->key_size,e[j].rec + db->key_size,db->value_size);
+				} else {
+					if (KISSDB_snapshot_preserve(db,p,e[j].bucket,offset)) { r = KISSDB_ERROR_IO; goto put_batch_done; }
+					if (db->value_size >= KISSDB_EXTENT_DESCRIPTOR_SIZE) {
+						if (KISSDB_read_at(db,offset + db->key_size,replaced + ((uint64_t)nreplaced * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2),KISSDB_EXTENT_DESCRIPTOR_SIZE)) { r = KISSDB_ERROR_IO; goto put_batch_done; }
+						memcpy(replaced + ((uint64_t)nreplaced * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2) + KISSDB_EXTENT_DESCRIPTOR_SIZE,e[j].rec + db->key_size,KISSDB_EXTENT_DESCRIPTOR_SIZE);
+						++nreplaced;
+					}
+					w[nw].offset = offset + db->key_size;
+					w[nw].data = e[j].rec + db->key_size;
+					w[nw].len = db->value_size;
+					w[nw].slot = 0;
+					w[nw].entry = (uint64_t *)0;
+					++nw;
+				}
+				break;
+			}
+
+			htoffset = cur_hash_table[db->hash_table_size];
+			cur_hash_table += (db->hash_table_size + 1);
+		}
+		if (p == db->num_hash_tables)
+			fallback[nfallback++] = e[j].rec;
+	}
+
+	/* records first, then the slots that point at them */
+	if ((nappended)&&(KISSDB_write_at(db,endoffset,appended,recsize * nappended))) {
+		r = KISSDB_ERROR_IO;
+		goto put_batch_done;
+	}
+	qsort(w,nw,sizeof(struct KISSDB_BatchWrite),KISSDB_batch_write_cmp);
+	for(i=0;i<nw;++i) {
+		if (KISSDB_write_at(db,w[i].offset,(w[i].data) ? w[i].data : (const void *)&(w[i].slot),w[i].len)) {
+			r = KISSDB_ERROR_IO;
+			goto put_batch_done;
+		}
+	}
+	slots_written = 1;
+	for(i=0;i<nfallback;++i) {
+		if ((r = KISSDB_put(db,fallback[i],fallback[i] + db->key_size)))
+			goto put_batch_done;
+	}
+	KISSDB_flush_updates(db);
+	for(i=0;i<nreplaced;++i)
+		KISSDB_extent_replaced(db,replaced + ((uint64_t)i * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2),replaced + ((uint64_t)i * KISSDB_EXTENT_DESCRIPTOR_SIZE * 2) + KISSDB_EXTENT_DESCRIPTOR_SIZE);
+
+put_batch_done:
+	if ((r)&&(!slots_written)) {
+		/* the slots claimed for appended records may point past what was written */
+		for(i=0;i<nw;++i) {
+			if (w[i].entry)
+				*(w[i].entry) = 0;
+		}
+	}
+	free(e);
+	free(w);
+	free(fallback);
+	free(appended);
+	free(kbuf);
+	free(replaced);
+	return r;
+}
+
+/* Extents are whole blocks, reused from a free list or else reserved at
+ * the end of the file, and written and read with positioned I/O on the
+ * descriptor, so neither disturbs the stdio stream of the thread that
+ * owns db->f. Nothing in an extent is ever read back through that stream,
+ * so its buffer never holds stale extent bytes. In O_DIRECT mode they go
+ * through a second descriptor without O_DIRECT rather than the buffer
+ * pool, so a large value does not evict the hash tables.
+ *
+ * A freed extent first waits on the pending list, stamped with the epoch
+ * it was freed in. Every hold records the epoch it was taken in, and a
+ * pending extent moves to the free list once it is older than the oldest
+ * hold: any reader that could still see it has finished by then. */
+
+static const uint8_t KISSDB_EXTENT_MAGIC[8] = { 0,'K','d','B','x','t','n','t' };
+
+#ifdef KISSDB_HAVE_EXTENTS
+
+#define KISSDB_ROUND_UP(n) ((((n) + KISSDB_BLOCK_SIZE - 1) / KISSDB_BLOCK_SIZE) * KISSDB_BLOCK_SIZE)
+
+struct KISSDB_Range {
+	uint64_t offset;
+	uint64_t length;
+	uint64_t epoch; /* pending ranges only */
+};
+
+struct KISSDB_Hold {
+	uint64_t epoch;
+	unsigned long count;
+};
+
+struct KISSDB_ExtentSpace {
+	pthread_mutex_t lock;
+	struct KISSDB_Range *free_ranges; /* sorted by offset, coalesced */
+	unsigned long num_free,cap_free;
+	struct KISSDB_Range *pending; /* freed, maybe still read */
+	unsigned long num_pending,cap_pending;
+	struct KISSDB_Hold *holds; /* oldest first */
+	unsigned long num_holds,cap_holds;
+	uint64_t epoch;
+	unsigned long untracked; /* holds we had no memory to record: reuse nothing */
+	int scanned;
+};
+
+static int KISSDB_extent_space_create(KISSDB *db)
+{
+	db->extents = calloc(1,sizeof(struct KISSDB_ExtentSpace));
+	if (!db->extents)
+		return KISSDB_ERROR_MALLOC;
+	pthread_mutex_init(&db->extents->lock,NULL);
+	return 0;
+}
+
+static void KISSDB_extent_space_free(KISSDB *db)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+
+	if (!x)
+		return;
+	pthread_mutex_destroy(&x->lock);
+	free(x->free_ranges);
+	free(x->pending);
+	free(x->holds);
+	free(x);
+	db->extents = (struct KISSDB_ExtentSpace *)0;
+}
+
+/* Grow an array of ranges to hold one more. */
+static int KISSDB_range_reserve(struct KISSDB_Range **a,unsigned long num,unsigned long *cap)
+{
+	struct KISSDB_Range *n;
+
+	if (num < *cap)
+		return 0;
+	n = realloc(*a,sizeof(struct KISSDB_Range) * ((*cap) ? (*cap * 2) : 16));
+	if (!n)
+		return KISSDB_ERROR_MALLOC;
+	*a = n;
+	*cap = (*cap) ? (*cap * 2) : 16;
+	return 0;
+}
+
+/* Add a range to the free list, merging it with its neighbours. Called
+ * with the lock held; on malloc failure the range is simply lost until
+ * the next open. */
+static void KISSDB_free_insert(struct KISSDB_ExtentSpace *x,uint64_t offset,uint64_t length)
+{
+	unsigned long lo = 0,hi = x->num_free,mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (x->free_ranges[mid].offset < offset)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	if ((lo)&&((x->free_ranges[lo - 1].offset + x->free_ranges[lo - 1].length) == offset)) {
+		x->free_ranges[lo - 1].length += length;
+		if ((lo < x->num_free)&&((offset + length) == x->free_ranges[lo].offset)) {
+			x->free_ranges[lo - 1].length += x->free_ranges[lo].length;
+			memmove(x->free_ranges + lo,x->free_ranges + lo + 1,sizeof(struct KISSDB_Range) * (x->num_free - lo - 1));
+			--x->num_free;
+		}
+		return;
+	}
+	if ((lo < x->num_free)&&((offset + length) == x->free_ranges[lo].offset)) {
+		x->free_ranges[lo].offset = offset;
+		x->free_ranges[lo].length += length;
+		return;
+	}
+	if (KISSDB_range_reserve(&(x->free_ranges),x->num_free,&(x->cap_free)))
+		return;
+	memmove(x->free_ranges + lo + 1,x->free_ranges + lo,sizeof(struct KISSDB_Range) * (x->num_free - lo));
+	x->free_ranges[lo].offset = offset;
+	x->free_ranges[lo].length = length;
+	x->free_ranges[lo].epoch = 0;
+	++x->num_free;
+}
+
+/* Move pending ranges no hold can see any more to the free list. Called
+ * with the lock held. */
+static void KISSDB_extent_promote(struct KISSDB_ExtentSpace *x)
+{
+	unsigned long i,kept = 0;
+
+	if (x->untracked)
+		return;
+	for(i=0;i<x->num_pending;++i) {
+		if ((!x->num_holds)||(x->pending[i].epoch < x->holds[0].epoch))
+			KISSDB_free_insert(x,x->pending[i].offset,x->pending[i].length);
+		else x->pending[kept++] = x->pending[i];
+	}
+	x->num_pending = kept;
+}
+
+static int KISSDB_range_cmp(const void *a,const void *b)
+{
+	const struct KISSDB_Range *x = (const struct KISSDB_Range *)a;
+	const struct KISSDB_Range *y = (const struct KISSDB_Range *)b;
+	return (x->offset < y->offset) ? -1 : ((x->offset > y->offset) ? 1 : 0);
+}
+
+/* Find the free space of a file opened in this session: every whole
+ * block that is not in the header, a hash table, a record or an extent
+ * some record refers to. Extents nothing refers to, such as those of an
+ * upload that was cut off, are reclaimed here. */
+static int KISSDB_extent_scan(KISSDB *db)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+	struct KISSDB_Range *used = (struct KISSDB_Range *)0;
+	unsigned long num = 0,cap = 0,p,i;
+	uint8_t desc[KISSDB_EXTENT_DESCRIPTOR_SIZE];
+	uint64_t *cur_hash_table = db->hash_tables;
+	uint64_t htoffset = KISSDB_HEADER_SIZE;
+	uint64_t endoffset,at,start,stop;
+	KISSDB_Extent e;
+	int r = 0;
+
+	if (KISSDB_end_offset(db,&endoffset))
+		return KISSDB_ERROR_IO;
+
+#define KISSDB_SCAN_ADD(o,l) do { \
+		if ((r = KISSDB_range_reserve(&used,num,&cap))) goto extent_scan_done; \
+		used[num].offset = (o); used[num].length = (l); used[num].epoch = 0; ++num; \
+	} while (0)
+
+	KISSDB_SCAN_ADD(0,KISSDB_HEADER_SIZE);
+	for(p=0;p<db->num_hash_tables;++p) {
+		KISSDB_SCAN_ADD(htoffset,db->hash_table_size_bytes);
+		for(i=0;i<db->hash_table_size;++i) {
+			if (!cur_hash_table[i])
+				continue;
+			KISSDB_SCAN_ADD(cur_hash_table[i],db->key_size + db->value_size);
+			if (db->value_size < KISSDB_EXTENT_DESCRIPTOR_SIZE)
+				continue;
+			if (KISSDB_read_at(db,cur_hash_table[i] + db->key_size,desc,sizeof(desc))) {
+				r = KISSDB_ERROR_IO;
+				goto extent_scan_done;
+			}
+			if (KISSDB_extent_decode(db,desc,&e))
+				KISSDB_SCAN_ADD(e.offset,KISSDB_ROUND_UP(e.length));
+		}
+		htoffset = cur_hash_table[db->hash_table_size];
+		cur_hash_table += (db->hash_table_size + 1);
+	}
+
+	pthread_mutex_lock(&x->lock);
+	for(i=0;i<(x->num_pending + x->num_free);++i) {
+		if (KISSDB_range_reserve(&used,num,&cap)) {
+			pthread_mutex_unlock(&x->lock);
+			r = KISSDB_ERROR_MALLOC;
+			goto extent_scan_done;
+		}
+		used[num++] = (i < x->num_pending) ? x->pending[i] : x->free_ranges[i - x->num_pending];
+	}
+	qsort(used,num,sizeof(struct KISSDB_Range),KISSDB_range_cmp);
+	for(at=0,i=0;i<=num;++i) {
+		stop = (i < num) ? used[i].offset : endoffset;
+		if (stop > endoffset)
+			stop = endoffset;
+		start = KISSDB_ROUND_UP(at);
+		stop -= stop % KISSDB_BLOCK_SIZE;
+		if (stop > start)
+			KISSDB_free_insert(x,start,stop - start);
+		if ((i < num)&&((used[i].offset + used[i].length) > at))
+			at = used[i].offset + used[i].length;
+	}
+	x->scanned = 1;
+	pthread_mutex_unlock(&x->lock);
+
+#undef KISSDB_SCAN_ADD
+
+extent_scan_done:
+	free(used);
+	return r;
+}
+
+static int KISSDB_extent_fd(KISSDB *db)
+{
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool)
+		return db->pool->extent_fd;
+#endif
+	return fileno(db->f);
+}
+
+#ifdef KISSDB_HAVE_DIRECT
+/* Drop whatever the pool still caches of a reused range; its blocks may
+ * have held records that no slot ever pointed at. */
+static void KISSDB_pool_discard(KISSDB *db,uint64_t offset,uint64_t length)
+{
+	struct KISSDB_BufferPool *p = db->pool;
+	uint64_t block;
+	long f;
+
+	pthread_mutex_lock(&p->lock);
+	for(block=offset/KISSDB_BLOCK_SIZE;block<((offset + length)/KISSDB_BLOCK_SIZE);++block) {
+		f = p->buckets[block % p->num_frames];
+		while ((f >= 0)&&(p->frames[f].block != block))
+			f = p->frames[f].next;
+		if ((f >= 0)&&(!p->frames[f].pins)) {
+			p->frames[f].dirty = 0;
+			KISSDB_pool_unlink(p,f);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+#endif
+
+/* Reads that may run alongside the thread that owns db->f: the snapshot
+ * copier. */
+static int KISSDB_read_shared(KISSDB *db,uint64_t offset,void *buf,unsigned long len)
+{
+	uint8_t *out = (uint8_t *)buf;
+	ssize_t n;
+
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool)
+		return KISSDB_pool_read(db,offset,buf,len);
+#endif
+	while (len) {
+		n = pread(fileno(db->f),out,len,(off_t)offset);
+		if (n <= 0)
+			return KISSDB_ERROR_IO;
+		out += n;
+		offset += (uint64_t)n;
+		len -= (unsigned long)n;
+	}
+	return 0;
+}
+
+int KISSDB_extent_alloc(KISSDB *db,uint64_t length,KISSDB_Extent *e)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+	uint64_t span = KISSDB_ROUND_UP(length);
+	uint64_t endoffset;
+	uint64_t *first;
+	unsigned long i;
+	int r;
+
+	if (!length)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	/* the first hash table page must directly follow the header */
+	if (!db->num_hash_tables) {
+		if (!(first = calloc(1,db->hash_table_size_bytes)))
+			return KISSDB_ERROR_MALLOC;
+		if (KISSDB_write_at(db,KISSDB_HEADER_SIZE,first,db->hash_table_size_bytes)) {
+			free(first);
+			return KISSDB_ERROR_IO;
+		}
+		db->hash_tables = first;
+		db->num_hash_tables = 1;
+		KISSDB_flush_updates(db);
+	}
+	if ((!x->scanned)&&((r = KISSDB_extent_scan(db))))
+		return r;
+
+	e->length = length;
+	pthread_mutex_lock(&x->lock);
+	KISSDB_extent_promote(x);
+	for(i=0;i<x->num_free;++i) {
+		if (x->free_ranges[i].length >= span) {
+			e->offset = x->free_ranges[i].offset;
+			x->free_ranges[i].offset += span;
+			x->free_ranges[i].length -= span;
+			if (!x->free_ranges[i].length) {
+				memmove(x->free_ranges + i,x->free_ranges + i + 1,sizeof(struct KISSDB_Range) * (x->num_free - i - 1));
+				--x->num_free;
+			}
+			pthread_mutex_unlock(&x->lock);
+#ifdef KISSDB_HAVE_DIRECT
+			if (db->pool)
+				KISSDB_pool_discard(db,e->offset,span);
+#endif
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+
+#ifdef KISSDB_HAVE_DIRECT
+	if (db->pool) {
+		pthread_mutex_lock(&db->pool->lock);
+		e->offset = KISSDB_ROUND_UP(db->file_size);
+		db->file_size = e->offset + span;
+		pthread_mutex_unlock(&db->pool->lock);
+		return 0;
+	}
+#endif
+	if (KISSDB_end_offset(db,&endoffset))
+		return KISSDB_ERROR_IO;
+	e->offset = KISSDB_ROUND_UP(endoffset);
+	if ((fflush(db->f))||(ftruncate(fileno(db->f),(off_t)(e->offset + span))))
+		return KISSDB_ERROR_IO;
+	return 0;
+}
+
+void KISSDB_extent_free(KISSDB *db,const KISSDB_Extent *e)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+	uint64_t span = KISSDB_ROUND_UP(e->length);
+	const struct KISSDB_Range *r;
+	unsigned long i;
+
+	if ((!span)||(e->offset % KISSDB_BLOCK_SIZE))
+		return;
+	pthread_mutex_lock(&x->lock);
+	/* a range freed twice must not be handed out twice */
+	for(i=0;i<(x->num_pending + x->num_free);++i) {
+		r = (i < x->num_pending) ? &(x->pending[i]) : &(x->free_ranges[i - x->num_pending]);
+		if ((e->offset < (r->offset + r->length))&&(r->offset < (e->offset + span)))
+			goto extent_free_done;
+	}
+	if (KISSDB_range_reserve(&(x->pending),x->num_pending,&(x->cap_pending)))
+		goto extent_free_done;
+	x->pending[x->num_pending].offset = e->offset;
+	x->pending[x->num_pending].length = span;
+	x->pending[x->num_pending].epoch = x->epoch++;
+	++x->num_pending;
+extent_free_done:
+	pthread_mutex_unlock(&x->lock);
+}
+
+uint64_t KISSDB_extent_hold(KISSDB *db)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+	struct KISSDB_Hold *n;
+	uint64_t ticket;
+
+	pthread_mutex_lock(&x->lock);
+	ticket = x->epoch;
+	if ((x->num_holds)&&(x->holds[x->num_holds - 1].epoch == ticket)) {
+		++x->holds[x->num_holds - 1].count;
+	} else {
+		if (x->num_holds == x->cap_holds) {
+			n = realloc(x->holds,sizeof(struct KISSDB_Hold) * ((x->cap_holds) ? (x->cap_holds * 2) : 16));
+			if (!n) {
+				++x->untracked;
+				pthread_mutex_unlock(&x->lock);
+				return (uint64_t)-1;
+			}
+			x->holds = n;
+			x->cap_holds = (x->cap_holds) ? (x->cap_holds * 2) : 16;
+		}
+		x->holds[x->num_holds].epoch = ticket;
+		x->holds[x->num_holds].count = 1;
+		++x->num_holds;
+	}
+	pthread_mutex_unlock(&x->lock);
+	return ticket;
+}
+
+void KISSDB_extent_release(KISSDB *db,uint64_t ticket)
+{
+	struct KISSDB_ExtentSpace *x = db->extents;
+	unsigned long i;
+
+	pthread_mutex_lock(&x->lock);
+	if (ticket == (uint64_t)-1) {
+		--x->untracked;
+	} else {
+		for(i=0;i<x->num_holds;++i) {
+			if (x->holds[i].epoch == ticket) {
+				if (!--x->holds[i].count) {
+					memmove(x->holds + i,x->holds + i + 1,sizeof(struct KISSDB_Hold) * (x->num_holds - i - 1));
+					--x->num_holds;
+				}
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+}
+
+int KISSDB_extent_write(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,const void *buf,unsigned long len)
+{
+	const uint8_t *in = (const uint8_t *)buf;
+	uint64_t offset = e->offset + pos;
+	int fd = KISSDB_extent_fd(db);
+	ssize_t n;
+
+	if ((pos > e->length)||(len > (e->length - pos)))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	PROBE2(kissdb,write,offset,len);
+	while (len) {
+		n = pwrite(fd,in,len,(off_t)offset);
+		if (n <= 0)
+			return KISSDB_ERROR_IO;
+		in += n;
+		offset += (uint64_t)n;
+		len -= (unsigned long)n;
+	}
+	return 0;
+}
+
+int KISSDB_extent_read(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,void *buf,unsigned long len)
+{
+	uint8_t *out = (uint8_t *)buf;
+	uint64_t offset = e->offset + pos;
+	int fd = KISSDB_extent_fd(db);
+	ssize_t n;
+
+	if ((pos > e->length)||(len > (e->length - pos)))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	PROBE2(kissdb,read,offset,len);
+	while (len) {
+		n = pread(fd,out,len,(off_t)offset);
+		if (n <= 0)
+			return KISSDB_ERROR_IO;
+		out += n;
+		offset += (uint64_t)n;
+		len -= (unsigned long)n;
+	}
+	return 0;
+}
+
+#else /* !KISSDB_HAVE_EXTENTS */
+
+static int KISSDB_extent_space_create(KISSDB *db) { return 0; }
+static void KISSDB_extent_space_free(KISSDB *db) {}
+int KISSDB_extent_alloc(KISSDB *db,uint64_t length,KISSDB_Extent *e) { return KISSDB_ERROR_INVALID_PARAMETERS; }
+void KISSDB_extent_free(KISSDB *db,const KISSDB_Extent *e) {}
+uint64_t KISSDB_extent_hold(KISSDB *db) { return 0; }
+void KISSDB_extent_release(KISSDB *db,uint64_t ticket) {}
+int KISSDB_extent_write(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,const void *buf,unsigned long len) { return KISSDB_ERROR_INVALID_PARAMETERS; }
+int KISSDB_extent_read(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,void *buf,unsigned long len) { return KISSDB_ERROR_INVALID_PARAMETERS; }
+
+#endif /* KISSDB_HAVE_EXTENTS */
+
+int KISSDB_extent_encode(KISSDB *db,const KISSDB_Extent *e,void *vbuf)
+{
+	uint8_t *v = (uint8_t *)vbuf;
+
+	if (db->value_size < KISSDB_EXTENT_DESCRIPTOR_SIZE)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	memset(v,0,db->value_size);
+	memcpy(v,KISSDB_EXTENT_MAGIC,sizeof(KISSDB_EXTENT_MAGIC));
+	memcpy(v + 8,&(e->offset),sizeof(uint64_t));
+	memcpy(v + 16,&(e->length),sizeof(uint64_t));
+	return 0;
+}
+
+int KISSDB_extent_decode(KISSDB *db,const void *vbuf,KISSDB_Extent *e)
+{
+	const uint8_t *v = (const uint8_t *)vbuf;
+
+	if ((db->value_size < KISSDB_EXTENT_DESCRIPTOR_SIZE)||(memcmp(v,KISSDB_EXTENT_MAGIC,sizeof(KISSDB_EXTENT_MAGIC))))
+		return 0;
+	memcpy(&(e->offset),v + 8,sizeof(uint64_t));
+	memcpy(&(e->length),v + 16,sizeof(uint64_t));
+	return 1;
+}
+
+/* Free the extent of a value that was just overwritten, unless the new
+ * value refers to the same one. */
+static void KISSDB_extent_replaced(KISSDB *db,const void *oldv,const void *newv)
+{
+	KISSDB_Extent o,n;
+
+	if ((KISSDB_extent_decode(db,oldv,&o))&&((!KISSDB_extent_decode(db,newv,&n))||(n.offset != o.offset)))
+		KISSDB_extent_free(db,&o);
+}
+
+/* Snapshots: the hash tables are copied at the epoch and the copier walks
+ * that copy slot by slot. Records added afterwards are simply not in the
+ * copy; the only thing KISSDB_put() changes in place is the value of an
+ * existing record, so the old value is saved the first time a slot the
+ * copier has not reached yet is overwritten. */
+
+#ifdef KISSDB_HAVE_SNAPSHOT
+
+#define KISSDB_SNAPSHOT_BUCKETS 1024
+#define KISSDB_SNAPSHOT_EXTENT_CHUNK (16 * KISSDB_BLOCK_SIZE)
+
+struct KISSDB_Preserved {
+	uint64_t slot;
+	struct KISSDB_Preserved *next;
+	uint8_t value[1];
+};
+
+struct KISSDB_Snapshot {
+	pthread_mutex_t lock;
+	uint64_t *hash_tables;
+	unsigned long num_hash_tables;
+	uint64_t cursor; /* slots below this have been copied out */
+	uint64_t hold; /* keeps the extents of the epoch from being reused */
+	unsigned long preserved_count;
+	struct KISSDB_Preserved *preserved[KISSDB_SNAPSHOT_BUCKETS];
+};
+
+struct KISSDB_SnapshotCopy {
+	KISSDB *db;
+	uint64_t slot;
+	int error;
+};
+
+static void KISSDB_snapshot_free(KISSDB *db)
+{
+	struct KISSDB_Snapshot *s = db->snapshot;
+	struct KISSDB_Preserved *p;
+	unsigned long b;
+
+	if (!s)
+		return;
+	for(b=0;b<KISSDB_SNAPSHOT_BUCKETS;++b) {
+		while ((p = s->preserved[b])) {
+			s->preserved[b] = p->next;
+			free(p);
+		}
+	}
+	KISSDB_extent_release(db,s->hold);
+	pthread_mutex_destroy(&s->lock);
+	free(s->hash_tables);
+	free(s);
+	db->snapshot = (struct KISSDB_Snapshot *)0;
+}
+
+static int KISSDB_snapshot_preserve(KISSDB *db,unsigned long page,uint64_t hash,uint64_t recoffset)
+{
+	struct KISSDB_Snapshot *s = db->snapshot;
+	struct KISSDB_Preserved *p;
+	uint64_t slot;
+	int r = 0;
+
+	if (!s)
+		return 0;
+	if ((page >= s->num_hash_tables)||(s->hash_tables[((db->hash_table_size + 1) * page) + hash] != recoffset))
+		return 0; /* added after the epoch */
+
+	slot = ((uint64_t)page * db->hash_table_size) + hash;
+	pthread_mutex_lock(&s->lock);
+	if (slot >= s->cursor) {
+		for(p=s->preserved[slot % KISSDB_SNAPSHOT_BUCKETS];p;p=p->next) {
+			if (p->slot == slot)
+				break;
+		}
+		if (!p) {
+			p = malloc(sizeof(struct KISSDB_Preserved) + db->value_size);
+			if (!p)
+				r = KISSDB_ERROR_MALLOC;
+			else if (KISSDB_read_at(db,recoffset + db->key_size,p->value,db->value_size)) {
+				free(p);
+				r = KISSDB_ERROR_IO;
+			} else {
+				p->slot = slot;
+				p->next = s->preserved[slot % KISSDB_SNAPSHOT_BUCKETS];
+				s->preserved[slot % KISSDB_SNAPSHOT_BUCKETS] = p;
+				++s->preserved_count;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+static int KISSDB_snapshot_next(void *arg,void *kbuf,void *vbuf)
+{
+	struct KISSDB_SnapshotCopy *c = (struct KISSDB_SnapshotCopy *)arg;
+	KISSDB *db = c->db;
+	struct KISSDB_Snapshot *s = db->snapshot;
+	struct KISSDB_Preserved **link,*p;
+	uint64_t total = (uint64_t)s->num_hash_tables * db->hash_table_size;
+	uint64_t offset;
+
+	for(;c->slot<total;++c->slot) {
+		offset = s->hash_tables[((db->hash_table_size + 1) * (c->slot / db->hash_table_size)) + (c->slot % db->hash_table_size)];
+		if (!offset)
+			continue;
+
+		pthread_mutex_lock(&s->lock);
+		for(link=&(s->preserved[c->slot % KISSDB_SNAPSHOT_BUCKETS]);(*link)&&((*link)->slot != c->slot);link=&((*link)->next));
+		if ((p = *link)) {
+			*link = p->next;
+			--s->preserved_count;
+			memcpy(vbuf,p->value,db->value_size);
+			free(p);
+			c->error = KISSDB_read_shared(db,offset,kbuf,db->key_size);
+		} else {
+			c->error = KISSDB_read_shared(db,offset,kbuf,db->key_size);
+			if (!c->error)
+				c->error = KISSDB_read_shared(db,offset + db->key_size,vbuf,db->value_size);
+		}
+		s->cursor = ++c->slot;
+		pthread_mutex_unlock(&s->lock);
+
+		return (c->error) ? c->error : 1;
+	}
+	return 0;
+}
+
+int KISSDB_snapshot_begin(KISSDB *db)
+{
+	struct KISSDB_Snapshot *s;
+
+	if (db->snapshot)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	s = calloc(1,sizeof(struct KISSDB_Snapshot));
+	if (!s)
+		return KISSDB_ERROR_MALLOC;
+	if (db->num_hash_tables) {
+		s->hash_tables = malloc(db->hash_table_size_bytes * db->num_hash_tables);
+		if (!s->hash_tables) {
+			free(s);
+			return KISSDB_ERROR_MALLOC;
+		}
+		memcpy(s->hash_tables,db->hash_tables,db->hash_table_size_bytes * db->num_hash_tables);
+	}
+	s->num_hash_tables = db->num_hash_tables;
+	s->hold = KISSDB_extent_hold(db);
+	pthread_mutex_init(&s->lock,NULL);
+
+	/* make in-place updates made so far visible to the copier's pread() */
+	KISSDB_flush_updates(db);
+
+	db->snapshot = s;
+	return 0;
+}
+
+/* The records copied by KISSDB_build() still point at extents of the
+ * original file. Copy each one to the end of the new file and point its
+ * record at the copy; extents are never changed, so this needs no lock.
+ * Pointing a record at its copy "frees" the original's range in the new
+ * file, so a hold on it keeps those ranges out of use until we are done. */
+static int KISSDB_snapshot_copy_extents(KISSDB *db,const char *path)
+{
+	KISSDB out;
+	KISSDB_Iterator dbi;
+	KISSDB_Extent e,copy;
+	uint8_t *kbuf,*vbuf,*chunk;
+	uint64_t pos,hold;
+	unsigned long n;
+	int r;
+
+	if ((r = KISSDB_open(&out,path,KISSDB_OPEN_MODE_RDWR,0,0,0)))
+		return r;
+	hold = KISSDB_extent_hold(&out);
+	kbuf = malloc(out.key_size);
+	vbuf = malloc(out.value_size);
+	chunk = malloc(KISSDB_SNAPSHOT_EXTENT_CHUNK);
+	if ((!kbuf)||(!vbuf)||(!chunk)) {
+		r = KISSDB_ERROR_MALLOC;
+		goto copy_extents_done;
+	}
+
+	KISSDB_Iterator_init(&out,&dbi);
+	while ((r = KISSDB_Iterator_next(&dbi,kbuf,vbuf)) > 0) {
+		if (!KISSDB_extent_decode(&out,vbuf,&e))
+			continue;
+		if ((r = KISSDB_extent_alloc(&out,e.length,&copy)))
+			goto copy_extents_done;
+		for(pos=0;pos<e.length;pos+=n) {
+			n = ((e.length - pos) > KISSDB_SNAPSHOT_EXTENT_CHUNK) ? KISSDB_SNAPSHOT_EXTENT_CHUNK : (unsigned long)(e.length - pos);
+			if ((r = KISSDB_extent_read(db,&e,pos,chunk,n)))
+				goto copy_extents_done;
+			if ((r = KISSDB_extent_write(&out,&copy,pos,chunk,n)))
+				goto copy_extents_done;
+		}
+		KISSDB_extent_encode(&out,&copy,vbuf);
+		/* overwrites in place, so the iterator is not disturbed */
+		if ((r = KISSDB_put(&out,kbuf,vbuf)))
+			goto copy_extents_done;
+	}
+	if (!r)
+		r = KISSDB_sync(&out);
+
+copy_extents_done:
+	free(kbuf);
+	free(vbuf);
+	free(chunk);
+	KISSDB_extent_release(&out,hold);
+	KISSDB_close(&out);
+	return r;
+}
+
+int KISSDB_snapshot_write(KISSDB *db,const char *path)
+{
+	struct KISSDB_SnapshotCopy c;
+	int r;
+
+	if (!db->snapshot)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	c.db = db;
+	c.slot = 0;
+	c.error = 0;
+	r = KISSDB_build(path,db->hash_table_size,db->key_size,db->value_size,KISSDB_snapshot_next,&c);
+	if (c.error)
+		return c.error;
+	if ((!r)&&(db->value_size >= KISSDB_EXTENT_DESCRIPTOR_SIZE))
+		r = KISSDB_snapshot_copy_extents(db,path);
+	return r;
+}
+
+void KISSDB_snapshot_end(KISSDB *db)
+{
+	KISSDB_snapshot_free(db);
+}
+
+#else /* !KISSDB_HAVE_SNAPSHOT */
+
+static void KISSDB_snapshot_free(KISSDB *db) {}
+static int KISSDB_snapshot_preserve(KISSDB *db,unsigned long page,uint64_t hash,uint64_t recoffset) { return 0; }
+int KISSDB_snapshot_begin(KISSDB *db) { return KISSDB_ERROR_INVALID_PARAMETERS; }
+int KISSDB_snapshot_write(KISSDB *db,const char *path) { return KISSDB_ERROR_INVALID_PARAMETERS; }
+void KISSDB_snapshot_end(KISSDB *db) {}
+
+#endif /* KISSDB_HAVE_SNAPSHOT */
+
+#ifdef KISSDB_TEST
+
+#include <inttypes.h>
+
+/* Yields keys 0..19999 where keys >= 10000 repeat keys 0..9999 with new values. */
+static int build_test_next(void *arg,void *kbuf,void *vbuf)
+{
+	uint64_t *n = (uint64_t *)arg;
+	uint64_t k,j;
+
+	if (*n >= 20000)
+		return 0;
+	k = *n % 10000;
+	memcpy(kbuf,&k,sizeof(k));
+	for(j=0;j<8;++j)
+		((uint64_t *)vbuf)[j] = *n;
+	++*n;
+	return 1;
+}
+
+/* Byte pos of the value stored by extent_test_put() with seed 'seed'. */
+static uint8_t extent_test_byte(uint64_t pos,uint64_t seed)
+{
+	return (uint8_t)((pos * 7) + (pos >> 10) + seed);
+}
+
+/* Stores a value of 'length' bytes under key 'k' in an extent, 4000 bytes at a time. */
+static int extent_test_put(KISSDB *db,uint64_t k,uint64_t length,uint64_t seed)
+{
+	static uint8_t piece[4000];
+	uint8_t vbuf[64];
+	KISSDB_Extent e;
+	uint64_t pos;
+	unsigned long n,i;
+
+	if (KISSDB_extent_alloc(db,length,&e))
+		return 1;
+	for(pos=0;pos<length;pos+=n) {
+		n = ((length - pos) > sizeof(piece)) ? sizeof(piece) : (unsigned long)(length - pos);
+		for(i=0;i<n;++i)
+			piece[i] = extent_test_byte(pos + i,seed);
+		if (KISSDB_extent_write(db,&e,pos,piece,n))
+			return 1;
+	}
+	if (KISSDB_extent_encode(db,&e,vbuf))
+		return 1;
+	return KISSDB_put(db,&k,vbuf);
+}
+
+/* Checks the value stored by extent_test_put(). */
+static int extent_test_check(KISSDB *db,KISSDB *data,uint64_t k,uint64_t length,uint64_t seed)
+{
+	static uint8_t piece[4096];
+	uint8_t vbuf[64];
+	KISSDB_Extent e;
+	uint64_t pos;
+	unsigned long n,i;
+
+	if ((KISSDB_get(db,&k,vbuf))||(!KISSDB_extent_decode(db,vbuf,&e))||(e.length != length))
+		return 1;
+	for(pos=0;pos<length;pos+=n) {
+		n = ((length - pos) > sizeof(piece)) ? sizeof(piece) : (unsigned long)(length - pos);
+		if (KISSDB_extent_read(data,&e,pos,piece,n))
+			return 1;
+		for(i=0;i<n;++i) {
+			if (piece[i] != extent_test_byte(pos + i,seed))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc,char **argv)
+{
+	uint64_t i,j;
+	uint64_t v[8];
+	KISSDB db,snap;
+	KISSDB_Iterator dbi;
+	KISSDB_Extent ext,held;
+	uint64_t first,ticket;
+	char got_all_values[10000];
+	static uint8_t batch[4000 * (8 + sizeof(v))];
+	uint64_t k;
+	int q;
+
+	printf("Opening new empty database test.db...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+
+	printf("Adding and then re-getting 10000 64-byte values...\n");
 
 	for(i=0;i<10000;++i) {
 		for(j=0;j<8;++j)
@@ -444,6 +2149,307 @@ int main(int argc,char **argv)
 
 	KISSDB_close(&db);
 
+	printf("Re-opening with O_DIRECT and a 16 block pool...\n");
+
+	if (KISSDB_open_direct(&db,"test.db",KISSDB_OPEN_MODE_RDWR,1024,8,sizeof(v),16)) {
+		printf("KISSDB_open_direct failed\n");
+		return 1;
+	}
+
+	printf("Overwriting and re-getting 10000 64-byte values...\n");
+
+	for(i=0;i<10000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = i + 1;
+		if (KISSDB_put(&db,&i,v)) {
+			printf("KISSDB_put (direct) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=10000;i<11000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = i + 1;
+		if (KISSDB_put(&db,&i,v)) {
+			printf("KISSDB_put (direct) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<11000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (4) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i + 1) {
+				printf("KISSDB_get (4) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Re-opening without O_DIRECT and checking 11000 values...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,1024,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<11000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (5) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i + 1) {
+				printf("KISSDB_get (5) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Bulk building 10000 64-byte values from 20000 puts...\n");
+
+	i = 0;
+	if (KISSDB_build("test.db",0,8,sizeof(v),build_test_next,&i)) {
+		printf("KISSDB_build failed\n");
+		return 1;
+	}
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (6) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i + 10000) {
+				printf("KISSDB_get (6) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+	i = 10000;
+	if (KISSDB_get(&db,&i,v) != 1) {
+		printf("KISSDB_get (6) found a key that was never added\n");
+		return 1;
+	}
+	if (KISSDB_put(&db,&i,v)) {
+		printf("KISSDB_put after build failed\n");
+		return 1;
+	}
+
+	printf("Snapshot, then overwriting 10000 values and adding 1000...\n");
+
+	if (KISSDB_snapshot_begin(&db)) {
+		printf("KISSDB_snapshot_begin failed\n");
+		return 1;
+	}
+	for(i=0;i<11000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = 0;
+		if (KISSDB_put(&db,&i,v)) {
+			printf("KISSDB_put during snapshot failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_snapshot_write(&db,"test-snapshot.db")) {
+		printf("KISSDB_snapshot_write failed\n");
+		return 1;
+	}
+	KISSDB_snapshot_end(&db);
+	KISSDB_close(&db);
+
+	if (KISSDB_open(&db,"test-snapshot.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open of snapshot failed\n");
+		return 1;
+	}
+	for(i=0;i<11000;++i) {
+		q = KISSDB_get(&db,&i,v);
+		if ((i <= 10000) ? (q != 0) : (q != 1)) {
+			printf("KISSDB_get (7) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;(j<8)&&(i<10000);++j) {
+			if (v[j] != i + 10000) {
+				printf("KISSDB_get (7) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Batch putting 3000 new and 1000 overwritten 64-byte values...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,64,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(q=0;q<2;++q) {
+		for(i=0;i<4000;++i) {
+			k = (q) ? (i % 3000) + 1000 : (i % 3000); /* the second batch overwrites 1000..2999 */
+			memcpy(batch + (i * (8 + sizeof(v))),&k,8);
+			for(j=0;j<8;++j)
+				v[j] = k + (q * 100000) + ((i >= 3000) ? 50000 : 0);
+			memcpy(batch + (i * (8 + sizeof(v))) + 8,v,sizeof(v));
+		}
+		if (KISSDB_put_batch(&db,batch,4000)) {
+			printf("KISSDB_put_batch failed\n");
+			return 1;
+		}
+	}
+	for(i=0;i<4000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (8) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		/* last copy wins: batch 1 repeats 0..999, batch 2 covers 1000..3999 and repeats 1000..1999 */
+		k = (i < 1000) ? i + 50000 : ((i < 2000) ? i + 150000 : i + 100000);
+		for(j=0;j<8;++j) {
+			if (v[j] != k) {
+				printf("KISSDB_get (8) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Storing 3 large values in extents on an empty database...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,64,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<3;++i) {
+		if (extent_test_put(&db,i,(i + 1) * 300007,i)) {
+			printf("Storing extent failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(j=0;j<8;++j)
+		v[j] = 3;
+	i = 3;
+	if (KISSDB_put(&db,&i,v)) {
+		printf("KISSDB_put next to extents failed\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	printf("Re-opening with O_DIRECT and reading the extents back...\n");
+
+	if (KISSDB_open_direct(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0,16)) {
+		printf("KISSDB_open_direct failed\n");
+		return 1;
+	}
+	for(i=0;i<3;++i) {
+		if (extent_test_check(&db,&db,i,(i + 1) * 300007,i)) {
+			printf("Reading extent failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	i = 3;
+	if ((KISSDB_get(&db,&i,v))||(v[0] != 3)) {
+		printf("KISSDB_get next to extents failed\n");
+		return 1;
+	}
+	i = 0;
+	if ((KISSDB_get(&db,&i,v))||(!KISSDB_extent_decode(&db,v,&ext))) {
+		printf("Decoding extent failed\n");
+		return 1;
+	}
+	first = ext.offset;
+
+	printf("Snapshot, then replacing a large value...\n");
+
+	if (KISSDB_snapshot_begin(&db)) {
+		printf("KISSDB_snapshot_begin failed\n");
+		return 1;
+	}
+	if (extent_test_put(&db,0,5000,100)) {
+		printf("Replacing extent during snapshot failed\n");
+		return 1;
+	}
+	if (KISSDB_snapshot_write(&db,"test-snapshot.db")) {
+		printf("KISSDB_snapshot_write failed\n");
+		return 1;
+	}
+	KISSDB_snapshot_end(&db);
+	i = 0;
+	if (extent_test_check(&db,&db,i,5000,100)) {
+		printf("Reading replaced extent failed\n");
+		return 1;
+	}
+
+	if (KISSDB_open(&snap,"test-snapshot.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open of snapshot failed\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+	for(i=0;i<3;++i) {
+		if (extent_test_check(&snap,&snap,i,(i + 1) * 300007,i)) {
+			printf("Reading extent from snapshot failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	KISSDB_close(&snap);
+
+	printf("Re-opening and reusing the space of replaced extents...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	/* only a walk of the records knows the first value of key 0 is gone */
+	i = 4;
+	if ((extent_test_put(&db,i,1000,4))||(KISSDB_get(&db,&i,v))||(!KISSDB_extent_decode(&db,v,&ext))||(ext.offset != first)) {
+		printf("Space of an extent replaced before re-opening not reused\n");
+		return 1;
+	}
+	ticket = KISSDB_extent_hold(&db);
+	i = 1;
+	if ((KISSDB_get(&db,&i,v))||(!KISSDB_extent_decode(&db,v,&held))||(extent_test_put(&db,i,2000,11))) {
+		printf("Replacing extent failed\n");
+		return 1;
+	}
+	i = 5;
+	if ((extent_test_put(&db,i,600014,5))||(KISSDB_get(&db,&i,v))||(!KISSDB_extent_decode(&db,v,&ext))||(ext.offset < (held.offset + held.length))) {
+		printf("Extent reused while held\n");
+		return 1;
+	}
+	KISSDB_extent_release(&db,ticket);
+	i = 6;
+	if ((extent_test_put(&db,i,600014,6))||(KISSDB_get(&db,&i,v))||(!KISSDB_extent_decode(&db,v,&ext))||(ext.offset >= (held.offset + held.length))) {
+		printf("Extent not reused after release\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	if (KISSDB_open_direct(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0,16)) {
+		printf("KISSDB_open_direct failed\n");
+		return 1;
+	}
+	if (extent_test_put(&db,4,70000,44)) {
+		printf("Replacing extent with O_DIRECT failed\n");
+		return 1;
+	}
+	if ((extent_test_check(&db,&db,0,5000,100))||(extent_test_check(&db,&db,1,2000,11))||(extent_test_check(&db,&db,2,900021,2))
+		||(extent_test_check(&db,&db,4,70000,44))||(extent_test_check(&db,&db,5,600014,5))||(extent_test_check(&db,&db,6,600014,6))) {
+		printf("Reading reused extents failed\n");
+		return 1;
+	}
+	i = 3;
+	if ((KISSDB_get(&db,&i,v))||(v[0] != 3)) {
+		printf("KISSDB_get next to reused extents failed\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+
 	printf("All tests OK!\n");
 
 	return 0;
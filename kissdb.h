@@ -38,8 +38,20 @@ typedef struct {
 	unsigned long num_hash_tables;
 	uint64_t *hash_tables;
 	FILE *f;
+	int fd;
+	uint64_t file_size;
+	struct KISSDB_BufferPool *pool;
+	struct KISSDB_Snapshot *snapshot;
+	struct KISSDB_ExtentSpace *extents;
 } KISSDB;
 
+/**
+ * Size of the blocks cached by the O_DIRECT buffer pool
+ *
+ * Must be a multiple of the logical block size of the underlying device.
+ */
+#define KISSDB_BLOCK_SIZE 4096
+
 /**
  * I/O error or file not found
  */
@@ -105,6 +117,57 @@ extern int KISSDB_open(
 	unsigned long key_size,
 	unsigned long value_size);
 
+/**
+ * Open database with O_DIRECT and an engine-managed buffer pool
+ *
+ * Same as KISSDB_open(), but the file bypasses both stdio and the kernel
+ * page cache. File blocks are cached in a pool of pool_blocks aligned
+ * blocks of KISSDB_BLOCK_SIZE bytes, so resident memory is bounded by
+ * pool_blocks * KISSDB_BLOCK_SIZE. The pool is write-back: updates reach
+ * the file when their block is evicted and on KISSDB_close(). A pool_blocks
+ * of 0 is equivalent to KISSDB_open(). Only supported on Linux.
+ *
+ * @param db Database struct
+ * @param path Path to file
+ * @param mode One of the KISSDB_OPEN_MODE constants
+ * @param hash_table_size Size of hash table in 64-bit entries (must be >0)
+ * @param key_size Size of keys in bytes
+ * @param value_size Size of values in bytes
+ * @param pool_blocks Number of blocks in the buffer pool
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_open_direct(
+	KISSDB *db,
+	const char *path,
+	int mode,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size,
+	unsigned long pool_blocks);
+
+/**
+ * Write all buffered updates to the file and sync it to stable storage
+ *
+ * Must not run concurrently with KISSDB_put().
+ *
+ * @param db Database struct
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_sync(KISSDB *db);
+
+/**
+ * Get the size of the database file
+ *
+ * Safe to call while other threads use the database. Without the buffer
+ * pool on platforms other than Linux it must not run concurrently with
+ * other calls.
+ *
+ * @param db Database struct
+ * @param size Receives the size in bytes
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_file_size(KISSDB *db,uint64_t *size);
+
 /**
  * Close database
  *
@@ -135,6 +198,214 @@ extern int KISSDB_get(KISSDB *db,const void *key,void *vbuf);
  */
 extern int KISSDB_put(KISSDB *db,const void *key,const void *value);
 
+/**
+ * Build a new database file from a stream of entries
+ *
+ * Entries are pulled from the next() callback, spread over temporary
+ * partition files by key hash, de-duplicated (the last value given for a
+ * key wins) and written out in a single sequential pass: header, first
+ * hash table page, all records, remaining hash table pages. This is much
+ * faster than calling KISSDB_put() for every entry on an empty database.
+ *
+ * If hash_table_size is 0 it is set to the number of entries read, which
+ * keeps the number of hash table pages small.
+ *
+ * @param path Path to file (replaced if it exists)
+ * @param hash_table_size Size of hash table in 64-bit entries, 0 to size automatically
+ * @param key_size Size of keys in bytes
+ * @param value_size Size of values in bytes
+ * @param next Fills kbuf (key_size bytes) and vbuf (value_size bytes), returns 1 if filled, 0 at end, negative on error
+ * @param arg Passed to next()
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_build(
+	const char *path,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size,
+	int (*next)(void *arg,void *kbuf,void *vbuf),
+	void *arg);
+
+/**
+ * Start a point-in-time snapshot
+ *
+ * Captures the current contents of the database. Must not run
+ * concurrently with KISSDB_put(); it only copies the in-memory hash
+ * tables, so it is cheap. Until KISSDB_snapshot_end(), KISSDB_put()
+ * saves the old value of a record the first time it overwrites one that
+ * has not been copied out yet (copy on write).
+ *
+ * @param db Database struct
+ * @return 0 on success, nonzero on error (e.g. a snapshot is already active)
+ */
+extern int KISSDB_snapshot_begin(KISSDB *db);
+
+/**
+ * Write the active snapshot to a new database file
+ *
+ * May run in another thread concurrently with KISSDB_get() and
+ * KISSDB_put(). The result is a regular database file holding exactly
+ * the entries present at KISSDB_snapshot_begin(). Extents those entries
+ * refer to are copied along, and no others.
+ *
+ * @param db Database struct
+ * @param path Path of the file to create (replaced if it exists)
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_snapshot_write(KISSDB *db,const char *path);
+
+/**
+ * Release the active snapshot
+ *
+ * Must not run concurrently with KISSDB_put().
+ *
+ * @param db Database struct
+ */
+extern void KISSDB_snapshot_end(KISSDB *db);
+
+/**
+ * Put many entries at once
+ *
+ * Entries are applied in hash bucket order: records of new keys are
+ * appended with one write, the remaining table and value updates are
+ * issued in file order, and the file is flushed once. If a key appears
+ * more than once the last copy wins.
+ *
+ * @param db Database struct
+ * @param entries count entries, each key_size bytes of key followed by value_size bytes of value
+ * @param count Number of entries
+ * @return -1 on I/O error, 0 on success
+ */
+extern int KISSDB_put_batch(KISSDB *db,const void *entries,unsigned long count);
+
+/**
+ * Extent: a value too large for a record
+ *
+ * An extent is a run of whole blocks of the file outside the hash tables.
+ * Its record holds a descriptor in place of the value: KISSDB_EXTENT_MAGIC,
+ * then the offset and the length of the extent. A value_size buffer that
+ * starts with KISSDB_EXTENT_MAGIC is therefore never an ordinary value.
+ * Extents are written and read in pieces, so a large value never has to
+ * be in memory at once. An extent is never changed once a record refers
+ * to it; a new value gets a new extent.
+ *
+ * Storing a value with KISSDB_put() or KISSDB_put_batch() frees the
+ * extent of the value it replaces, and of an earlier copy of the key in
+ * the same batch. Freed extents are reused by KISSDB_extent_alloc(), but
+ * not while a reader that may still see them holds the extents (see
+ * KISSDB_extent_hold()). The free space is only kept in memory: the first
+ * KISSDB_extent_alloc() after opening finds it again by walking every
+ * record, which also reclaims extents that no record refers to. The file
+ * never shrinks; a snapshot writes a compact copy.
+ */
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+} KISSDB_Extent;
+
+/**
+ * Size of an extent descriptor; value_size must be at least this
+ */
+#define KISSDB_EXTENT_DESCRIPTOR_SIZE 24
+
+/**
+ * Reserve an extent, reusing freed space or else at the end of the file
+ *
+ * Must not run concurrently with KISSDB_get() or KISSDB_put(). An extent
+ * that will not be stored after all should be given back with
+ * KISSDB_extent_free().
+ *
+ * @param db Database struct
+ * @param length Length of the extent in bytes (must be >0)
+ * @param e Extent to initialize
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_extent_alloc(KISSDB *db,uint64_t length,KISSDB_Extent *e);
+
+/**
+ * Free an extent no record refers to any more
+ *
+ * Only needed for extents that were never stored; KISSDB_put() frees the
+ * extents of values it replaces. May run concurrently with any other call.
+ *
+ * @param db Database struct
+ * @param e Extent
+ */
+extern void KISSDB_extent_free(KISSDB *db,const KISSDB_Extent *e);
+
+/**
+ * Keep freed extents from being reused while reading
+ *
+ * Take a hold before getting a descriptor and release it after the last
+ * KISSDB_extent_read() of its extent: an extent freed in between is not
+ * reused until then. May run concurrently with any other call.
+ *
+ * @param db Database struct
+ * @return Ticket for KISSDB_extent_release()
+ */
+extern uint64_t KISSDB_extent_hold(KISSDB *db);
+
+/**
+ * Release a hold taken with KISSDB_extent_hold()
+ *
+ * @param db Database struct
+ * @param ticket Ticket returned by KISSDB_extent_hold()
+ */
+extern void KISSDB_extent_release(KISSDB *db,uint64_t ticket);
+
+/**
+ * Write part of an extent
+ *
+ * May run concurrently with any other call, as long as no record refers
+ * to the extent yet.
+ *
+ * @param db Database struct
+ * @param e Extent
+ * @param pos Offset within the extent
+ * @param buf Data
+ * @param len Length of data, pos + len at most the extent's length
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_extent_write(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,const void *buf,unsigned long len);
+
+/**
+ * Read part of an extent
+ *
+ * May run concurrently with any other call. A reader racing with
+ * KISSDB_put() of the same key should hold the extents (see
+ * KISSDB_extent_hold()), or the extent may be reused under it.
+ *
+ * @param db Database struct
+ * @param e Extent
+ * @param pos Offset within the extent
+ * @param buf Buffer to fill
+ * @param len Bytes to read, pos + len at most the extent's length
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_extent_read(KISSDB *db,const KISSDB_Extent *e,uint64_t pos,void *buf,unsigned long len);
+
+/**
+ * Fill a value buffer with the descriptor of an extent
+ *
+ * The buffer can then be stored with KISSDB_put() or KISSDB_put_batch().
+ *
+ * @param db Database struct
+ * @param e Extent
+ * @param vbuf Value buffer (value_size bytes)
+ * @return 0 on success, nonzero if value_size is too small
+ */
+extern int KISSDB_extent_encode(KISSDB *db,const KISSDB_Extent *e,void *vbuf);
+
+/**
+ * Tell whether a value is an extent descriptor
+ *
+ * @param db Database struct
+ * @param vbuf Value as returned by KISSDB_get() (value_size bytes)
+ * @param e Filled with the extent if it is one
+ * @return 1 if vbuf is an extent descriptor, 0 otherwise
+ */
+extern int KISSDB_extent_decode(KISSDB *db,const void *vbuf,KISSDB_Extent *e);
+
 /**
  * Cursor used for iterating over all entries in database
  */
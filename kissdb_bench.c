@@ -0,0 +1,456 @@
+/* kissdb_bench.c
+
+	Microbenchmarks of the KISSDB storage engine.
+
+	For every combination of record count, hash table size, key size and
+	value size it builds a fresh database with KISSDB_put() and measures
+	the puts, KISSDB_sync(), reopening the file, gets of existing keys,
+	gets of missing keys, overwrites and a full iteration. Every phase
+	reports its throughput, and the per-operation phases also report
+	latency percentiles, as a text table or as one JSON object per line
+	so runs before and after an engine change can be compared.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "kissdb.h"
+#include "histogram.h"
+
+#define DEFAULT_DB_PATH "kissdb_bench.db"
+#define DEFAULT_RECORDS "10000,100000"
+#define DEFAULT_HASH_TABLE_SIZES "1024"
+#define DEFAULT_KEY_SIZES "128"			// The server's KEY_SIZE.
+#define DEFAULT_VALUE_SIZES "1024"		// The server's VALUE_SIZE.
+#define DEFAULT_SAMPLES 100000			// Random gets, misses and overwrites per configuration.
+#define MAX_LIST 16
+#define BILLION 1000000000
+
+// One benchmark configuration.
+typedef struct bench_config {
+	const char *path;
+	unsigned long records;
+	unsigned long hash_table_size;
+	unsigned long key_size;
+	unsigned long value_size;
+	unsigned long samples;
+	unsigned long pool_blocks;
+	int json;
+} bench_config;
+
+// Result of one phase.
+typedef struct bench_result {
+	const char *phase;
+	unsigned long operations;
+	unsigned long errors;		// Failed calls, or gets that returned the wrong answer.
+	uint64_t elapsed;		// Nanoseconds.
+	histogram latency;		// Per operation, if timed one by one.
+	int timed;
+} bench_result;
+
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+	fprintf(stderr, "Usage: kissdb_bench [OPTION]...\n\n");
+	fprintf(stderr, "Measures KISSDB over every combination of the listed sizes.\n\n");
+	fprintf(stderr, "Available Options:\n");
+	fprintf(stderr, "-h:             Print this help message.\n");
+	fprintf(stderr, "-o <path>:      Scratch database file (default %s, removed afterwards).\n", DEFAULT_DB_PATH);
+	fprintf(stderr, "-n <list>:      Record counts (default %s).\n", DEFAULT_RECORDS);
+	fprintf(stderr, "-t <list>:      Hash table sizes in entries (default %s).\n", DEFAULT_HASH_TABLE_SIZES);
+	fprintf(stderr, "-k <list>:      Key sizes in bytes, at least 8 (default %s).\n", DEFAULT_KEY_SIZES);
+	fprintf(stderr, "-v <list>:      Value sizes in bytes, at least 8 (default %s).\n", DEFAULT_VALUE_SIZES);
+	fprintf(stderr, "-s <count>:     Random gets, misses and overwrites per run (default %d).\n", DEFAULT_SAMPLES);
+	fprintf(stderr, "-p <blocks>:    Open with KISSDB_open_direct() and a pool of <blocks> blocks.\n");
+	fprintf(stderr, "-j:             Print one JSON object per phase instead of a table.\n");
+	fprintf(stderr, "\nLists are comma separated; sizes take a K, M or G suffix (x1000).\n");
+}
+
+/**
+ * @name now - Reads the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static uint64_t now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * BILLION + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @name next_random - xorshift64* generator.
+ * @param state: The generator state, never 0.
+ *
+ * @return 64 random bits.
+ */
+static uint64_t next_random(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @name parse_list - Parses a comma separated list of sizes.
+ * @param arg: The list, e.g. "10K,1M".
+ * @param values: Receives up to MAX_LIST values.
+ *
+ * @return The number of values, or -1 on error.
+ */
+static int parse_list(const char *arg, unsigned long *values) {
+	char *end;
+	int count = 0;
+
+	while (*arg) {
+		if (count == MAX_LIST)
+			return -1;
+		values[count] = strtoul(arg, &end, 10);
+		if (end == arg)
+			return -1;
+		if (*end == 'K' || *end == 'k')
+			values[count] *= 1000UL, end++;
+		else if (*end == 'M' || *end == 'm')
+			values[count] *= 1000000UL, end++;
+		else if (*end == 'G' || *end == 'g')
+			values[count] *= 1000000000UL, end++;
+		if (values[count] == 0 || (*end && *end != ','))
+			return -1;
+		count++;
+		arg = (*end == ',') ? end + 1 : end;
+	}
+	return count ? count : -1;
+}
+
+/**
+ * @name make_key - Fills the key of record 'number'. Existing keys have
+ * the top bit clear, keys used for misses have it set.
+ * @param key: Buffer of key_size bytes.
+ * @param key_size: The key size, at least 8.
+ * @param number: The record number.
+ *
+ * @return
+ */
+static void make_key(void *key, unsigned long key_size, uint64_t number) {
+
+	memset(key, 0, key_size);
+	memcpy(key, &number, sizeof(number));
+}
+
+/**
+ * @name make_value - Fills a value that identifies its record and version.
+ * @param value: Buffer of value_size bytes.
+ * @param value_size: The value size, at least 8.
+ * @param number: The record number.
+ * @param version: 0 when inserted, 1 once overwritten.
+ *
+ * @return
+ */
+static void make_value(void *value, unsigned long value_size, uint64_t number, uint64_t version) {
+	uint64_t stamp = number * 2 + version;
+
+	memset(value, (int) (number & 0xff), value_size);
+	memcpy(value, &stamp, sizeof(stamp));
+}
+
+/**
+ * @name open_db - Opens the benchmark database.
+ * @param db: The database.
+ * @param config: The configuration.
+ * @param mode: One of the KISSDB_OPEN_MODE constants.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+static int open_db(KISSDB *db, const bench_config *config, int mode) {
+
+	return KISSDB_open_direct(db, config->path, mode, config->hash_table_size,
+		config->key_size, config->value_size, config->pool_blocks);
+}
+
+/**
+ * @name report - Prints the result of one phase.
+ * @param config: The configuration.
+ * @param result: The result.
+ *
+ * @return
+ */
+static void report(const bench_config *config, const bench_result *result) {
+	double seconds = (double) result->elapsed / BILLION;
+	double rate = seconds > 0 ? result->operations / seconds : 0;
+	const histogram *h = &result->latency;
+
+	if (config->json) {
+		printf("{\"records\":%lu,\"hash_table_size\":%lu,\"key_size\":%lu,\"value_size\":%lu,\"pool_blocks\":%lu,"
+			"\"phase\":\"%s\",\"operations\":%lu,\"errors\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.1f",
+			config->records, config->hash_table_size, config->key_size, config->value_size, config->pool_blocks,
+			result->phase, result->operations, result->errors, seconds, rate);
+		if (result->timed)
+			printf(",\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,\"mean_ns\":%.1f",
+				(unsigned long long) histogram_percentile(h, 0.50), (unsigned long long) histogram_percentile(h, 0.90),
+				(unsigned long long) histogram_percentile(h, 0.99), (unsigned long long) histogram_percentile(h, 0.999),
+				(unsigned long long) h->max, histogram_mean(h));
+		printf("}\n");
+	}
+	else {
+		printf("%-10s %10lu %7lu %10.3f %12.1f", result->phase, result->operations, result->errors, seconds, rate);
+		if (result->timed)
+			printf(" %9.2f %9.2f %9.2f %9.2f %9.2f",
+				histogram_percentile(h, 0.50) / 1000.0, histogram_percentile(h, 0.90) / 1000.0,
+				histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/**
+ * @name begin_phase - Clears a result before a phase.
+ * @param result: The result.
+ * @param phase: The phase name.
+ * @param timed: Whether operations are timed one by one.
+ *
+ * @return
+ */
+static void begin_phase(bench_result *result, const char *phase, int timed) {
+
+	result->phase = phase;
+	result->operations = 0;
+	result->errors = 0;
+	result->elapsed = 0;
+	result->timed = timed;
+	histogram_reset(&result->latency);
+}
+
+/**
+ * @name run_config - Runs every phase of one configuration.
+ * @param config: The configuration.
+ * @param result: Scratch result, reused by every phase.
+ *
+ * @return 0 on success, -1 if the database could not be created or opened.
+ */
+static int run_config(const bench_config *config, bench_result *result) {
+	KISSDB db;
+	KISSDB_Iterator it;
+	char *key, *value, *expected;
+	uint64_t rng = 0x9E3779B97F4A7C15ULL, start, t, i, number;
+	int rc;
+
+	key = (char *) malloc(config->key_size);
+	value = (char *) malloc(config->value_size);
+	expected = (char *) malloc(config->value_size);
+	if (!key || !value || !expected) {
+		fprintf(stderr, "(Error) kissdb_bench: Cannot allocate record buffers.\n");
+		exit(1);
+	}
+
+	if (!config->json)
+		printf("\nrecords=%lu hash_table_size=%lu key_size=%lu value_size=%lu pool_blocks=%lu\n"
+			"phase             ops  errors    seconds        ops/s   p50(us)   p90(us)   p99(us) p99.9(us)   max(us)\n",
+			config->records, config->hash_table_size, config->key_size, config->value_size, config->pool_blocks);
+
+	// Insert every record into a new file.
+	if (open_db(&db, config, KISSDB_OPEN_MODE_RWREPLACE)) {
+		fprintf(stderr, "(Error) kissdb_bench: Cannot create %s.\n", config->path);
+		goto error;
+	}
+	begin_phase(result, "put", 1);
+	start = now();
+	for (i = 0; i < config->records; i++) {
+		make_key(key, config->key_size, i);
+		make_value(value, config->value_size, i, 0);
+		t = now();
+		if (KISSDB_put(&db, key, value))
+			result->errors++;
+		histogram_record(&result->latency, now() - t);
+	}
+	result->elapsed = now() - start;
+	result->operations = config->records;
+	report(config, result);
+
+	begin_phase(result, "sync", 0);
+	start = now();
+	if (KISSDB_sync(&db))
+		result->errors++;
+	result->elapsed = now() - start;
+	result->operations = 1;
+	report(config, result);
+	KISSDB_close(&db);
+
+	// Reopening reads every hash table page.
+	begin_phase(result, "open", 0);
+	start = now();
+	rc = open_db(&db, config, KISSDB_OPEN_MODE_RDWR);
+	result->elapsed = now() - start;
+	result->operations = 1;
+	if (rc) {
+		fprintf(stderr, "(Error) kissdb_bench: Cannot reopen %s.\n", config->path);
+		goto error;
+	}
+	report(config, result);
+
+	begin_phase(result, "get", 1);
+	start = now();
+	for (i = 0; i < config->samples; i++) {
+		number = next_random(&rng) % config->records;
+		make_key(key, config->key_size, number);
+		t = now();
+		rc = KISSDB_get(&db, key, value);
+		histogram_record(&result->latency, now() - t);
+		make_value(expected, config->value_size, number, 0);
+		if (rc || memcmp(value, expected, config->value_size))
+			result->errors++;
+	}
+	result->elapsed = now() - start;
+	result->operations = config->samples;
+	report(config, result);
+
+	begin_phase(result, "miss", 1);
+	start = now();
+	for (i = 0; i < config->samples; i++) {
+		make_key(key, config->key_size, next_random(&rng) | (1ULL << 63));
+		t = now();
+		rc = KISSDB_get(&db, key, value);
+		histogram_record(&result->latency, now() - t);
+		if (rc != 1)
+			result->errors++;
+	}
+	result->elapsed = now() - start;
+	result->operations = config->samples;
+	report(config, result);
+
+	begin_phase(result, "overwrite", 1);
+	start = now();
+	for (i = 0; i < config->samples; i++) {
+		number = next_random(&rng) % config->records;
+		make_key(key, config->key_size, number);
+		make_value(value, config->value_size, number, 1);
+		t = now();
+		if (KISSDB_put(&db, key, value))
+			result->errors++;
+		histogram_record(&result->latency, now() - t);
+	}
+	result->elapsed = now() - start;
+	result->operations = config->samples;
+	report(config, result);
+
+	begin_phase(result, "iterate", 0);
+	start = now();
+	KISSDB_Iterator_init(&db, &it);
+	while ((rc = KISSDB_Iterator_next(&it, key, value)) > 0)
+		result->operations++;
+	result->elapsed = now() - start;
+	if (rc < 0 || result->operations != config->records)
+		result->errors++;
+	report(config, result);
+
+	KISSDB_close(&db);
+	unlink(config->path);
+	free(key);
+	free(value);
+	free(expected);
+	return 0;
+
+error:
+	unlink(config->path);
+	free(key);
+	free(value);
+	free(expected);
+	return -1;
+}
+
+/**
+ * @name main - The main routine.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int main(int argc, char **argv) {
+
+	unsigned long records[MAX_LIST], hash_table_sizes[MAX_LIST], key_sizes[MAX_LIST], value_sizes[MAX_LIST];
+	int num_records, num_hash_table_sizes, num_key_sizes, num_value_sizes;
+	int option, r, t, k, v, failed = 0;
+	unsigned long samples = DEFAULT_SAMPLES;
+	bench_config config;
+	bench_result *result;
+
+	memset(&config, 0, sizeof(config));
+	config.path = DEFAULT_DB_PATH;
+	num_records = parse_list(DEFAULT_RECORDS, records);
+	num_hash_table_sizes = parse_list(DEFAULT_HASH_TABLE_SIZES, hash_table_sizes);
+	num_key_sizes = parse_list(DEFAULT_KEY_SIZES, key_sizes);
+	num_value_sizes = parse_list(DEFAULT_VALUE_SIZES, value_sizes);
+
+	while ((option = getopt(argc, argv, "ho:n:t:k:v:s:p:j")) != -1) {
+		switch (option) {
+			case 'h':
+				print_usage();
+				exit(0);
+			case 'o':
+				config.path = optarg;
+				break;
+			case 'n':
+				num_records = parse_list(optarg, records);
+				break;
+			case 't':
+				num_hash_table_sizes = parse_list(optarg, hash_table_sizes);
+				break;
+			case 'k':
+				num_key_sizes = parse_list(optarg, key_sizes);
+				break;
+			case 'v':
+				num_value_sizes = parse_list(optarg, value_sizes);
+				break;
+			case 's':
+				samples = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				config.pool_blocks = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				config.json = 1;
+				break;
+			default:
+				print_usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (num_records < 0 || num_hash_table_sizes < 0 || num_key_sizes < 0 || num_value_sizes < 0 || samples == 0) {
+		fprintf(stderr, "Error: Invalid list or count.\n\n");
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+	for (k = 0; k < num_key_sizes; k++)
+		for (v = 0; v < num_value_sizes; v++)
+			if (key_sizes[k] < sizeof(uint64_t) || value_sizes[v] < sizeof(uint64_t)) {
+				fprintf(stderr, "Error: Keys and values must be at least %zu bytes.\n\n", sizeof(uint64_t));
+				exit(EXIT_FAILURE);
+			}
+
+	if (!(result = (bench_result *) malloc(sizeof(bench_result)))) {
+		fprintf(stderr, "(Error) kissdb_bench: Cannot allocate memory.\n");
+		return 1;
+	}
+	config.samples = samples;
+
+	for (r = 0; r < num_records; r++)
+		for (t = 0; t < num_hash_table_sizes; t++)
+			for (k = 0; k < num_key_sizes; k++)
+				for (v = 0; v < num_value_sizes; v++) {
+					config.records = records[r];
+					config.hash_table_size = hash_table_sizes[t];
+					config.key_size = key_sizes[k];
+					config.value_size = value_sizes[v];
+					if (run_config(&config, result))
+						failed = 1;
+				}
+
+	free(result);
+	return failed;
+}
@@ -0,0 +1,208 @@
+/* lockprof.c
+
+	Contention profiler for the server's synchronization primitives.
+*/
+
+#include <string.h>
+#include "lockprof.h"
+#include "stats.h"
+
+static lockprof_site *sites[LOCKPROF_MAX_SITES];
+static int number_of_sites = 0;
+
+// When the calling thread acquired each site; a shared lock has many holders.
+static __thread uint64_t acquired_at[LOCKPROF_MAX_SITES];
+
+/**
+ * @name lockprof_register - Adds a site to the registry.
+ * @param site: The site.
+ *
+ * @return
+ */
+void lockprof_register(lockprof_site *site) {
+
+	if (number_of_sites == LOCKPROF_MAX_SITES) {
+		fprintf(stderr, "(Warning) lockprof: Too many lock sites, %s is not profiled.\n", site->name);
+		return;
+	}
+	site->index = number_of_sites;
+	sites[number_of_sites++] = site;
+}
+
+/**
+ * @name lockprof_count - Returns the number of registered sites.
+ *
+ * @return The number of sites.
+ */
+int lockprof_count(void) {
+
+	return number_of_sites;
+}
+
+/**
+ * @name lockprof_get - Returns a registered site.
+ * @param index: Between 0 and lockprof_count() - 1.
+ *
+ * @return The site.
+ */
+lockprof_site *lockprof_get(int index) {
+
+	return sites[index];
+}
+
+/**
+ * @name lockprof_acquired - Records an acquisition.
+ * @param site: The site.
+ * @param contended: Whether the lock was taken when asked for.
+ * @param asked: When the lock was asked for, if contended.
+ *
+ * @return
+ */
+static void lockprof_acquired(lockprof_site *site, int contended, uint64_t asked) {
+	uint64_t now = stats_clock();
+
+	__atomic_add_fetch(&site->acquisitions, 1, __ATOMIC_RELAXED);
+	if (contended) {
+		__atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+		histogram_record_shared(&site->wait, now - asked);
+	} else
+		histogram_record_shared(&site->wait, 0);
+
+	if (site->index >= 0)
+		acquired_at[site->index] = now;
+}
+
+/**
+ * @name lockprof_released - Records the end of a hold.
+ * @param site: The site.
+ *
+ * @return
+ */
+static void lockprof_released(lockprof_site *site) {
+
+	if (site->index >= 0)
+		histogram_record_shared(&site->hold, stats_clock() - acquired_at[site->index]);
+}
+
+/**
+ * @name lockprof_mutex_lock - Locks a mutex.
+ * @param lock: The mutex.
+ * @param site: Its site.
+ *
+ * @return As pthread_mutex_lock().
+ */
+int lockprof_mutex_lock(pthread_mutex_t *lock, lockprof_site *site) {
+	uint64_t asked;
+	int rc;
+
+	if (!pthread_mutex_trylock(lock)) {
+		lockprof_acquired(site, 0, 0);
+		return 0;
+	}
+
+	asked = stats_clock();
+	if (!(rc = pthread_mutex_lock(lock)))
+		lockprof_acquired(site, 1, asked);
+	return rc;
+}
+
+/**
+ * @name lockprof_mutex_unlock - Unlocks a mutex.
+ * @param lock: The mutex.
+ * @param site: Its site.
+ *
+ * @return As pthread_mutex_unlock().
+ */
+int lockprof_mutex_unlock(pthread_mutex_t *lock, lockprof_site *site) {
+
+	lockprof_released(site);
+	return pthread_mutex_unlock(lock);
+}
+
+/**
+ * @name lockprof_cond_wait - Waits on a condition variable. The mutex is
+ * not counted as held while the thread is blocked.
+ * @param cond: The condition variable.
+ * @param lock: The mutex, held by the caller.
+ * @param site: Its site.
+ * @param deadline: Absolute timeout, or NULL to wait without one.
+ *
+ * @return As pthread_cond_wait() or pthread_cond_timedwait().
+ */
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, lockprof_site *site, const struct timespec *deadline) {
+	uint64_t blocked;
+	int rc;
+
+	lockprof_released(site);
+	blocked = stats_clock();
+
+	rc = deadline ? pthread_cond_timedwait(cond, lock, deadline) : pthread_cond_wait(cond, lock);
+
+	histogram_record_shared(&site->cond_wait, stats_clock() - blocked);
+	if (site->index >= 0)
+		acquired_at[site->index] = stats_clock();
+	return rc;
+}
+
+/**
+ * @name lockprof_rwlock_lock - Locks a reader/writer lock.
+ * @param lock: The lock.
+ * @param site: Its site.
+ * @param exclusive: Lock for writing instead of reading.
+ *
+ * @return As pthread_rwlock_rdlock() or pthread_rwlock_wrlock().
+ */
+int lockprof_rwlock_lock(pthread_rwlock_t *lock, lockprof_site *site, int exclusive) {
+	uint64_t asked;
+	int rc;
+
+	if (!(exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock))) {
+		lockprof_acquired(site, 0, 0);
+		return 0;
+	}
+
+	asked = stats_clock();
+	if (!(rc = exclusive ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock)))
+		lockprof_acquired(site, 1, asked);
+	return rc;
+}
+
+/**
+ * @name lockprof_rwlock_unlock - Unlocks a reader/writer lock.
+ * @param lock: The lock.
+ * @param site: Its site.
+ *
+ * @return As pthread_rwlock_unlock().
+ */
+int lockprof_rwlock_unlock(pthread_rwlock_t *lock, lockprof_site *site) {
+
+	lockprof_released(site);
+	return pthread_rwlock_unlock(lock);
+}
+
+/**
+ * @name lockprof_print - Prints acquisitions, contention and the wait, hold
+ * and condition wait percentiles of every site.
+ * @param out: The stream to print to.
+ *
+ * @return
+ */
+void lockprof_print(FILE *out) {
+	lockprof_site *site;
+	int i;
+
+	fprintf(out, "%-24s %10s %10s %10s %10s %10s %10s %10s %10s\n", "Lock (ns)", "acquired", "contended",
+		"wait p50", "wait p99", "hold p50", "hold p99", "cond p50", "cond p99");
+	for (i = 0; i < number_of_sites; i++) {
+		site = sites[i];
+		fprintf(out, "%-24s %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n", site->name,
+			(unsigned long long) __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+			(unsigned long long) histogram_percentile(&site->wait, 0.50),
+			(unsigned long long) histogram_percentile(&site->wait, 0.99),
+			(unsigned long long) histogram_percentile(&site->hold, 0.50),
+			(unsigned long long) histogram_percentile(&site->hold, 0.99),
+			(unsigned long long) histogram_percentile(&site->cond_wait, 0.50),
+			(unsigned long long) histogram_percentile(&site->cond_wait, 0.99));
+	}
+}
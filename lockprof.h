@@ -0,0 +1,92 @@
+/* lockprof.h
+
+	Contention profiler for the server's mutexes, reader/writer locks and
+	condition variables.
+
+	Every profiled lock gets a site, declared next to it with
+	LOCKPROF_SITE(), that counts acquisitions and contended acquisitions
+	and keeps histograms of the time spent waiting for the lock, holding
+	it, and blocked on a condition variable with it. The LOCKPROF_ macros
+	replace the pthread calls on the lock. A lock that is not a variable
+	of its own, e.g. a struct member, names its site with the _AT macros.
+
+	Profiling is compiled in with -DLOCKPROF=1. Otherwise the macros
+	expand to the plain pthread calls and the sites to nothing.
+*/
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "histogram.h"
+
+#ifndef LOCKPROF
+#define LOCKPROF 0
+#endif
+
+#define LOCKPROF_MAX_SITES 32
+
+typedef struct lockprof_site {
+	const char *name;
+	int index;			// Position in the registry.
+	uint64_t acquisitions;
+	uint64_t contended;		// Acquisitions that found the lock taken.
+	histogram wait;			// Blocked acquiring the lock, in nanoseconds.
+	histogram hold;			// Lock held, in nanoseconds.
+	histogram cond_wait;		// Blocked on a condition variable, in nanoseconds.
+} lockprof_site;
+
+#if LOCKPROF
+
+// Defines the site of 'lock' and registers it before main() runs.
+#define LOCKPROF_SITE(lock) \
+	lockprof_site lock##_prof = { #lock, -1, 0, 0, { 0 }, { 0 }, { 0 } }; \
+	static void __attribute__((constructor)) lock##_prof_register(void) { lockprof_register(&lock##_prof); }
+
+#define LOCKPROF_LOCK(lock)			lockprof_mutex_lock(&(lock), &lock##_prof)
+#define LOCKPROF_UNLOCK(lock)			lockprof_mutex_unlock(&(lock), &lock##_prof)
+#define LOCKPROF_COND_WAIT(cond, lock)		lockprof_cond_wait(&(cond), &(lock), &lock##_prof, NULL)
+#define LOCKPROF_COND_TIMEDWAIT(cond, lock, t)	lockprof_cond_wait(&(cond), &(lock), &lock##_prof, (t))
+#define LOCKPROF_RDLOCK(lock)			lockprof_rwlock_lock(&(lock), &lock##_prof, 0)
+#define LOCKPROF_WRLOCK(lock)			lockprof_rwlock_lock(&(lock), &lock##_prof, 1)
+#define LOCKPROF_RWUNLOCK(lock)			lockprof_rwlock_unlock(&(lock), &lock##_prof)
+#define LOCKPROF_LOCK_AT(lock, site)		lockprof_mutex_lock(&(lock), &site##_prof)
+#define LOCKPROF_UNLOCK_AT(lock, site)		lockprof_mutex_unlock(&(lock), &site##_prof)
+#define LOCKPROF_COND_WAIT_AT(cond, lock, site)	lockprof_cond_wait(&(cond), &(lock), &site##_prof, NULL)
+
+#else
+
+#define LOCKPROF_SITE(lock)
+#define LOCKPROF_LOCK(lock)			pthread_mutex_lock(&(lock))
+#define LOCKPROF_UNLOCK(lock)			pthread_mutex_unlock(&(lock))
+#define LOCKPROF_COND_WAIT(cond, lock)		pthread_cond_wait(&(cond), &(lock))
+#define LOCKPROF_COND_TIMEDWAIT(cond, lock, t)	pthread_cond_timedwait(&(cond), &(lock), (t))
+#define LOCKPROF_RDLOCK(lock)			pthread_rwlock_rdlock(&(lock))
+#define LOCKPROF_WRLOCK(lock)			pthread_rwlock_wrlock(&(lock))
+#define LOCKPROF_RWUNLOCK(lock)			pthread_rwlock_unlock(&(lock))
+#define LOCKPROF_LOCK_AT(lock, site)		pthread_mutex_lock(&(lock))
+#define LOCKPROF_UNLOCK_AT(lock, site)		pthread_mutex_unlock(&(lock))
+#define LOCKPROF_COND_WAIT_AT(cond, lock, site)	pthread_cond_wait(&(cond), &(lock))
+
+#endif
+
+// add 'site' to the registry; called by LOCKPROF_SITE().
+void lockprof_register(lockprof_site *site);
+
+// number of registered sites.
+int lockprof_count(void);
+
+// the registered site at 'index'.
+lockprof_site *lockprof_get(int index);
+
+int lockprof_mutex_lock(pthread_mutex_t *lock, lockprof_site *site);
+int lockprof_mutex_unlock(pthread_mutex_t *lock, lockprof_site *site);
+int lockprof_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, lockprof_site *site, const struct timespec *deadline);
+int lockprof_rwlock_lock(pthread_rwlock_t *lock, lockprof_site *site, int exclusive);
+int lockprof_rwlock_unlock(pthread_rwlock_t *lock, lockprof_site *site);
+
+// print one line per registered site.
+void lockprof_print(FILE *out);
+
+#endif
@@ -0,0 +1,214 @@
+/* memstore.c
+
+	Concurrent in-memory hash table of fixed size keys and values.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "memstore.h"
+
+/**
+ * @name memstore_hash - FNV-1a hash of a key.
+ * @param key: The key.
+ * @param len: The key size.
+ *
+ * @return The hash.
+ */
+static uint64_t memstore_hash(const void *key, size_t len) {
+	const unsigned char *p = (const unsigned char *) key;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * @name memstore_init - Initializes an empty table.
+ * @param ms: The table.
+ * @param num_buckets: Number of buckets, rounded up to a power of two.
+ * @param key_size: Size of every key in bytes.
+ * @param value_size: Size of every value in bytes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int memstore_init(memstore *ms, size_t num_buckets, size_t key_size, size_t value_size) {
+	size_t size = 1;
+	int i;
+
+	while (size < num_buckets)
+		size <<= 1;
+
+	memset(ms, 0, sizeof(memstore));
+	ms->key_size = key_size;
+	ms->value_size = value_size;
+	ms->num_buckets = size;
+	if (!(ms->buckets = (memstore_entry **) calloc(size, sizeof(memstore_entry *))))
+		return -1;
+
+	for (i = 0; i < MEMSTORE_STRIPES; i++) {
+		pthread_rwlock_init(&ms->stripes[i].lock, NULL);
+		ms->stripes[i].dirty = NULL;
+	}
+	return 0;
+}
+
+/**
+ * @name memstore_destroy - Frees every entry and the table.
+ * @param ms: The table.
+ *
+ * @return
+ */
+void memstore_destroy(memstore *ms) {
+	int i;
+
+	memstore_clear(ms);
+	free(ms->buckets);
+	ms->buckets = NULL;
+
+	for (i = 0; i < MEMSTORE_STRIPES; i++)
+		pthread_rwlock_destroy(&ms->stripes[i].lock);
+}
+
+/**
+ * @name memstore_clear - Removes every entry.
+ * @param ms: The table.
+ *
+ * @return
+ */
+void memstore_clear(memstore *ms) {
+	memstore_entry *entry, *next;
+	size_t b;
+	int i;
+
+	for (b = 0; b < ms->num_buckets; b++) {
+		for (entry = ms->buckets[b]; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		ms->buckets[b] = NULL;
+	}
+	for (i = 0; i < MEMSTORE_STRIPES; i++)
+		ms->stripes[i].dirty = NULL;
+	ms->count = 0;
+}
+
+/**
+ * @name memstore_count - Returns the number of entries.
+ * @param ms: The table.
+ *
+ * @return The number of entries.
+ */
+size_t memstore_count(memstore *ms) {
+
+	return __atomic_load_n(&ms->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @name memstore_get - Looks up a key.
+ * @param ms: The table.
+ * @param key: The key (key_size bytes).
+ * @param value: Buffer of value_size bytes receiving the value.
+ *
+ * @return 0 if found, 1 if not found.
+ */
+int memstore_get(memstore *ms, const void *key, void *value) {
+	size_t b = memstore_hash(key, ms->key_size) & (ms->num_buckets - 1);
+	memstore_stripe *stripe = &ms->stripes[b % MEMSTORE_STRIPES];
+	memstore_entry *entry;
+	int rc = 1;
+
+	pthread_rwlock_rdlock(&stripe->lock);
+	for (entry = ms->buckets[b]; entry; entry = entry->next) {
+		if (!memcmp(entry->data, key, ms->key_size)) {
+			memcpy(value, entry->data + ms->key_size, ms->value_size);
+			rc = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return rc;
+}
+
+/**
+ * @name memstore_put - Inserts or overwrites a key.
+ * @param ms: The table.
+ * @param key: The key (key_size bytes).
+ * @param value: The value (value_size bytes).
+ * @param track: Queue the entry for memstore_drain_dirty().
+ * @param old: Receives the value replaced if it was still queued for
+ * memstore_drain_dirty(), zeros otherwise; may be NULL.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int memstore_put(memstore *ms, const void *key, const void *value, int track, void *old) {
+	size_t b = memstore_hash(key, ms->key_size) & (ms->num_buckets - 1);
+	memstore_stripe *stripe = &ms->stripes[b % MEMSTORE_STRIPES];
+	memstore_entry *entry;
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	for (entry = ms->buckets[b]; entry; entry = entry->next) {
+		if (!memcmp(entry->data, key, ms->key_size))
+			break;
+	}
+
+	if (!entry) {
+		if (!(entry = (memstore_entry *) malloc(sizeof(memstore_entry) + ms->key_size + ms->value_size))) {
+			pthread_rwlock_unlock(&stripe->lock);
+			return -1;
+		}
+		memcpy(entry->data, key, ms->key_size);
+		entry->dirty = 0;
+		entry->next_dirty = NULL;
+		entry->next = ms->buckets[b];
+		ms->buckets[b] = entry;
+		__atomic_add_fetch(&ms->count, 1, __ATOMIC_RELAXED);
+		if (old)
+			memset(old, 0, ms->value_size);
+	} else if (old) {
+		// A drained value is the drain callback's to handle.
+		if (entry->dirty)
+			memcpy(old, entry->data + ms->key_size, ms->value_size);
+		else
+			memset(old, 0, ms->value_size);
+	}
+	memcpy(entry->data + ms->key_size, value, ms->value_size);
+
+	if (track && !entry->dirty) {
+		entry->dirty = 1;
+		entry->next_dirty = stripe->dirty;
+		stripe->dirty = entry;
+	}
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return 0;
+}
+
+/**
+ * @name memstore_drain_dirty - Hands every tracked update to a callback.
+ * @param ms: The table.
+ * @param fn: Called with the key and current value of each dirty entry.
+ * @param arg: Passed to fn.
+ *
+ * @return
+ */
+void memstore_drain_dirty(memstore *ms, void (*fn)(void *arg, const void *key, const void *value), void *arg) {
+	memstore_entry *entry, *next;
+	int i;
+
+	for (i = 0; i < MEMSTORE_STRIPES; i++) {
+		pthread_rwlock_wrlock(&ms->stripes[i].lock);
+		for (entry = ms->stripes[i].dirty; entry; entry = next) {
+			next = entry->next_dirty;
+			fn(arg, entry->data, entry->data + ms->key_size);
+			entry->dirty = 0;
+			entry->next_dirty = NULL;
+		}
+		ms->stripes[i].dirty = NULL;
+		pthread_rwlock_unlock(&ms->stripes[i].lock);
+	}
+}
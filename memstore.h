@@ -0,0 +1,67 @@
+/* memstore.h
+
+	Concurrent in-memory hash table of fixed size keys and values.
+
+	Buckets are spread over MEMSTORE_STRIPES reader/writer locks so that
+	requests on different keys rarely meet on the same lock. Updates can
+	be tracked on per-stripe dirty lists and drained by a background
+	thread that persists them.
+*/
+
+#ifndef MEMSTORE_H
+#define MEMSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MEMSTORE_STRIPES 64
+#define CACHE_LINE_SIZE  64
+
+typedef struct memstore_entry {
+	struct memstore_entry *next;		// Bucket chain.
+	struct memstore_entry *next_dirty;	// Stripe dirty list.
+	int dirty;
+	char data[];				// key_size bytes of key, then value_size bytes of value.
+} memstore_entry;
+
+typedef struct memstore_stripe {
+	pthread_rwlock_t lock;
+	memstore_entry *dirty;
+} __attribute__((aligned(CACHE_LINE_SIZE))) memstore_stripe;
+
+typedef struct memstore {
+	size_t key_size;
+	size_t value_size;
+	size_t num_buckets;		// Power of two.
+	memstore_entry **buckets;
+	size_t count;			// Number of entries, updated atomically.
+	memstore_stripe stripes[MEMSTORE_STRIPES];
+} memstore;
+
+// initialize an empty table with 'num_buckets' buckets (rounded up to a power of two).
+int memstore_init(memstore *ms, size_t num_buckets, size_t key_size, size_t value_size);
+
+// free every entry and the table itself.
+void memstore_destroy(memstore *ms);
+
+// remove every entry. Must not run concurrently with other calls.
+void memstore_clear(memstore *ms);
+
+// number of entries in the table.
+size_t memstore_count(memstore *ms);
+
+// copy the value of 'key' to 'value'; 0 if found, 1 if not.
+int memstore_get(memstore *ms, const void *key, void *value);
+
+// insert or overwrite 'key'; if 'track' is set the entry is queued for
+// memstore_drain_dirty(). The replaced value goes to 'old' unless it is
+// NULL: zeros if the key was new or its value was already drained.
+// 0 on success, -1 if out of memory.
+int memstore_put(memstore *ms, const void *key, const void *value, int track, void *old);
+
+// call 'fn' for every entry updated since the last drain and clear its
+// dirty mark. 'fn' runs with the entry's stripe write locked.
+void memstore_drain_dirty(memstore *ms, void (*fn)(void *arg, const void *key, const void *value), void *arg);
+
+#endif
@@ -0,0 +1,256 @@
+/* metrics.c
+
+	Prometheus text format metrics of the key-value server.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "stats.h"
+
+#define METRICS_REQUEST_SIZE 1024
+
+// Upper bounds of the exported histogram buckets, in nanoseconds.
+static const uint64_t latency_bounds[] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+	250000000, 500000000, 1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+/**
+ * @name metrics_printf - Appends formatted text, growing the buffer as needed.
+ * @param mb: The buffer.
+ * @param format: printf format.
+ *
+ * @return
+ */
+void metrics_printf(metrics_buffer *mb, const char *format, ...) {
+	va_list args;
+	size_t capacity;
+	char *data;
+	int n;
+
+	for (;;) {
+		va_start(args, format);
+		n = vsnprintf(mb->data ? mb->data + mb->length : NULL, mb->capacity - mb->length, format, args);
+		va_end(args);
+		if (n < 0)
+			return;
+		if (mb->length + (size_t) n < mb->capacity) {
+			mb->length += (size_t) n;
+			return;
+		}
+
+		capacity = mb->capacity ? mb->capacity * 2 : 16384;
+		while (capacity <= mb->length + (size_t) n)
+			capacity *= 2;
+		if (!(data = (char *) realloc(mb->data, capacity)))
+			return;
+		mb->data = data;
+		mb->capacity = capacity;
+	}
+}
+
+/**
+ * @name metrics_gauge - Appends a gauge.
+ * @param mb: The buffer.
+ * @param name: Metric name.
+ * @param help: HELP text.
+ * @param value: Current value.
+ *
+ * @return
+ */
+void metrics_gauge(metrics_buffer *mb, const char *name, const char *help, double value) {
+
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s gauge\n%s %.0f\n", name, help, name, name, value);
+}
+
+/**
+ * @name metrics_histogram - Appends the samples of one labelled histogram,
+ * converted from nanoseconds to seconds.
+ * @param mb: The buffer.
+ * @param name: Metric name.
+ * @param label: Label name, e.g. "op".
+ * @param value: Label value.
+ * @param h: The histogram.
+ *
+ * @return
+ */
+void metrics_histogram(metrics_buffer *mb, const char *name, const char *label, const char *value, const histogram *h) {
+	size_t i;
+
+	for (i = 0; i < sizeof(latency_bounds) / sizeof(latency_bounds[0]); i++) {
+		metrics_printf(mb, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label, value, (double) latency_bounds[i] / 1e9,
+			(unsigned long long) histogram_count_at_most(h, latency_bounds[i]));
+	}
+	metrics_printf(mb, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, (unsigned long long) h->count);
+	metrics_printf(mb, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value, (double) h->sum / 1e9);
+	metrics_printf(mb, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long) h->count);
+}
+
+/**
+ * @name metrics_write_stats - Appends the request counters, the latency
+ * histograms of every request class and the per-stage histograms.
+ * @param mb: The buffer.
+ *
+ * @return
+ */
+void metrics_write_stats(metrics_buffer *mb) {
+	histogram *wait[STAT_OP_TYPES], *service[STAT_OP_TYPES];
+	worker_counters totals;
+	int type, stage;
+
+	stats_sum_counters(&totals);
+
+	metrics_printf(mb, "# HELP kvserver_requests_total Requests answered.\n# TYPE kvserver_requests_total counter\n");
+	for (type = 0; type < STAT_OP_TYPES; type++)
+		metrics_printf(mb, "kvserver_requests_total{op=\"%s\"} %llu\n", stats_name(type), (unsigned long long) totals.requests[type]);
+
+	metrics_printf(mb, "# HELP kvserver_request_failures_total GET ERROR and PUT ERROR replies.\n# TYPE kvserver_request_failures_total counter\n");
+	metrics_printf(mb, "kvserver_request_failures_total{op=\"GET\"} %llu\n", (unsigned long long) totals.failed[STAT_GET]);
+	metrics_printf(mb, "kvserver_request_failures_total{op=\"PUT\"} %llu\n", (unsigned long long) totals.failed[STAT_PUT]);
+
+	metrics_printf(mb, "# HELP kvserver_read_errors_total Connections without a readable request.\n# TYPE kvserver_read_errors_total counter\n");
+	metrics_printf(mb, "kvserver_read_errors_total %llu\n", (unsigned long long) totals.read_errors);
+	metrics_printf(mb, "# HELP kvserver_parse_errors_total Requests that could not be parsed.\n# TYPE kvserver_parse_errors_total counter\n");
+	metrics_printf(mb, "kvserver_parse_errors_total %llu\n", (unsigned long long) totals.parse_errors);
+	metrics_printf(mb, "# HELP kvserver_received_bytes_total Request payload bytes.\n# TYPE kvserver_received_bytes_total counter\n");
+	metrics_printf(mb, "kvserver_received_bytes_total %llu\n", (unsigned long long) totals.bytes_in);
+	metrics_printf(mb, "# HELP kvserver_sent_bytes_total Reply payload bytes.\n# TYPE kvserver_sent_bytes_total counter\n");
+	metrics_printf(mb, "kvserver_sent_bytes_total %llu\n", (unsigned long long) totals.bytes_out);
+
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		wait[type] = (histogram *) malloc(sizeof(histogram));
+		service[type] = (histogram *) malloc(sizeof(histogram));
+		if (wait[type] && service[type])
+			stats_merge_latency(type, wait[type], service[type]);
+	}
+
+	metrics_printf(mb, "# HELP kvserver_queue_wait_seconds Time from accept to dequeue.\n# TYPE kvserver_queue_wait_seconds histogram\n");
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		if (wait[type] && service[type])
+			metrics_histogram(mb, "kvserver_queue_wait_seconds", "op", stats_name(type), wait[type]);
+	}
+	metrics_printf(mb, "# HELP kvserver_service_seconds Time from accept to reply.\n# TYPE kvserver_service_seconds histogram\n");
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		if (wait[type] && service[type])
+			metrics_histogram(mb, "kvserver_service_seconds", "op", stats_name(type), service[type]);
+	}
+
+	metrics_printf(mb, "# HELP kvserver_stage_seconds Time spent in each stage of a request.\n# TYPE kvserver_stage_seconds histogram\n");
+	for (stage = 0; stage < STAGES; stage++) {
+		if (wait[0]) {
+			stats_merge_stage(stage, wait[0]);	// Done with the GET histograms; reuse one.
+			metrics_histogram(mb, "kvserver_stage_seconds", "stage", stats_stage_name(stage), wait[0]);
+		}
+	}
+
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		free(wait[type]);
+		free(service[type]);
+	}
+}
+
+/**
+ * @name metrics_listen - Opens the metrics socket on the loopback interface.
+ * @param port: TCP port.
+ *
+ * @return The listening socket, -1 on error.
+ */
+int metrics_listen(int port) {
+	struct sockaddr_in addr;
+	int fd, reuse = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 5) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * @name metrics_write_all - Writes a whole buffer to a socket.
+ * @param fd: The socket.
+ * @param buf: The data.
+ * @param len: Its length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int metrics_write_all(int fd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+/**
+ * @name metrics_serve - Answers HTTP scrapes, one connection at a time,
+ * until the listening socket is shut down.
+ * @param listen_fd: Socket returned by metrics_listen().
+ * @param collect: Appends server-specific metrics, may be NULL.
+ * @param arg: Passed to collect.
+ *
+ * @return
+ */
+void metrics_serve(int listen_fd, void (*collect)(metrics_buffer *mb, void *arg), void *arg) {
+	char request[METRICS_REQUEST_SIZE], header[256];
+	struct timeval timeout = { 1, 0 };	// A stalled scraper must not block the next one for long.
+	metrics_buffer mb;
+	ssize_t n;
+	int fd;
+
+	memset(&mb, 0, sizeof(mb));
+	for (;;) {
+		if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+			// shutdown() of the socket makes accept() fail with EINVAL.
+			if (errno == EINVAL || errno == EBADF)
+				break;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		n = read(fd, request, sizeof(request) - 1);
+		request[(n > 0) ? n : 0] = '\0';
+
+		if (strncmp(request, "GET /metrics", 12) && strncmp(request, "GET / ", 6)) {
+			snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+			metrics_write_all(fd, header, strlen(header));
+			close(fd);
+			continue;
+		}
+
+		mb.length = 0;
+		metrics_write_stats(&mb);
+		if (collect)
+			collect(&mb, arg);
+
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+			(unsigned long) mb.length);
+		if (!metrics_write_all(fd, header, strlen(header)))
+			metrics_write_all(fd, mb.data, mb.length);
+		close(fd);
+	}
+	free(mb.data);
+}
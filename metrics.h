@@ -0,0 +1,44 @@
+/* metrics.h
+
+	Prometheus text format metrics of the key-value server, served over
+	plain HTTP on a local port.
+
+	A scrape only reads the per-worker statistics blocks with relaxed
+	loads, so it takes no lock the consumer threads wait on.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+// Growable text buffer a scrape is written into.
+typedef struct metrics_buffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+} metrics_buffer;
+
+// append printf-style text to 'mb'.
+void metrics_printf(metrics_buffer *mb, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// append a gauge with its HELP and TYPE lines.
+void metrics_gauge(metrics_buffer *mb, const char *name, const char *help, double value);
+
+// append the samples of a histogram of nanoseconds, as seconds, labelled label="value".
+// The caller writes the HELP and TYPE lines.
+void metrics_histogram(metrics_buffer *mb, const char *name, const char *label, const char *value, const histogram *h);
+
+// append the request counters and latency histograms of all workers.
+void metrics_write_stats(metrics_buffer *mb);
+
+// open a listening socket on 127.0.0.1:'port'. The socket on success, -1 on error.
+int metrics_listen(int port);
+
+// answer scrapes on 'listen_fd' until shutdown() is called on it; 'collect' may
+// append server-specific metrics.
+void metrics_serve(int listen_fd, void (*collect)(metrics_buffer *mb, void *arg), void *arg);
+
+#endif
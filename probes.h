@@ -0,0 +1,44 @@
+/* probes.h
+
+	USDT (SystemTap/DTrace style) static probes.
+
+	When <sys/sdt.h> is available, every PROBEn() site compiles to a
+	single nop plus a note in the ELF file, so perf, bpftrace or
+	SystemTap can attach to it in a running binary:
+
+		bpftrace -l 'usdt:./server:*'
+		bpftrace -e 'usdt:./server:kissdb:get__done { @pages = hist(arg0); }'
+
+	A probe costs nothing until a tracer attaches. Without <sys/sdt.h>,
+	or when built with -DNO_PROBES, the macros expand to nothing.
+*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+
+#define PROBE0(provider, name)				DTRACE_PROBE(provider, name)
+#define PROBE1(provider, name, a)			DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b)			DTRACE_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c)			DTRACE_PROBE3(provider, name, a, b, c)
+#define PROBE4(provider, name, a, b, c, d)		DTRACE_PROBE4(provider, name, a, b, c, d)
+
+#else
+
+#define PROBE0(provider, name)				do { } while (0)
+#define PROBE1(provider, name, a)			do { } while (0)
+#define PROBE2(provider, name, a, b)			do { } while (0)
+#define PROBE3(provider, name, a, b, c)			do { } while (0)
+#define PROBE4(provider, name, a, b, c, d)		do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+"""scaling_bench.py
+
+	End-to-end scaling benchmark of the key-value server.
+
+	Builds the server once per number of consumer threads
+	(-DNUMBER_OF_CONSUMER_THREADS), starts it on localhost in a scratch
+	directory, preloads the key space and drives it with the client's load
+	generator for every combination of client concurrency and PUT share.
+	Throughput and latency percentiles of every point are written to a JSON
+	file, and can be compared against a stored baseline: points whose
+	throughput dropped or whose p99 latency grew by more than the tolerance
+	are reported as regressions and make the script exit with status 1.
+
+	Usage:
+		./scaling_bench.py --threads 1,2,4,8 --concurrency 4,16,64 --write-percent 10,50
+		./scaling_bench.py --output new.json --baseline baseline.json --tolerance 0.1
+		./scaling_bench.py --output baseline.json		# record a new baseline
+"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.abspath(__file__))
+SERVER_SOURCES = ["server.c", "utils.c", "kissdb.c", "histogram.c", "stats.c", "memstore.c", "singleflight.c", "combiner.c", "scheduler.c",
+	"affinity.c", "metrics.c", "lockprof.c", "trace.c"]
+CLIENT_SOURCES = ["client.c", "utils.c", "histogram.c"]
+CFLAGS = ["-O2", "-Wall"]
+SERVER_PORT = 6767		# MY_PORT in server.c, SERVER_PORT in client.c.
+UNIX_SOCKET = "kvserver.sock"	# UNIX_SOCKET_PATH in server.c, relative to the server's directory.
+START_TIMEOUT = 10		# Seconds to wait for the server to listen.
+STOP_TIMEOUT = 15		# Seconds to wait for a graceful shutdown (SHUTDOWN_DRAIN_MS and more).
+
+
+def int_list(text):
+	return [int(x) for x in text.split(",") if x]
+
+
+def build(output, sources, defines):
+	"""Compiles 'sources' into 'output' with -D'defines'."""
+	command = ["gcc"] + CFLAGS + ["-D%s" % d for d in defines] + ["-o", output] \
+		+ [os.path.join(REPO, s) for s in sources] + ["-lpthread", "-lm"]
+	subprocess.run(command, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def port_open():
+	try:
+		with socket.create_connection(("127.0.0.1", SERVER_PORT), timeout=0.2):
+			return True
+	except OSError:
+		return False
+
+
+def start_server(binary, directory):
+	"""Starts the server in 'directory' and waits until it accepts connections."""
+	log = open(os.path.join(directory, "server.log"), "w")
+	server = subprocess.Popen([binary], cwd=directory, stdout=log, stderr=log)
+	deadline = time.time() + START_TIMEOUT
+	while time.time() < deadline:
+		if server.poll() is not None:
+			sys.exit("server exited during startup, see %s" % log.name)
+		if port_open():
+			return server
+		time.sleep(0.05)
+	server.kill()
+	sys.exit("server did not start listening on port %d" % SERVER_PORT)
+
+
+def stop_server(server):
+	"""Shuts the server down gracefully (SIGTERM), killing it if it hangs."""
+	server.send_signal(signal.SIGTERM)
+	try:
+		server.wait(STOP_TIMEOUT)
+	except subprocess.TimeoutExpired:
+		server.kill()
+		server.wait()
+	# Let the port leave the listening state before the next server binds it.
+	while port_open():
+		time.sleep(0.05)
+
+
+def run_client(binary, args):
+	"""Runs the load generator and returns its JSON report."""
+	result = subprocess.run([binary, "-j"] + args, check=True, stdout=subprocess.PIPE, universal_newlines=True)
+	return json.loads(result.stdout.strip().splitlines()[-1])
+
+
+def client_args(options, concurrency, write_percent, directory):
+	args = ["-t", str(options.duration), "-w", str(write_percent), "-k", str(options.keys),
+		"-v", str(options.value_size), "-d", options.distribution]
+	if options.unix:
+		args += ["-u", os.path.join(directory, UNIX_SOCKET)]
+	if options.event:
+		# A few threads drive 'concurrency' connections.
+		args += ["-e", "-c", str(min(concurrency, options.event_threads)), "-n", str(concurrency)]
+	else:
+		args += ["-c", str(concurrency)]
+	if options.rate:
+		args += ["-r", str(options.rate)]
+	return args
+
+
+def run_points(options, work):
+	client = os.path.join(work, "client")
+	build(client, CLIENT_SOURCES, [])
+	points = []
+
+	for threads in options.threads:
+		server = os.path.join(work, "server-%d" % threads)
+		build(server, SERVER_SOURCES, ["NUMBER_OF_CONSUMER_THREADS=%d" % threads])
+
+		for concurrency in options.concurrency:
+			for write_percent in options.write_percent:
+				# Every point starts from a fresh database holding the key space.
+				directory = tempfile.mkdtemp(prefix="point-", dir=work)
+				process = start_server(server, directory)
+				try:
+					if options.warmup > 0:
+						run_client(client, ["-t", str(options.warmup), "-w", "100", "-k", str(options.keys),
+							"-v", str(options.value_size), "-c", "8"])
+					report = run_client(client, client_args(options, concurrency, write_percent, directory))
+				finally:
+					stop_server(process)
+				shutil.rmtree(directory, ignore_errors=True)
+
+				latency = report["response"] if options.rate else report["service"]
+				point = {
+					"consumer_threads": threads,
+					"concurrency": concurrency,
+					"write_percent": write_percent,
+					"throughput": report["throughput"],
+					"requests": report["requests"],
+					"failures": report["failures"],
+					"busy": report["busy"],
+					"unsent": report["unsent"],
+					"goodput": report["goodput"],
+					"p50_us": latency["p50_us"],
+					"p90_us": latency["p90_us"],
+					"p99_us": latency["p99_us"],
+					"p999_us": latency["p999_us"],
+					"max_us": latency["max_us"],
+				}
+				points.append(point)
+				print("threads=%-3d concurrency=%-5d put=%3d%%  %10.1f req/s  p50 %9.1f us  p99 %9.1f us  failures %d"
+					% (threads, concurrency, write_percent, point["throughput"], point["p50_us"], point["p99_us"],
+					point["failures"]), flush=True)
+	return points
+
+
+def point_key(point):
+	return (point["consumer_threads"], point["concurrency"], point["write_percent"])
+
+
+def compare(points, baseline, tolerance, latency_tolerance):
+	"""Prints every point next to its baseline. Returns the number of regressions."""
+	previous = dict((point_key(p), p) for p in baseline["points"])
+	regressions = 0
+
+	print("\n%-8s %-11s %-4s %12s %8s %10s %8s  %s" % ("threads", "concurrency", "put%", "req/s", "change", "p99 (us)", "change", ""))
+	for point in points:
+		old = previous.get(point_key(point))
+		if not old:
+			print("%-8d %-11d %-4d %12.1f %8s %10.1f %8s  new point" % (point_key(point) + (point["throughput"], "", point["p99_us"], "")))
+			continue
+		throughput_change = (point["throughput"] - old["throughput"]) / old["throughput"] if old["throughput"] else 0.0
+		p99_change = (point["p99_us"] - old["p99_us"]) / old["p99_us"] if old["p99_us"] else 0.0
+		flags = []
+		if throughput_change < -tolerance:
+			flags.append("THROUGHPUT REGRESSION")
+		if p99_change > latency_tolerance:
+			flags.append("LATENCY REGRESSION")
+		regressions += 1 if flags else 0
+		print("%-8d %-11d %-4d %12.1f %+7.1f%% %10.1f %+7.1f%%  %s" % (point_key(point) + (point["throughput"],
+			100 * throughput_change, point["p99_us"], 100 * p99_change, ", ".join(flags))))
+	return regressions
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Scaling benchmark of the key-value server.")
+	parser.add_argument("--threads", type=int_list, default=[1, 2, 4, 8], help="consumer thread counts (default 1,2,4,8)")
+	parser.add_argument("--concurrency", type=int_list, default=[4, 16, 64], help="client concurrency (default 4,16,64)")
+	parser.add_argument("--write-percent", type=int_list, default=[10, 50], help="PUT shares (default 10,50)")
+	parser.add_argument("--duration", type=float, default=5, help="seconds per point (default 5)")
+	parser.add_argument("--warmup", type=float, default=1, help="seconds of PUTs preloading each point (default 1)")
+	parser.add_argument("--keys", type=int, default=10000, help="key space (default 10000)")
+	parser.add_argument("--value-size", type=int, default=100, help="value size (default 100)")
+	parser.add_argument("--distribution", default="uniform", help="key distribution, as the client's -d (default uniform)")
+	parser.add_argument("--rate", type=float, default=0, help="open loop rate; reports corrected latency (default closed loop)")
+	parser.add_argument("--event", action="store_true", help="use the event driven client, concurrency = connections")
+	parser.add_argument("--unix", action="store_true", help="connect over the server's Unix domain socket instead of TCP")
+	parser.add_argument("--event-threads", type=int, default=4, help="client threads with --event (default 4)")
+	parser.add_argument("--output", default="scaling.json", help="results file (default scaling.json)")
+	parser.add_argument("--baseline", help="compare against this results file")
+	parser.add_argument("--tolerance", type=float, default=0.10, help="allowed throughput drop (default 0.10)")
+	parser.add_argument("--latency-tolerance", type=float, default=0.25, help="allowed p99 increase (default 0.25)")
+	options = parser.parse_args()
+
+	if port_open():
+		sys.exit("port %d is already in use; stop the running server first" % SERVER_PORT)
+
+	work = tempfile.mkdtemp(prefix="scaling-bench-")
+	try:
+		points = run_points(options, work)
+	finally:
+		shutil.rmtree(work, ignore_errors=True)
+
+	try:
+		commit = subprocess.run(["git", "-C", REPO, "rev-parse", "--short", "HEAD"], stdout=subprocess.PIPE,
+			stderr=subprocess.DEVNULL, universal_newlines=True).stdout.strip()
+	except OSError:
+		commit = ""
+	results = {
+		"meta": {
+			"date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+			"host": socket.gethostname(),
+			"commit": commit,
+			"duration": options.duration,
+			"keys": options.keys,
+			"value_size": options.value_size,
+			"distribution": options.distribution,
+			"rate": options.rate,
+			"event": options.event,
+		},
+		"points": points,
+	}
+	with open(options.output, "w") as out:
+		json.dump(results, out, indent=1)
+	print("\nResults written to %s" % options.output)
+
+	if options.baseline:
+		with open(options.baseline) as f:
+			baseline = json.load(f)
+		regressions = compare(points, baseline, options.tolerance, options.latency_tolerance)
+		if regressions:
+			print("\n%d point(s) regressed beyond tolerance." % regressions)
+			return 1
+		print("\nNo regressions.")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
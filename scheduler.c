@@ -0,0 +1,205 @@
+/* scheduler.c
+
+	Admission of parsed requests to the database.
+*/
+
+#include <string.h>
+#include <time.h>
+#include "scheduler.h"
+#include "lockprof.h"
+
+// The server runs one scheduler, profiled as one site.
+LOCKPROF_SITE(scheduler_lock)
+
+static const char *lane_names[LANES] = { "GET", "PUT" };
+static const char *policy_names[] = { "writer-preferring", "reader-preferring", "phase-fair" };
+
+/**
+ * @name scheduler_clock - Reads the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+static uint64_t scheduler_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * @name scheduler_init - Initializes the scheduler.
+ * @param s: The scheduler.
+ * @param policy: One of the SCHED_ constants.
+ *
+ * @return
+ */
+void scheduler_init(scheduler *s, int policy) {
+	int lane;
+
+	memset(s, 0, sizeof(scheduler));
+	pthread_mutex_init(&s->lock, NULL);
+	s->policy = policy;
+	for (lane = 0; lane < LANES; lane++)
+		pthread_cond_init(&s->lanes[lane].cond, NULL);
+}
+
+/**
+ * @name get_may_enter - Tells whether a GET may enter. Called with the
+ * lock held.
+ * @param s: The scheduler.
+ * @param phase: The phase the GET arrived in.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+static int get_may_enter(const scheduler *s, uint64_t phase) {
+	const scheduler_lane *puts = &s->lanes[LANE_PUT];
+
+	if (puts->active)
+		return 0;
+	switch (s->policy) {
+		case SCHED_READER_PREFERRING:
+			return 1;
+		case SCHED_WRITER_PREFERRING:
+			return puts->waiting == 0;
+		default:
+			// A GET that waited for a PUT goes before the next one.
+			return puts->waiting == 0 || phase != s->phase;
+	}
+}
+
+/**
+ * @name put_may_enter - Tells whether a PUT may enter. Called with the
+ * lock held.
+ * @param s: The scheduler.
+ * @param ticket: The PUT's place in arrival order.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+static int put_may_enter(const scheduler *s, uint64_t ticket) {
+	const scheduler_lane *gets = &s->lanes[LANE_GET];
+	const scheduler_lane *puts = &s->lanes[LANE_PUT];
+
+	if (puts->active || gets->active || ticket != puts->serving)
+		return 0;
+	switch (s->policy) {
+		case SCHED_READER_PREFERRING:
+			return gets->waiting == 0;
+		case SCHED_WRITER_PREFERRING:
+			return 1;
+		default:
+			return s->released == 0;
+	}
+}
+
+/**
+ * @name scheduler_enter - Waits in a lane until the policy lets the
+ * request into the database.
+ * @param s: The scheduler.
+ * @param lane: LANE_GET or LANE_PUT.
+ *
+ * @return
+ */
+void scheduler_enter(scheduler *s, int lane) {
+	scheduler_lane *l = &s->lanes[lane];
+	uint64_t start = scheduler_clock(), ticket, phase;
+
+	LOCKPROF_LOCK_AT(s->lock, scheduler_lock);
+	l->waiting++;
+	if (l->waiting > l->max_waiting)
+		l->max_waiting = l->waiting;
+
+	if (lane == LANE_GET) {
+		phase = s->phase;
+		while (!get_may_enter(s, phase))
+			LOCKPROF_COND_WAIT_AT(l->cond, s->lock, scheduler_lock);
+		if (phase != s->phase && s->released > 0)
+			s->released--;
+	}
+	else {
+		ticket = l->next_ticket++;
+		while (!put_may_enter(s, ticket))
+			LOCKPROF_COND_WAIT_AT(l->cond, s->lock, scheduler_lock);
+		l->serving++;
+	}
+
+	l->waiting--;
+	l->active++;
+	l->admitted++;
+	histogram_record(&l->wait, scheduler_clock() - start);
+	LOCKPROF_UNLOCK_AT(s->lock, scheduler_lock);
+}
+
+/**
+ * @name scheduler_leave - Leaves the database and wakes the lanes that
+ * may enter now.
+ * @param s: The scheduler.
+ * @param lane: The lane the request entered from.
+ *
+ * @return
+ */
+void scheduler_leave(scheduler *s, int lane) {
+	scheduler_lane *gets = &s->lanes[LANE_GET];
+	scheduler_lane *puts = &s->lanes[LANE_PUT];
+
+	LOCKPROF_LOCK_AT(s->lock, scheduler_lock);
+	if (lane == LANE_GET) {
+		gets->active--;
+		if (gets->active == 0 && puts->waiting)
+			pthread_cond_broadcast(&puts->cond);
+	}
+	else {
+		puts->active--;
+		s->phase++;
+		// The GETs waiting now belong to the phase that just ended.
+		if (s->policy == SCHED_PHASE_FAIR)
+			s->released = gets->waiting;
+		if (gets->waiting)
+			pthread_cond_broadcast(&gets->cond);
+		// PUTs enter in ticket order, so wake them all to find the next.
+		if (puts->waiting)
+			pthread_cond_broadcast(&puts->cond);
+	}
+	LOCKPROF_UNLOCK_AT(s->lock, scheduler_lock);
+}
+
+/**
+ * @name scheduler_get_counts - Copies the counters of every lane under
+ * the lock, so a reader never sees them halfway through an update.
+ * @param s: The scheduler.
+ * @param counts: Receives LANES entries, indexed by lane.
+ *
+ * @return
+ */
+void scheduler_get_counts(scheduler *s, scheduler_counts counts[LANES]) {
+	int lane;
+
+	LOCKPROF_LOCK_AT(s->lock, scheduler_lock);
+	for (lane = 0; lane < LANES; lane++) {
+		counts[lane].waiting = s->lanes[lane].waiting;
+		counts[lane].max_waiting = s->lanes[lane].max_waiting;
+		counts[lane].admitted = s->lanes[lane].admitted;
+	}
+	LOCKPROF_UNLOCK_AT(s->lock, scheduler_lock);
+}
+
+/**
+ * @name scheduler_lane_name - Returns the name of a lane.
+ * @param lane: LANE_GET or LANE_PUT.
+ *
+ * @return The name.
+ */
+const char *scheduler_lane_name(int lane) {
+
+	return lane_names[lane];
+}
+
+/**
+ * @name scheduler_policy_name - Returns the name of a policy.
+ * @param policy: One of the SCHED_ constants.
+ *
+ * @return The name.
+ */
+const char *scheduler_policy_name(int policy) {
+
+	return policy_names[policy];
+}
@@ -0,0 +1,79 @@
+/* scheduler.h
+
+	Admission of parsed requests to the database.
+
+	A request waits in the lane of its operation until the scheduler lets
+	it in: any number of GETs may be in the database together, a PUT only
+	alone. PUTs are let in one at a time in arrival order. Which lane goes
+	first when both have requests waiting is the policy:
+
+	SCHED_WRITER_PREFERRING	A waiting PUT holds back new GETs. A steady
+				stream of PUTs can starve GETs.
+	SCHED_READER_PREFERRING	GETs enter whenever no PUT is in. A steady
+				stream of GETs can starve PUTs.
+	SCHED_PHASE_FAIR	A waiting PUT holds back new GETs, and when a
+				PUT leaves, every GET that waited for it enters
+				before the next PUT. Neither lane waits more
+				than one phase of the other.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "histogram.h"
+
+#define SCHED_WRITER_PREFERRING 0
+#define SCHED_READER_PREFERRING 1
+#define SCHED_PHASE_FAIR        2
+
+#define LANE_GET 0		// Shared access.
+#define LANE_PUT 1		// Exclusive access.
+#define LANES    2
+
+typedef struct scheduler_lane {
+	pthread_cond_t cond;		// Signalled when requests of this lane may enter.
+	int waiting;			// Requests waiting to enter.
+	int max_waiting;		// Deepest the lane has been.
+	int active;			// Requests in the database.
+	uint64_t next_ticket;		// PUTs: arrival order.
+	uint64_t serving;		// PUTs: ticket of the next to enter.
+	uint64_t admitted;		// Requests let in.
+	histogram wait;			// Time spent waiting to enter, in nanoseconds.
+} scheduler_lane;
+
+// The counters of a lane, copied at one instant.
+typedef struct scheduler_counts {
+	int waiting;
+	int max_waiting;
+	uint64_t admitted;
+} scheduler_counts;
+
+typedef struct scheduler {
+	pthread_mutex_t lock;
+	int policy;
+	uint64_t phase;			// PUTs that have left the database.
+	int released;			// Phase-fair: GETs let through by the last PUT, not yet in.
+	scheduler_lane lanes[LANES];
+} scheduler;
+
+// initialize with one of the SCHED_ policies.
+void scheduler_init(scheduler *s, int policy);
+
+// wait in 'lane' until the policy lets the request into the database.
+void scheduler_enter(scheduler *s, int lane);
+
+// leave the database, letting in whoever the policy picks next.
+void scheduler_leave(scheduler *s, int lane);
+
+// copy the counters of every lane into 'counts'.
+void scheduler_get_counts(scheduler *s, scheduler_counts counts[LANES]);
+
+// name of a lane, e.g. "GET".
+const char *scheduler_lane_name(int lane);
+
+// name of a policy, e.g. "phase-fair".
+const char *scheduler_policy_name(int policy);
+
+#endif
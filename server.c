@@ -12,41 +12,105 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <signal.h>
+#include <semaphore.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include "utils.h"
 #include "kissdb.h"
+#include "memstore.h"
+#include "stats.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "probes.h"
+#include "singleflight.h"
+#include "combiner.h"
+#include "scheduler.h"
+#include "affinity.h"
 
 #define MY_PORT                 6767
 #define BUF_SIZE                1160
 #define KEY_SIZE                 128
 #define HASH_SIZE               1024
 #define VALUE_SIZE              1024
-#define MAX_PENDING_CONNECTIONS   5
+#define MAX_PENDING_CONNECTIONS 128
+#ifndef NUMBER_OF_CONSUMER_THREADS		// Can be set with -D, as the scaling benchmark does.
 #define NUMBER_OF_CONSUMER_THREADS 8
+#endif
 #define QUEUE_SIZE 100
+#define DB_POOL_BLOCKS 0		// O_DIRECT buffer pool size in KISSDB_BLOCK_SIZE blocks, 0 to use stdio.
 #define BILLION 1000000000
+#define DB_PATH "mydb.db"
+
+// Storage engines.
+#define ENGINE_KISSDB 0		// Requests are served from the KISSDB file.
+#define ENGINE_MEMORY 1		// Requests are served from memory; KISSDB is written in the background.
+#define ENGINE_LSM 2		// PUTs go to a memtable flushed to KISSDB in batches; GETs check it first.
+#define ENGINE ENGINE_KISSDB
+
+#define MEMSTORE_BUCKETS (1 << 18)
+#define CHANGE_LOG_PATH "mydb.log"
+#define LOG_INTERVAL_MS 100		// PUTs are logged this often; bounds what a crash can lose.
+#define CHECKPOINT_INTERVAL_MS 5000	// Logged PUTs are applied to KISSDB this often.
+#define MEMTABLE_BUCKETS (1 << 16)
+#define MEMTABLE_ENTRIES 32768		// A memtable this full is flushed right away.
+#define MEMTABLE_FLUSH_INTERVAL_MS 1000	// Any other non-empty memtable is flushed this often.
+#define SNAPSHOT_PATH "mydb.db.snapshot"	// Written on SIGUSR1.
+#define METRICS_PORT 6768		// Prometheus metrics on 127.0.0.1, 0 to disable.
+#define TRACE_PATH "trace.json"		// Written on SIGUSR2.
+#define SLOW_REQUEST_US 50000		// Slower requests are logged to SLOW_LOG_PATH, 0 to disable.
+#define SLOW_LOG_PATH "slow_requests.log"
+#define SHUTDOWN_DRAIN_MS 5000		// Queued connections still waiting after this are dropped.
+#define ACCEPT_POLL_MS 200		// How often the producer checks for a shutdown request.
+#define GET_COALESCING 1	// GETs of a key that is being read from KISSDB share that read.
+#define PUT_COMBINING 1		// Concurrent PUTs are written to KISSDB as one batch.
+#define SCHEDULER_POLICY SCHED_PHASE_FAIR	// Order of waiting GETs and PUTs, see scheduler.h.
+#define KEEP_ALIVE 1		// Serve further requests on a connection until the client closes it.
+#define MAX_EVENTS 64		// Ready connections taken from epoll at a time.
+#define CONNECTION_BUFFER_SIZE 4096	// Read buffer of every connection; holds a few requests.
+#define QUEUE_DEADLINE_MS 100		// Requests queued longer are answered BUSY, 0 to serve them all.
+#define REJECT_DRAIN_MS 5		// How long a BUSY connection may keep the producer waiting for its request.
+#define PIN_THREADS 0		// Pin every consumer thread to a CPU of its own, spread over the NUMA nodes.
+#define PRODUCER_CPU 0		// CPU of the producer (main) thread when pinning, -1 to leave it floating.
+#define STEER_BY_NODE 1		// Pinned: queue a request for the consumers on the node its packets arrived on.
+#define UNIX_SOCKET_PATH "kvserver.sock"	// Local clients may connect here instead of MY_PORT, "" to disable.
+#define LARGE_VALUE_MAX (64 << 20)	// Longest value PUT_LARGE accepts, in bytes.
+#define STREAM_CHUNK_SIZE 65536		// Large values cross the socket in frames of up to this many bytes.
 
 pthread_mutex_t full_queue_cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(full_queue_cond_mutex)
 pthread_cond_t full_queue_cond_var = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t empty_queue_cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(empty_queue_cond_mutex)
 pthread_cond_t empty_queue_cond_var = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t writer_cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t writer_cond_var = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t reader_cond_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t reader_cond_var = PTHREAD_COND_INITIALIZER;
 
-pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t enqueue_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(enqueue_mutex)
 pthread_mutex_t dequeue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t update_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(dequeue_mutex)
+pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(persist_mutex)
+pthread_rwlock_t memtable_lock = PTHREAD_RWLOCK_INITIALIZER;
+LOCKPROF_SITE(memtable_lock)
+pthread_mutex_t memtable_cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+LOCKPROF_SITE(memtable_cond_mutex)
+pthread_cond_t memtable_full_cond_var = PTHREAD_COND_INITIALIZER;
+pthread_cond_t memtable_flushed_cond_var = PTHREAD_COND_INITIALIZER;
 
 // Definition of the operation type.
 typedef enum operation {
 	PUT,
-	GET
+	GET,
+	STATS,
+	PUT_LARGE,
+	GET_LARGE
 } Operation; 
 
 // Definition of the request.
@@ -60,64 +124,157 @@ typedef struct request {
 typedef struct connection_info {
 
 	int fd;		// File descriptor returned by accept() in producer (main) thread.
-	struct timespec connection_start;
+	int polled;		// Reported readable by epoll; the client may have closed the connection instead.
+	frame_reader *reader;	// Bytes received on the connection but not yet served.
+	uint64_t id;		// Request number, for tracing.
+	uint64_t connection_start;	// Arrival, from stats_clock().
 } connection_info;
 
 // Definition of the database.
 KISSDB *db = NULL;
 
 pthread_t thread_id[NUMBER_OF_CONSUMER_THREADS];
-
-double total_waiting_time = 0;	// ...of requests in queue.
-double total_service_time = 0;	// ...of completed requests.
-int completed_requests = 0;
-
-int reader_count = 0;		// Threads serving a GET request. Unlimited at a time.
-int writer_count = 0;		// Threads serving a PUT request. Max 1 at a time.
-
-int stop = 0;		// Used for informing consumer threads to wrap it up.
-
-// Definition of the queue holding the request new_requests.
-connection_info queue[QUEUE_SIZE];
+pthread_t snapshot_thread_id;
+pthread_t persist_thread_id;
+pthread_t flush_thread_id;
+pthread_t metrics_thread_id;
+int metrics_fd = -1;		// Listening socket of the metrics thread, -1 if none.
+sem_t snapshot_sem;		// Posted by the SIGUSR1 handler.
+pthread_t trace_dump_thread_id;
+sem_t trace_sem;		// Posted by the SIGUSR2 handler.
+FILE *slow_log = NULL;
+
+// Admission to KISSDB: readers (GETs) from one lane, writers (PUTs and flushes) from the other.
+scheduler db_scheduler;
+
+int epoll_fd = -1;		// The listening sockets and the idle kept-alive connections.
+frame_reader **open_connections = NULL;	// By descriptor; whoever holds a connection updates its slot.
+int max_connections = 0;	// Slots in open_connections, the descriptor limit.
+int listeners[2] = { -1, -1 };	// The TCP and Unix domain listening sockets; epoll events of a listener point to its entry.
+uint64_t next_request_id = 0;	// Updated atomically.
+uint64_t service_estimate = 0;	// Moving average of the time a consumer takes per request, in nanoseconds.
+uint64_t rejected_connections = 0;	// Refused at accept because the queue was too long.
+
+volatile sig_atomic_t stop = 0;	// Used for informing consumer threads to wrap it up.
+volatile int stop_background = 0;	// Set once the consumers are gone; background threads exit.
+
+// KISSDB reads in flight, shared by concurrent GETs of the same key.
+singleflight get_flights;
+
+// PUTs waiting to be written to KISSDB by whichever thread holds the writer role.
+combiner put_combiner;
+
+// State of the in-memory engine.
+memstore memory_store;
+FILE *change_log = NULL;
+char *pending_puts = NULL;	// Logged but not yet applied to KISSDB, KEY_SIZE + VALUE_SIZE bytes each.
+size_t pending_count = 0;
+size_t pending_capacity = 0;
+
+// State of the LSM engine. Both pointers are protected by memtable_lock.
+memstore memtables[2];
+memstore *active_memtable = NULL;	// Receives PUTs.
+memstore *flushing_memtable = NULL;	// Being written to KISSDB, still visible to GETs.
+
+// Definition of the queue holding the request new_requests. With pinned
+// consumers there is one per NUMA node; a consumer serves its own node's
+// queue first and takes from the others when it runs dry.
+typedef struct request_queue {
+	connection_info entries[QUEUE_SIZE];
+	int head;
+	int tail;
+	int items;		// Updated atomically.
+} request_queue;
+
+request_queue queues[AFFINITY_MAX_NODES];
+int number_of_queues = 1;
+int node_queue[AFFINITY_MAX_NODES];	// Queue of the consumers on each node, -1 if none.
+int home_queue[NUMBER_OF_CONSUMER_THREADS];	// Queue each consumer serves first.
 int queue_is_empty = 1;
 int queue_is_full = 0;
-int head = 0;
-int tail = 0;
-int items_in_queue = 0;
+int items_in_queue = 0;		// In all queues together.
 
 void print_globals(char *called_by) {
+	int q;
 
 	printf("(Coming from %s)\n"
 		"queue_is_empty = %d\n"
 		"queue_is_full = %d\n"
-		"head = %d\n"
-		"tail = %d\n"
-		"items_in_queue = %d\n\n",
-		called_by, queue_is_empty, queue_is_full, head, tail, items_in_queue);
+		"items_in_queue = %d\n",
+		called_by, queue_is_empty, queue_is_full, items_in_queue);
+	for (q = 0; q < number_of_queues; q++)
+		printf("queue %d: head = %d, tail = %d, items = %d\n", q, queues[q].head, queues[q].tail, queues[q].items);
+	printf("\n");
 }
 
-void enqueue(connection_info new_connection_info) {
+void enqueue(connection_info new_connection_info, int q) {
+	request_queue *queue = &queues[q];
 
-	if (!(tail % QUEUE_SIZE)) { tail = 0; }
+	if (!(queue->tail % QUEUE_SIZE)) { queue->tail = 0; }
 
-	queue[tail] = new_connection_info;
-	tail++;
-	items_in_queue++;
+	queue->entries[queue->tail] = new_connection_info;
+	queue->tail++;
+	// Producer and consumers hold different mutexes.
+	__atomic_add_fetch(&queue->items, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&items_in_queue, 1, __ATOMIC_RELEASE);
 }
 
-connection_info dequeue() {
+/*
+ * @name dequeue - Takes the oldest connection of the first non-empty queue,
+ * starting from the consumer's home queue. Called with dequeue_mutex held
+ * and at least one connection queued.
+ * @param home: The queue to look at first.
+ *
+ * @return The connection.
+ */
+connection_info dequeue(int home) {
+	request_queue *queue = &queues[home];
+	int i;
+
+	for (i = 0; i < number_of_queues; i++) {
+		queue = &queues[(home + i) % number_of_queues];
+		if (__atomic_load_n(&queue->items, __ATOMIC_ACQUIRE))
+			break;
+	}
 
-	if (!(head % QUEUE_SIZE)) { head = 0; }
+	if (!(queue->head % QUEUE_SIZE)) { queue->head = 0; }
 
-	head++;
-	items_in_queue--;
+	queue->head++;
+	__atomic_sub_fetch(&queue->items, 1, __ATOMIC_ACQ_REL);
+	__atomic_sub_fetch(&items_in_queue, 1, __ATOMIC_ACQ_REL);
 
-	return queue[head - 1];
+	return queue->entries[queue->head - 1];
+}
+
+/*
+ * @name steer_connection - Picks the queue of a connection: the one of the
+ * consumers on the NUMA node whose CPU received its packets, or else the
+ * shortest.
+ * @param fd: The connection.
+ *
+ * @return The queue.
+ */
+int steer_connection(int fd) {
+	socklen_t len = sizeof(int);
+	int cpu, node, q, best = 0;
+
+	if (number_of_queues == 1)
+		return 0;
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+		node = affinity_node(cpu);
+		if (node < AFFINITY_MAX_NODES && node_queue[node] >= 0)
+			return node_queue[node];
+	}
+	for (q = 1; q < number_of_queues; q++) {
+		if (__atomic_load_n(&queues[q].items, __ATOMIC_RELAXED) < __atomic_load_n(&queues[best].items, __ATOMIC_RELAXED))
+			best = q;
+	}
+	return best;
 }
 
 int check_if_queue_is_empty() {
 
-	queue_is_empty = (items_in_queue == 0);
+	queue_is_empty = (__atomic_load_n(&items_in_queue, __ATOMIC_ACQUIRE) == 0);
 	return queue_is_empty;
 }
 
@@ -127,26 +284,537 @@ int check_if_queue_is_full() {
 	return queue_is_full;
 }
 
+/*
+ * @name update_service_estimate - Folds the time a consumer took for one
+ * request into service_estimate, with weight 1/16.
+ * @param sample: The time in nanoseconds.
+ *
+ * @return
+ */
+void update_service_estimate(uint64_t sample) {
+	uint64_t estimate = __atomic_load_n(&service_estimate, __ATOMIC_RELAXED);
+
+	// A lost update between consumers only delays the average a little.
+	__atomic_store_n(&service_estimate, estimate - estimate / 16 + sample / 16, __ATOMIC_RELAXED);
+}
+
+/*
+ * @name estimated_queue_wait - Estimates how long a request queued now
+ * would wait for a consumer thread.
+ *
+ * @return The estimate in nanoseconds.
+ */
+uint64_t estimated_queue_wait() {
+
+	return (uint64_t) __atomic_load_n(&items_in_queue, __ATOMIC_RELAXED) * __atomic_load_n(&service_estimate, __ATOMIC_RELAXED)
+		/ NUMBER_OF_CONSUMER_THREADS;
+}
+
+/*
+ * @name begin_read - Enters the database as a reader, from the GET lane.
+ * Any number of readers may proceed together; SCHEDULER_POLICY decides
+ * whether they go before waiting writers.
+ *
+ * @return
+ */
+void begin_read() {
+
+	PROBE1(kvserver, read__lock__start, db_scheduler.lanes[LANE_GET].active);
+	scheduler_enter(&db_scheduler, LANE_GET);
+	PROBE1(kvserver, read__lock__acquired, db_scheduler.lanes[LANE_GET].active);
+}
+
+/*
+ * @name end_read - Leaves the database as a reader, letting a waiting
+ * writer in when the last reader leaves.
+ *
+ * @return
+ */
+void end_read() {
+
+	PROBE1(kvserver, read__unlock, db_scheduler.lanes[LANE_GET].active);
+	scheduler_leave(&db_scheduler, LANE_GET);
+}
+
+/*
+ * @name begin_write - Enters the database as the single writer, from the
+ * PUT lane, once the active writer and all readers have left.
+ *
+ * @return
+ */
+void begin_write() {
+
+	PROBE1(kvserver, write__lock__start, db_scheduler.lanes[LANE_GET].active);
+	scheduler_enter(&db_scheduler, LANE_PUT);
+	PROBE0(kvserver, write__lock__acquired);
+}
+
+/*
+ * @name end_write - Leaves the database as the writer and lets in whoever
+ * SCHEDULER_POLICY picks next.
+ *
+ * @return
+ */
+void end_write() {
+
+	PROBE0(kvserver, write__unlock);
+	scheduler_leave(&db_scheduler, LANE_PUT);
+}
+
 void signal_handler(int sigid) {
 
+	// The producer notices within ACCEPT_POLL_MS and shuts the server down.
 	stop = 1;
+}
 
-	fprintf(stderr, "Completed requests: %d\n", completed_requests);
-	fprintf(stderr, "Total waiting time (nanosec): %.0lf\n", total_waiting_time);
-	fprintf(stderr, "Average waiting time (nanosec): %.0lf\n", total_waiting_time / (double) completed_requests);
-	fprintf(stderr, "Total service time (nanosec): %.0lf\n", total_service_time);
-	fprintf(stderr, "Average service time (nanosec): %.0lf\n", total_service_time / (double) completed_requests);
+/*
+ * @name add_pending_put - Appends a key/value pair to pending_puts.
+ * Used as the memstore_drain_dirty() callback.
+ *
+ * @return
+ */
+void add_pending_put(void *arg, const void *key, const void *value) {
+	char *grown;
 
-	// Destroy the database.
-	// Close the database.
-	KISSDB_close(db);
+	if (pending_count == pending_capacity) {
+		pending_capacity = pending_capacity ? pending_capacity * 2 : 1024;
+		if (!(grown = (char *) realloc(pending_puts, pending_capacity * (KEY_SIZE + VALUE_SIZE)))) {
+			fprintf(stderr, "(Error) persist: Cannot allocate memory for pending PUTs.\n");
+			exit(1);
+		}
+		pending_puts = grown;
+	}
+	memcpy(pending_puts + pending_count * (KEY_SIZE + VALUE_SIZE), key, KEY_SIZE);
+	memcpy(pending_puts + pending_count * (KEY_SIZE + VALUE_SIZE) + KEY_SIZE, value, VALUE_SIZE);
+	pending_count++;
+}
 
-	// Free memory.
-	if (db)
-		free(db);
-	db = NULL;
+/*
+ * @name log_changes - Appends the PUTs made since the last call to the
+ * change log and syncs it. Called with persist_mutex held.
+ *
+ * @return
+ */
+void log_changes() {
+	size_t first = pending_count;
+
+	memstore_drain_dirty(&memory_store, add_pending_put, NULL);
+	if (pending_count == first)
+		return;
+
+	if (fwrite(pending_puts + first * (KEY_SIZE + VALUE_SIZE), KEY_SIZE + VALUE_SIZE, pending_count - first, change_log) != pending_count - first
+		|| fflush(change_log) || fdatasync(fileno(change_log))) {
+
+		perror("(Error) persist: Cannot write the change log");
+	}
+}
 
-	_exit(1);
+/*
+ * @name checkpoint - Applies the logged PUTs to KISSDB, syncs it and
+ * empties the change log. Called with persist_mutex held.
+ *
+ * @return
+ */
+void checkpoint() {
+	int failed = 0;
+
+	log_changes();
+	if (!pending_count)
+		return;
+
+	begin_write();
+	if (KISSDB_put_batch(db, pending_puts, pending_count) || KISSDB_sync(db))
+		failed = 1;
+	end_write();
+
+	// Keep the log if KISSDB may not hold everything; it is replayed on restart.
+	if (failed) {
+		fprintf(stderr, "(Error) persist: Checkpoint failed, keeping the change log.\n");
+		return;
+	}
+	pending_count = 0;
+	if (ftruncate(fileno(change_log), 0) == -1 || fseek(change_log, 0, SEEK_SET))
+		perror("(Error) persist: Cannot truncate the change log");
+}
+
+/*
+ * @name persist_thread - Logs PUTs of the in-memory engine every
+ * LOG_INTERVAL_MS and checkpoints them to KISSDB every CHECKPOINT_INTERVAL_MS.
+ *
+ * @return
+ */
+void *persist_thread(void *arg) {
+
+	struct timespec interval = { LOG_INTERVAL_MS / 1000, (LOG_INTERVAL_MS % 1000) * 1000000L };
+	int since_checkpoint = 0;
+
+	while (!stop_background) {
+
+		nanosleep(&interval, NULL);
+
+		LOCKPROF_LOCK(persist_mutex);
+		since_checkpoint += LOG_INTERVAL_MS;
+		if (since_checkpoint >= CHECKPOINT_INTERVAL_MS) {
+			checkpoint();
+			since_checkpoint = 0;
+		} else
+			log_changes();
+		LOCKPROF_UNLOCK(persist_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * @name load_memory_store - Fills the in-memory engine from KISSDB and
+ * replays and checkpoints the change log left by a previous run.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int load_memory_store() {
+
+	KISSDB_Iterator dbi;
+	char key[KEY_SIZE], value[VALUE_SIZE];
+	size_t loaded = 0, replayed = 0;
+	int rc;
+
+	if (memstore_init(&memory_store, MEMSTORE_BUCKETS, KEY_SIZE, VALUE_SIZE)) {
+		fprintf(stderr, "(Error) main: Cannot allocate the in-memory store.\n");
+		return 1;
+	}
+
+	KISSDB_Iterator_init(db, &dbi);
+	while ((rc = KISSDB_Iterator_next(&dbi, key, value)) > 0) {
+		if (memstore_put(&memory_store, key, value, 0, NULL))
+			return 1;
+		loaded++;
+	}
+	if (rc < 0) {
+		fprintf(stderr, "(Error) main: Cannot read the database.\n");
+		return 1;
+	}
+
+	if (!(change_log = fopen(CHANGE_LOG_PATH, "r+b")) && !(change_log = fopen(CHANGE_LOG_PATH, "w+b"))) {
+		perror("(Error) main: Cannot open the change log");
+		return 1;
+	}
+
+	// Replayed PUTs stay pending so the checkpoint below writes them to KISSDB.
+	while (fread(key, KEY_SIZE, 1, change_log) == 1 && fread(value, VALUE_SIZE, 1, change_log) == 1) {
+		if (memstore_put(&memory_store, key, value, 0, NULL))
+			return 1;
+		add_pending_put(NULL, key, value);
+		replayed++;
+	}
+
+	// Drop a record torn by a crash before appending to the log.
+	if (ftruncate(fileno(change_log), replayed * (KEY_SIZE + VALUE_SIZE)) == -1
+		|| fseek(change_log, 0, SEEK_END)) {
+
+		perror("(Error) main: Cannot prepare the change log");
+		return 1;
+	}
+
+	// KISSDB finds its free space by walking its records, so the extents
+	// of replayed PUTs must be in them before the first PUT_LARGE.
+	if (replayed) {
+		checkpoint();
+		if (pending_count) {
+			fprintf(stderr, "(Error) main: Cannot write the replayed PUTs to the database.\n");
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "(Info) main: Loaded %zu pairs into memory, replayed %zu logged PUTs.\n", loaded, replayed);
+	return 0;
+}
+
+/*
+ * @name write_flushing_memtable - Writes the PUTs drained from the
+ * flushing memtable to KISSDB and retires it. If the write fails, the
+ * memtable stays visible to GETs and its PUTs stay pending, to be written
+ * by the next flush. Called with persist_mutex held.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+int write_flushing_memtable() {
+	int rc;
+
+	begin_write();
+	rc = KISSDB_put_batch(db, pending_puts, pending_count);
+	end_write();
+
+	if (rc) {
+		fprintf(stderr, "(Error) flush: Cannot write %zu PUTs to the database, keeping them for the next flush.\n", pending_count);
+		return rc;
+	}
+	pending_count = 0;
+
+	LOCKPROF_WRLOCK(memtable_lock);
+	memstore_clear(flushing_memtable);
+	flushing_memtable = NULL;
+	LOCKPROF_RWUNLOCK(memtable_lock);
+
+	LOCKPROF_LOCK(memtable_cond_mutex);
+	pthread_cond_broadcast(&memtable_flushed_cond_var);
+	LOCKPROF_UNLOCK(memtable_cond_mutex);
+	return 0;
+}
+
+/*
+ * @name flush_memtable - Swaps in an empty memtable and writes the full
+ * one to KISSDB as a single batch in bucket order. A memtable whose write
+ * failed before is written first. Called with persist_mutex held.
+ *
+ * @return
+ */
+void flush_memtable() {
+
+	// Until the last flush has been written there is nowhere to swap to.
+	if (flushing_memtable && write_flushing_memtable())
+		return;
+
+	LOCKPROF_WRLOCK(memtable_lock);
+	if (!memstore_count(active_memtable)) {
+		LOCKPROF_RWUNLOCK(memtable_lock);
+		return;
+	}
+	flushing_memtable = active_memtable;
+	active_memtable = (active_memtable == &memtables[0]) ? &memtables[1] : &memtables[0];
+	LOCKPROF_RWUNLOCK(memtable_lock);
+
+	// No PUT can reach the flushing memtable any more.
+	pending_count = 0;
+	memstore_drain_dirty(flushing_memtable, add_pending_put, NULL);
+	write_flushing_memtable();
+}
+
+/*
+ * @name flush_thread - Flushes the memtable of the LSM engine when it
+ * fills up or every MEMTABLE_FLUSH_INTERVAL_MS.
+ *
+ * @return
+ */
+void *flush_thread(void *arg) {
+
+	struct timespec deadline;
+
+	while (!stop_background) {
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += MEMTABLE_FLUSH_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (MEMTABLE_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= BILLION) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= BILLION;
+		}
+
+		LOCKPROF_LOCK(memtable_cond_mutex);
+		while (memstore_count(active_memtable) < MEMTABLE_ENTRIES && !stop_background) {
+			if (LOCKPROF_COND_TIMEDWAIT(memtable_full_cond_var, memtable_cond_mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		LOCKPROF_UNLOCK(memtable_cond_mutex);
+
+		LOCKPROF_LOCK(persist_mutex);
+		flush_memtable();
+		LOCKPROF_UNLOCK(persist_mutex);
+	}
+
+	return NULL;
+}
+
+void snapshot_signal_handler(int sigid) {
+
+	sem_post(&snapshot_sem);
+}
+
+/*
+ * @name snapshot_thread - Writes a point-in-time copy of the database
+ * to SNAPSHOT_PATH each time SIGUSR1 is received.
+ *
+ * Only starting and releasing the snapshot exclude PUT requests. The copy
+ * itself runs alongside them; KISSDB preserves overwritten values.
+ *
+ * @return
+ */
+void *snapshot_thread(void *arg) {
+
+	struct timespec start, finish;
+	double elapsed;
+	int rc;
+
+	while (!stop_background) {
+
+		if (sem_wait(&snapshot_sem) == -1 || stop_background) {
+			continue;	// Interrupted by a signal, or woken to exit.
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		// KISSDB lags behind the in-memory engine; bring it up to date first.
+		if (ENGINE == ENGINE_MEMORY) {
+			LOCKPROF_LOCK(persist_mutex);
+			checkpoint();
+			LOCKPROF_UNLOCK(persist_mutex);
+		} else if (ENGINE == ENGINE_LSM) {
+			LOCKPROF_LOCK(persist_mutex);
+			flush_memtable();
+			LOCKPROF_UNLOCK(persist_mutex);
+		}
+
+		begin_write();
+		rc = KISSDB_snapshot_begin(db);
+		end_write();
+
+		if (rc) {
+			fprintf(stderr, "(Error) snapshot: Cannot start snapshot (%d).\n", rc);
+			continue;
+		}
+
+		rc = KISSDB_snapshot_write(db, SNAPSHOT_PATH ".tmp");
+		if (!rc && rename(SNAPSHOT_PATH ".tmp", SNAPSHOT_PATH) == -1) {
+			rc = -1;
+		}
+
+		begin_write();
+		KISSDB_snapshot_end(db);
+		end_write();
+
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+		elapsed = (double)(finish.tv_sec - start.tv_sec) + (double)(finish.tv_nsec - start.tv_nsec) / (double)BILLION;
+
+		if (rc)
+			fprintf(stderr, "(Error) snapshot: Cannot write %s (%d).\n", SNAPSHOT_PATH, rc);
+		else
+			fprintf(stderr, "(Info) snapshot: Wrote %s in %.3f seconds.\n", SNAPSHOT_PATH, elapsed);
+	}
+
+	return NULL;
+}
+
+void trace_signal_handler(int sigid) {
+
+	sem_post(&trace_sem);
+}
+
+/*
+ * @name trace_dump_thread - Writes the trace rings of all threads to
+ * TRACE_PATH each time SIGUSR2 is received.
+ *
+ * @return
+ */
+void *trace_dump_thread(void *arg) {
+
+	while (!stop_background) {
+
+		if (sem_wait(&trace_sem) == -1 || stop_background) {
+			continue;	// Interrupted by a signal, or woken to exit.
+		}
+
+		if (trace_dump_chrome(TRACE_PATH))
+			fprintf(stderr, "(Error) trace: Cannot write %s.\n", TRACE_PATH);
+		else
+			fprintf(stderr, "(Info) trace: Wrote %s.\n", TRACE_PATH);
+	}
+
+	return NULL;
+}
+
+/*
+ * @name collect_metrics - Appends the queue and database gauges to a scrape.
+ *
+ * @return
+ */
+void collect_metrics(metrics_buffer *mb, void *arg) {
+
+	scheduler_counts counts[LANES];
+	uint64_t file_size = 0;
+	unsigned long hash_pages;
+	int lane;
+#if LOCKPROF
+	lockprof_site *site;
+	int i;
+#endif
+
+	metrics_gauge(mb, "kvserver_items_in_queue", "Connections waiting for a consumer thread.",
+		(double) __atomic_load_n(&items_in_queue, __ATOMIC_RELAXED));
+	metrics_gauge(mb, "kvserver_estimated_queue_wait_seconds", "Expected wait of a request queued now.", (double) estimated_queue_wait() / 1e9);
+	metrics_printf(mb, "# HELP kvserver_rejected_connections_total Connections refused at accept with a BUSY reply.\n# TYPE kvserver_rejected_connections_total counter\n");
+	metrics_printf(mb, "kvserver_rejected_connections_total %llu\n", (unsigned long long) __atomic_load_n(&rejected_connections, __ATOMIC_RELAXED));
+
+	// PUTs add hash table pages; read their count as a GET would.
+	begin_read();
+	hash_pages = db->num_hash_tables;
+	end_read();
+	metrics_gauge(mb, "kvserver_db_hash_pages", "Hash table pages of the KISSDB file.", (double) hash_pages);
+	KISSDB_file_size(db, &file_size);
+	metrics_gauge(mb, "kvserver_db_file_bytes", "Size of the KISSDB file.", (double) file_size);
+
+	if (ENGINE == ENGINE_MEMORY)
+		metrics_gauge(mb, "kvserver_memory_entries", "Keys held by the in-memory engine.", (double) memstore_count(&memory_store));
+
+	if (GET_COALESCING && ENGINE != ENGINE_MEMORY) {
+		metrics_printf(mb, "# HELP kvserver_get_reads_total KISSDB reads performed for GETs.\n# TYPE kvserver_get_reads_total counter\n");
+		metrics_printf(mb, "kvserver_get_reads_total %llu\n", (unsigned long long) __atomic_load_n(&get_flights.led, __ATOMIC_RELAXED));
+		metrics_printf(mb, "# HELP kvserver_get_coalesced_total GETs answered by another GET's read of the same key.\n# TYPE kvserver_get_coalesced_total counter\n");
+		metrics_printf(mb, "kvserver_get_coalesced_total %llu\n", (unsigned long long) __atomic_load_n(&get_flights.shared, __ATOMIC_RELAXED));
+	}
+
+	scheduler_get_counts(&db_scheduler, counts);
+	metrics_printf(mb, "# HELP kvserver_lane_waiting Requests waiting to enter KISSDB.\n# TYPE kvserver_lane_waiting gauge\n");
+	for (lane = 0; lane < LANES; lane++)
+		metrics_printf(mb, "kvserver_lane_waiting{lane=\"%s\"} %d\n", scheduler_lane_name(lane), counts[lane].waiting);
+	metrics_printf(mb, "# HELP kvserver_lane_max_waiting Most requests ever waiting to enter KISSDB.\n# TYPE kvserver_lane_max_waiting gauge\n");
+	for (lane = 0; lane < LANES; lane++)
+		metrics_printf(mb, "kvserver_lane_max_waiting{lane=\"%s\"} %d\n", scheduler_lane_name(lane), counts[lane].max_waiting);
+	metrics_printf(mb, "# HELP kvserver_lane_admitted_total Requests let into KISSDB.\n# TYPE kvserver_lane_admitted_total counter\n");
+	for (lane = 0; lane < LANES; lane++)
+		metrics_printf(mb, "kvserver_lane_admitted_total{lane=\"%s\"} %llu\n", scheduler_lane_name(lane),
+			(unsigned long long) counts[lane].admitted);
+	metrics_printf(mb, "# HELP kvserver_lane_wait_seconds Time spent waiting to enter KISSDB.\n# TYPE kvserver_lane_wait_seconds histogram\n");
+	for (lane = 0; lane < LANES; lane++)
+		metrics_histogram(mb, "kvserver_lane_wait_seconds", "lane", scheduler_lane_name(lane), &db_scheduler.lanes[lane].wait);
+
+	if (PUT_COMBINING && ENGINE == ENGINE_KISSDB) {
+		metrics_printf(mb, "# HELP kvserver_put_batches_total Batches of combined PUTs written to KISSDB.\n# TYPE kvserver_put_batches_total counter\n");
+		metrics_printf(mb, "kvserver_put_batches_total %llu\n", (unsigned long long) __atomic_load_n(&put_combiner.batches, __ATOMIC_RELAXED));
+		metrics_printf(mb, "# HELP kvserver_put_combined_total PUTs written through a batch.\n# TYPE kvserver_put_combined_total counter\n");
+		metrics_printf(mb, "kvserver_put_combined_total %llu\n", (unsigned long long) __atomic_load_n(&put_combiner.requests, __ATOMIC_RELAXED));
+	}
+
+#if LOCKPROF
+	metrics_printf(mb, "# HELP kvserver_lock_acquisitions_total Lock acquisitions.\n# TYPE kvserver_lock_acquisitions_total counter\n");
+	for (i = 0; i < lockprof_count(); i++) {
+		site = lockprof_get(i);
+		metrics_printf(mb, "kvserver_lock_acquisitions_total{lock=\"%s\"} %llu\n", site->name, (unsigned long long) site->acquisitions);
+	}
+	metrics_printf(mb, "# HELP kvserver_lock_contended_total Acquisitions that found the lock taken.\n# TYPE kvserver_lock_contended_total counter\n");
+	for (i = 0; i < lockprof_count(); i++) {
+		site = lockprof_get(i);
+		metrics_printf(mb, "kvserver_lock_contended_total{lock=\"%s\"} %llu\n", site->name, (unsigned long long) site->contended);
+	}
+	metrics_printf(mb, "# HELP kvserver_lock_wait_seconds Time blocked acquiring a lock.\n# TYPE kvserver_lock_wait_seconds histogram\n");
+	for (i = 0; i < lockprof_count(); i++)
+		metrics_histogram(mb, "kvserver_lock_wait_seconds", "lock", lockprof_get(i)->name, &lockprof_get(i)->wait);
+	metrics_printf(mb, "# HELP kvserver_lock_hold_seconds Time a lock was held.\n# TYPE kvserver_lock_hold_seconds histogram\n");
+	for (i = 0; i < lockprof_count(); i++)
+		metrics_histogram(mb, "kvserver_lock_hold_seconds", "lock", lockprof_get(i)->name, &lockprof_get(i)->hold);
+	metrics_printf(mb, "# HELP kvserver_lock_cond_wait_seconds Time blocked on a condition variable.\n# TYPE kvserver_lock_cond_wait_seconds histogram\n");
+	for (i = 0; i < lockprof_count(); i++)
+		metrics_histogram(mb, "kvserver_lock_cond_wait_seconds", "lock", lockprof_get(i)->name, &lockprof_get(i)->cond_wait);
+#endif
+}
+
+/*
+ * @name metrics_thread - Serves Prometheus metrics on METRICS_PORT.
+ *
+ * @return
+ */
+void *metrics_thread(void *arg) {
+
+	metrics_serve((int)(intptr_t) arg, collect_metrics, NULL);
+	return NULL;
 }
 
 /**
@@ -156,7 +824,7 @@ void signal_handler(int sigid) {
  * @return Initialized request on Success. NULL on Error.
  */
 Request *parse_request(char *buffer) {
-	char *token = NULL;
+	char *token = NULL, *saveptr = NULL;
 	Request *req = NULL;
 
 	// Check arguments.
@@ -169,18 +837,25 @@ Request *parse_request(char *buffer) {
 	memset(req->value, 0, VALUE_SIZE);
 
 	// Extract the operation type.
-	token = strtok(buffer, ":");    
+	token = strtok_r(buffer, ":", &saveptr);    
 	if (!strcmp(token, "PUT")) {
 		req->operation = PUT;
 	} else if (!strcmp(token, "GET")) {
 		req->operation = GET;
+	} else if (!strcmp(token, "STATS")) {
+		req->operation = STATS;
+		return req;
+	} else if (!strcmp(token, "PUT_LARGE")) {
+		req->operation = PUT_LARGE;
+	} else if (!strcmp(token, "GET_LARGE")) {
+		req->operation = GET_LARGE;
 	} else {
 		free(req);
 		return NULL;
 	}
 
 	// Extract the key.
-	token = strtok(NULL, ":");
+	token = strtok_r(NULL, ":", &saveptr);
 	if (token) {
 		strncpy(req->key, token, KEY_SIZE);
 	} else {
@@ -188,17 +863,390 @@ Request *parse_request(char *buffer) {
 		return NULL;
 	}
 
-	// Extract the value.
-	token = strtok(NULL, ":");
+	// Extract the value; of a PUT_LARGE, its length.
+	token = strtok_r(NULL, ":", &saveptr);
 	if (token) {
 		strncpy(req->value, token, VALUE_SIZE);
-	} else if (req->operation == PUT) {
+	} else if (req->operation == PUT || req->operation == PUT_LARGE) {
 		free(req);
 		return NULL;
 	}
 	return req;
 }
 
+/*
+ * @name db_get - Reads a key from the storage engine.
+ * @param key: The key.
+ * @param value: Buffer of VALUE_SIZE bytes receiving the value.
+ * @param lock_wait: Receives the nanoseconds spent waiting for locks.
+ *
+ * @return 0 on success, nonzero if not found or on error.
+ */
+int db_get(char *key, char *value, uint64_t *lock_wait) {
+	uint64_t wait_start;
+	singleflight_call *flight = NULL;
+	int rc;
+
+	*lock_wait = 0;
+
+	if (ENGINE == ENGINE_MEMORY)
+		return memstore_get(&memory_store, key, value);
+
+	if (ENGINE == ENGINE_LSM) {
+		wait_start = stats_clock();
+		LOCKPROF_RDLOCK(memtable_lock);
+		*lock_wait = stats_clock() - wait_start;
+		rc = memstore_get(active_memtable, key, value);
+		if (rc && flushing_memtable)
+			rc = memstore_get(flushing_memtable, key, value);
+		LOCKPROF_RWUNLOCK(memtable_lock);
+		if (!rc)
+			return 0;
+	}
+
+	// Take the result of a read of this key that is already in flight.
+	if (GET_COALESCING && !singleflight_begin(&get_flights, key, value, &rc, &flight))
+		return rc;
+
+	wait_start = stats_clock();
+	begin_read();
+	*lock_wait += stats_clock() - wait_start;
+	rc = KISSDB_get(db, key, value);
+	// Retire the read before a writer can get in, so a GET that arrives
+	// after a PUT has completed never shares a read from before it.
+	if (GET_COALESCING)
+		singleflight_finish(&get_flights, flight, value, rc);
+	end_read();
+
+	return rc;
+}
+
+/*
+ * @name apply_puts - Writes a batch of PUTs to KISSDB under a single
+ * writer lock and flush. Used as the put_combiner apply function.
+ * @param arg: Unused.
+ * @param entries: KEY_SIZE + VALUE_SIZE bytes per PUT, one per key.
+ * @param count: The number of PUTs.
+ * @param lock_wait: Receives the nanoseconds spent waiting for the writer lock.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+int apply_puts(void *arg, const void *entries, size_t count, uint64_t *lock_wait) {
+	uint64_t wait_start = stats_clock();
+	int rc;
+
+	begin_write();
+	*lock_wait = stats_clock() - wait_start;
+	if (count == 1)
+		rc = KISSDB_put(db, entries, (const char *) entries + KEY_SIZE);
+	else
+		rc = KISSDB_put_batch(db, entries, count);
+	end_write();
+
+	return rc;
+}
+
+/*
+ * @name free_replaced_extent - Frees the extent of a value that was
+ * replaced before it was handed to KISSDB, unless the new value is stored
+ * in the same extent.
+ * @param replaced: The replaced value, as memstore_put() returned it.
+ * @param value: The new value.
+ *
+ * @return
+ */
+void free_replaced_extent(char *replaced, char *value) {
+	KISSDB_Extent old, extent;
+
+	if (KISSDB_extent_decode(db, replaced, &old)
+		&& (!KISSDB_extent_decode(db, value, &extent) || extent.offset != old.offset)) {
+
+		KISSDB_extent_free(db, &old);
+	}
+}
+
+/*
+ * @name db_put - Writes a key/value pair to the storage engine.
+ * @param key: The key.
+ * @param value: The value.
+ * @param lock_wait: Receives the nanoseconds spent waiting for locks.
+ *
+ * @return 0 on success, nonzero on error.
+ */
+int db_put(char *key, char *value, uint64_t *lock_wait) {
+	char replaced[VALUE_SIZE];
+	uint64_t wait_start;
+	int rc;
+
+	*lock_wait = 0;
+
+	// A value replaced before it was logged never reaches KISSDB.
+	if (ENGINE == ENGINE_MEMORY) {
+		if (!(rc = memstore_put(&memory_store, key, value, 1, replaced)))
+			free_replaced_extent(replaced, value);
+		return rc;
+	}
+
+	if (ENGINE == ENGINE_LSM) {
+		// Hold PUTs back while the flush falls a whole memtable behind.
+		wait_start = stats_clock();
+		LOCKPROF_LOCK(memtable_cond_mutex);
+		while (flushing_memtable && memstore_count(active_memtable) >= MEMTABLE_ENTRIES) {
+			LOCKPROF_COND_WAIT(memtable_flushed_cond_var, memtable_cond_mutex);
+		}
+		LOCKPROF_UNLOCK(memtable_cond_mutex);
+
+		LOCKPROF_RDLOCK(memtable_lock);
+		*lock_wait = stats_clock() - wait_start;
+		rc = memstore_put(active_memtable, key, value, 1, replaced);
+		if (memstore_count(active_memtable) >= MEMTABLE_ENTRIES) {
+			LOCKPROF_LOCK(memtable_cond_mutex);
+			pthread_cond_signal(&memtable_full_cond_var);
+			LOCKPROF_UNLOCK(memtable_cond_mutex);
+		}
+		LOCKPROF_RWUNLOCK(memtable_lock);
+
+		// A value replaced in the active memtable never reached KISSDB.
+		if (!rc)
+			free_replaced_extent(replaced, value);
+		return rc;
+	}
+
+	// Waiting for a batch to take the PUT counts as lock time; the time
+	// its own batch spends writing counts as storage time.
+	if (PUT_COMBINING)
+		return combiner_submit(&put_combiner, key, value, lock_wait);
+
+	wait_start = stats_clock();
+	begin_write();
+	*lock_wait = stats_clock() - wait_start;
+	rc = KISSDB_put(db, key, value);
+	end_write();
+
+	return rc;
+}
+
+/*
+ * @name value_length - Returns the length of a stored value.
+ * @param value: The value, or the descriptor of the extent holding it.
+ *
+ * @return The length in bytes.
+ */
+uint64_t value_length(char *value) {
+	KISSDB_Extent extent;
+
+	if (KISSDB_extent_decode(db, value, &extent))
+		return extent.length;
+	return strlen(value);
+}
+
+/*
+ * @name put_large - Serves a PUT_LARGE. Reserves an extent for the value,
+ * answers PUT CONTINUE and writes the chunks the client then sends to the
+ * extent as they arrive; the key is stored with the extent's descriptor.
+ * An extent that is not stored is freed again.
+ * @param request: The connection.
+ * @param req: The request; its value holds the length of the large value.
+ * @param chunk: Buffer of STREAM_CHUNK_SIZE + 1 bytes.
+ * @param received: Receives the bytes of the value received.
+ * @param lock_wait: Receives the nanoseconds spent waiting for locks.
+ *
+ * @return 0 on success, 1 if the value was refused or not stored, -1 if
+ * the connection broke off in the middle of the value.
+ */
+int put_large(connection_info *request, Request *req, char *chunk, uint64_t *received, uint64_t *lock_wait) {
+	KISSDB_Extent extent;
+	uint64_t length, wait_start, wait;
+	char *end;
+	int rc, n;
+
+	*received = 0;
+	*lock_wait = 0;
+	length = strtoull(req->value, &end, 10);
+	if (*end || length == 0 || length > LARGE_VALUE_MAX)
+		return 1;
+
+	// Extents are taken from the end of the file, which a PUT may be growing.
+	wait_start = stats_clock();
+	begin_write();
+	*lock_wait = stats_clock() - wait_start;
+	rc = KISSDB_extent_alloc(db, length, &extent);
+	end_write();
+	if (rc)
+		return 1;
+
+	if (!write_str_to_socket(request->fd, "PUT CONTINUE\n", 13)) {
+		KISSDB_extent_free(db, &extent);
+		return -1;
+	}
+	// After a failed write the rest of the value is still read, so the
+	// next frame on the connection is a request again.
+	while (*received < length) {
+		if ((n = read_frame(request->reader, chunk, STREAM_CHUNK_SIZE + 1)) <= 0 || (uint64_t) n > length - *received) {
+			KISSDB_extent_free(db, &extent);
+			return -1;
+		}
+		if (!rc && KISSDB_extent_write(db, &extent, *received, chunk, n))
+			rc = 1;
+		*received += n;
+	}
+
+	// Nobody can see the extent before its descriptor is stored.
+	memset(req->value, 0, VALUE_SIZE);
+	if (rc || KISSDB_extent_encode(db, &extent, req->value)) {
+		KISSDB_extent_free(db, &extent);
+		return 1;
+	}
+
+	// The combiner keeps only the last PUT of a key in a batch and would
+	// drop the others' descriptors without freeing their extents.
+	if (ENGINE == ENGINE_KISSDB) {
+		wait_start = stats_clock();
+		begin_write();
+		*lock_wait += stats_clock() - wait_start;
+		rc = KISSDB_put(db, req->key, req->value);
+		end_write();
+	} else {
+		rc = db_put(req->key, req->value, &wait);
+		*lock_wait += wait;
+	}
+	return rc ? 1 : 0;
+}
+
+/*
+ * @name send_large - Streams a value to the client after the GET OK reply
+ * of a GET_LARGE, in frames of up to STREAM_CHUNK_SIZE bytes. Extents are
+ * never written once their descriptor is stored, so no lock is needed; the
+ * caller holds the extents so that one replaced meanwhile is not reused.
+ * @param fd: The connection.
+ * @param value: The value, or the descriptor of the extent holding it.
+ * @param chunk: Buffer of STREAM_CHUNK_SIZE bytes.
+ * @param sent: Receives the bytes of the value sent.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int send_large(int fd, char *value, char *chunk, uint64_t *sent) {
+	KISSDB_Extent extent;
+	uint64_t n;
+
+	*sent = 0;
+	// A value stored in the hash table goes in one chunk.
+	if (!KISSDB_extent_decode(db, value, &extent)) {
+		n = strlen(value);
+		if (n && !write_str_to_socket(fd, value, n))
+			return -1;
+		*sent = n;
+		return 0;
+	}
+
+	while (*sent < extent.length) {
+		n = extent.length - *sent;
+		if (n > STREAM_CHUNK_SIZE)
+			n = STREAM_CHUNK_SIZE;
+		if (KISSDB_extent_read(db, &extent, *sent, chunk, n) || !write_str_to_socket(fd, chunk, n))
+			return -1;
+		*sent += n;
+	}
+	return 0;
+}
+
+/*
+ * @name record_error - Records a request that could not be read or parsed.
+ * @param my_stats: Statistics of the calling worker.
+ * @param request: The connection.
+ * @param start: When the connection was dequeued.
+ * @param finish: When the error reply was ready.
+ * @param reply_size: Bytes of the error reply.
+ *
+ * @return
+ */
+void record_error(worker_stats *my_stats, const connection_info *request, uint64_t start, uint64_t finish, size_t reply_size) {
+
+	STAT_ADD(my_stats->counters.requests[STAT_ERROR], 1);
+	STAT_ADD(my_stats->counters.bytes_out, reply_size);
+	histogram_record(&my_stats->wait[STAT_ERROR], start - request->connection_start);
+	histogram_record(&my_stats->service[STAT_ERROR], finish - request->connection_start);
+}
+
+/*
+ * @name reject_connection - Answers BUSY to a connection the server has
+ * no time for and closes it.
+ * @param fd: The accepted socket.
+ *
+ * @return
+ */
+void reject_connection(int fd) {
+	char discard[BUF_SIZE];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	uint64_t now, deadline;
+	ssize_t n = 0;
+
+	write_str_to_socket(fd, "BUSY\n", 5);
+	shutdown(fd, SHUT_WR);
+
+	// Closing with an unread request would reset the connection and could
+	// destroy the reply before the client reads it. The connection was just
+	// accepted, so its request may still be on the way: wait for it, but
+	// only briefly, and read whatever has arrived.
+	deadline = stats_clock() + (uint64_t) REJECT_DRAIN_MS * 1000000;
+	while ((now = stats_clock()) < deadline) {
+		if (poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000)) <= 0)
+			break;
+		while ((n = recv(fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+			;
+		// Drained up to what the client has sent so far, or it closed.
+		if (n == 0 || errno != EINTR)
+			break;
+	}
+	close(fd);
+	rejected_connections++;
+}
+
+/*
+ * @name listen_unix - Creates a listening Unix domain stream socket. A
+ * socket file left behind by an earlier run is replaced.
+ * @param path: The path of the socket file.
+ *
+ * @return The socket, -1 on error.
+ */
+int listen_unix(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	// The TCP bind has already succeeded, so no other server is using the file.
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, MAX_PENDING_CONNECTIONS) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * @name close_connection - Closes a connection and frees its read buffer.
+ * @param request: The connection.
+ *
+ * @return
+ */
+void close_connection(connection_info *request) {
+
+	// Before close(), so an accept() that reuses the descriptor finds the slot free.
+	__atomic_store_n(&open_connections[request->fd], NULL, __ATOMIC_RELEASE);
+	close(request->fd);
+	frame_reader_destroy(request->reader);
+	request->reader = NULL;
+}
+
 /*
  * @name process_request - Process a client request.
  * 
@@ -209,126 +1257,162 @@ void process_request(void *arg) {
 	connection_info new_request;
 
 	char response_str[BUF_SIZE], request_str[BUF_SIZE];
+	char *chunk;		// A chunk of a large value.
 	int numbytes = 0;
 	Request *request = NULL;
+	uint64_t streamed;	// Bytes of a large value received or sent.
+	uint64_t hold;		// Keeps the extent a GET_LARGE is sending from being reused.
+	int broken;		// The connection broke off in the middle of a large value.
 
-	struct timespec start, finish;
-	long seconds_in_queue, nanoseconds_in_queue;
-	long seconds_of_service, nanoseconds_of_service;
-	double time_spent_in_queue;		// In nanoseconds.
-	double service_time;			// In nanoseconds.
+	uint64_t start, read_done, parse_done, finish, write_done, lock_wait;	// From stats_clock().
+
+	worker_stats *my_stats = stats_worker((int)(intptr_t) arg);
+	trace_ring *my_trace = trace_thread((int)(intptr_t) arg);
+	int stat_type, failed, n;
+	KISSDB_Extent extent;
+	size_t reply_size;
+	int pipelined = 0;
+	struct epoll_event event;
 
 	sigset_t set;
 
+	sigemptyset(&set);
 	sigaddset(&set, SIGTSTP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
 
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	while (!stop) {
+	if (!(chunk = (char *) malloc(STREAM_CHUNK_SIZE + 1)))
+		ERROR("malloc()");
 
-		pthread_mutex_lock(&empty_queue_cond_mutex);
-		while (check_if_queue_is_empty()) {
-			// fprintf(stderr, "Queue is empty, waiting...\n");
-			pthread_cond_wait(&empty_queue_cond_var, &empty_queue_cond_mutex);
-		}
-		pthread_mutex_unlock(&empty_queue_cond_mutex);
+	// On shutdown keep serving until the producer has emptied the queue.
+	while (pipelined || !stop || !check_if_queue_is_empty()) {
 
 	    // Clean buffers.
 		memset(response_str, 0, BUF_SIZE);
 		memset(request_str, 0, BUF_SIZE);
-		
-		pthread_mutex_lock(&dequeue_mutex);
-		if (check_if_queue_is_empty()) {
-			pthread_mutex_unlock(&dequeue_mutex);
-			continue;
-		}
 
-		new_request = dequeue();
-
-		// get time before serving the request.
-		if (clock_gettime(CLOCK_REALTIME, &start) == -1) {
+		// The next request on the connection just served has already been
+		// received; serve it without going through the queue.
+		if (!pipelined) {
+			LOCKPROF_LOCK(empty_queue_cond_mutex);
+			while (check_if_queue_is_empty() && !stop) {
+				// fprintf(stderr, "Queue is empty, waiting...\n");
+				LOCKPROF_COND_WAIT(empty_queue_cond_var, empty_queue_cond_mutex);
+			}
+			LOCKPROF_UNLOCK(empty_queue_cond_mutex);
 
-			perror("clock_gettime()");
-			exit(1);
-		}
+			LOCKPROF_LOCK(dequeue_mutex);
+			if (check_if_queue_is_empty()) {
+				LOCKPROF_UNLOCK(dequeue_mutex);
+				continue;
+			}
 
-		seconds_in_queue = start.tv_sec - new_request.connection_start.tv_sec;
-		nanoseconds_in_queue = start.tv_nsec - new_request.connection_start.tv_nsec;
+			new_request = dequeue(home_queue[(int)(intptr_t) arg]);
+			LOCKPROF_UNLOCK(dequeue_mutex);
 
-		time_spent_in_queue = ((double)seconds_in_queue * (double)BILLION) + ((double)nanoseconds_in_queue);
+			LOCKPROF_LOCK(full_queue_cond_mutex);
+			if (!check_if_queue_is_full()) {
 
-		total_waiting_time += time_spent_in_queue;
+				pthread_cond_signal(&full_queue_cond_var);
+			}
+			LOCKPROF_UNLOCK(full_queue_cond_mutex);
+		}
+		pipelined = 0;
+		broken = 0;
+		streamed = 0;
+		hold = 0;
 
-		pthread_mutex_unlock(&dequeue_mutex);
+		// get time before serving the request.
+		start = stats_clock();
 
-		pthread_mutex_lock(&full_queue_cond_mutex);
-		if (!check_if_queue_is_full()) {
+		// receive message.
+		numbytes = read_frame(new_request.reader, request_str, BUF_SIZE);
+		read_done = stats_clock();
 
-			pthread_cond_signal(&full_queue_cond_var);
+		// A polled connection also turns readable when the client closes it.
+		if (new_request.polled && numbytes == 0) {
+			close_connection(&new_request);
+			continue;
 		}
-		pthread_mutex_unlock(&full_queue_cond_mutex);
-
-		// receive message.
-		numbytes = read_str_from_socket(new_request.fd, request_str, BUF_SIZE);
 
+		histogram_record(&my_stats->stages[STAGE_QUEUE], start - new_request.connection_start);
+		trace_record(my_trace, TRACE_QUEUE, new_request.id, new_request.connection_start, start, 0);
+		PROBE3(kvserver, dequeue, new_request.id, new_request.fd, start - new_request.connection_start);
+		histogram_record(&my_stats->stages[STAGE_READ], read_done - start);
+		trace_record(my_trace, TRACE_READ, new_request.id, start, read_done, (uint32_t) (numbytes > 0 ? numbytes : 0));
+
+		if (numbytes > 0 && QUEUE_DEADLINE_MS && start - new_request.connection_start > (uint64_t) QUEUE_DEADLINE_MS * 1000000) {
+			// Served this late the reply would be of no use; tell the client to back off instead.
+			sprintf(response_str, "BUSY\n");
+			reply_size = strlen(response_str);
+			finish = stats_clock();
+			write_str_to_socket(new_request.fd, response_str, reply_size);
+			STAT_ADD(my_stats->counters.requests[STAT_BUSY], 1);
+			STAT_ADD(my_stats->counters.bytes_in, numbytes);
+			STAT_ADD(my_stats->counters.bytes_out, reply_size);
+			histogram_record(&my_stats->wait[STAT_BUSY], start - new_request.connection_start);
+			histogram_record(&my_stats->service[STAT_BUSY], finish - new_request.connection_start);
+		}
 	    // parse the request.
-		if (numbytes) {
+		else if (numbytes > 0) {
+			STAT_ADD(my_stats->counters.bytes_in, numbytes);
 			request = parse_request(request_str);
+			parse_done = stats_clock();
+			histogram_record(&my_stats->stages[STAGE_PARSE], parse_done - read_done);
+			trace_record(my_trace, TRACE_PARSE, new_request.id, read_done, parse_done, 0);
+			PROBE3(kvserver, parse, new_request.id, request ? (int) request->operation : -1, numbytes);
 			if (request) {
-				pthread_mutex_lock(&writer_cond_mutex);
-				while (writer_count == 1) {
-
-					pthread_cond_wait(&writer_cond_var, &writer_cond_mutex);
-				}
-				pthread_mutex_unlock(&writer_cond_mutex);
+				failed = 0;
+				lock_wait = 0;
 				switch (request->operation) {
 					case GET:
 
-					pthread_mutex_lock(&reader_mutex);
-					reader_count++;
-					pthread_mutex_unlock(&reader_mutex);
-
 	            	// Read the given key from the database.
-					if (KISSDB_get(db, request->key, request->value))
+					if ((failed = db_get(request->key, request->value, &lock_wait)))
 						sprintf(response_str, "GET ERROR\n");
+					else if (KISSDB_extent_decode(db, request->value, &extent))
+						sprintf(response_str, "GET LARGE: %" PRIu64 "\n", extent.length);
 					else
 						sprintf(response_str, "GET OK: %s\n", request->value);
+					break;
 
-					pthread_mutex_lock(&reader_cond_mutex);
-					reader_count--;
+					case GET_LARGE:
 
-					if (reader_count == 0) {
-						pthread_cond_signal(&reader_cond_var);
+					// Announce the length; the value follows the reply.
+					hold = KISSDB_extent_hold(db);
+					if ((failed = db_get(request->key, request->value, &lock_wait))) {
+						KISSDB_extent_release(db, hold);
+						sprintf(response_str, "GET ERROR\n");
 					}
-					pthread_mutex_unlock(&reader_cond_mutex);
+					else
+						sprintf(response_str, "GET OK: %" PRIu64 "\n", value_length(request->value));
 					break;
 
 					case PUT:
-					pthread_mutex_lock(&reader_cond_mutex);
-					while (reader_count != 0) {
-
-						pthread_cond_wait(&reader_cond_var, &reader_cond_mutex);
-					}
-					pthread_mutex_unlock(&reader_cond_mutex);
-
-					pthread_mutex_lock(&writer_mutex);
-					writer_count = 1;
 
 	            	// Write the given key/value pair to the database.
-					if (KISSDB_put(db, request->key, request->value)) 
+					if ((failed = db_put(request->key, request->value, &lock_wait)))
 						sprintf(response_str, "PUT ERROR\n");
 					else
 						sprintf(response_str, "PUT OK\n");
+					break;
 
-					writer_count = 0;
+					case PUT_LARGE:
 
-					pthread_mutex_lock(&writer_cond_mutex);
-					if (writer_count == 0) {
+					// Receive the value into an extent, then store the key.
+					if ((failed = put_large(&new_request, request, chunk, &streamed, &lock_wait)) < 0)
+						broken = 1;
+					sprintf(response_str, failed ? "PUT ERROR\n" : "PUT OK\n");
+					break;
 
-						pthread_cond_broadcast(&writer_cond_var);
-					}
-					pthread_mutex_unlock(&writer_cond_mutex);
-					pthread_mutex_unlock(&writer_mutex);
+					case STATS:
+
+					// Report the statistics gathered so far.
+					n = sprintf(response_str, "STATS OK: queue=%d ", __atomic_load_n(&items_in_queue, __ATOMIC_RELAXED));
+					stats_summary(response_str + n, BUF_SIZE - n - 1);
+					strcat(response_str, "\n");
 					break;
 					default:
 	            	// Unsupported operation.
@@ -336,23 +1420,35 @@ void process_request(void *arg) {
 				}
 
 				// get time after serving the request.
-				if (clock_gettime(CLOCK_REALTIME, &finish) == -1) {
-
-					perror("clock_gettime()");
-					exit(1);
+				finish = stats_clock();
+				if (request->operation != STATS) {
+					histogram_record(&my_stats->stages[STAGE_LOCK], lock_wait);
+					histogram_record(&my_stats->stages[STAGE_DB], finish - parse_done - lock_wait);
+					trace_record(my_trace, TRACE_LOCK, new_request.id, parse_done, parse_done + lock_wait, 0);
+					trace_record(my_trace, TRACE_DB, new_request.id, parse_done + lock_wait, finish, (uint32_t) failed);
 				}
-				seconds_of_service = finish.tv_sec - new_request.connection_start.tv_sec;
-				nanoseconds_of_service = finish.tv_nsec - new_request.connection_start.tv_nsec;
 
-				service_time = ((double)seconds_of_service * (double)BILLION) + ((double)nanoseconds_of_service);
+				update_service_estimate(finish - start);
+				reply_size = strlen(response_str);
+				stat_type = (request->operation == GET || request->operation == GET_LARGE) ? STAT_GET :
+					(request->operation == PUT || request->operation == PUT_LARGE) ? STAT_PUT : STAT_STATS;
+				STAT_ADD(my_stats->counters.requests[stat_type], 1);
+				STAT_ADD(my_stats->counters.failed[stat_type], failed ? 1 : 0);
+				STAT_ADD(my_stats->counters.bytes_in, streamed);
+				STAT_ADD(my_stats->counters.bytes_out, reply_size);
+				histogram_record(&my_stats->wait[stat_type], start - new_request.connection_start);
+				histogram_record(&my_stats->service[stat_type], finish - new_request.connection_start);
 
 				// Reply to the client.
-				write_str_to_socket(new_request.fd, response_str, strlen(response_str));
-
-				pthread_mutex_lock(&update_stats_mutex);
-				total_service_time += service_time;
-				completed_requests++;
-				pthread_mutex_unlock(&update_stats_mutex);
+				write_str_to_socket(new_request.fd, response_str, reply_size);
+
+				// A client that stops reading a large value loses the connection.
+				if (request->operation == GET_LARGE && !failed) {
+					if (send_large(new_request.fd, request->value, chunk, &streamed))
+						broken = 1;
+					KISSDB_extent_release(db, hold);
+					STAT_ADD(my_stats->counters.bytes_out, streamed);
+				}
 
 				if (request)
 					free(request);
@@ -361,21 +1457,240 @@ void process_request(void *arg) {
 			else {
 				// Send an Error reply to the client.
 				sprintf(response_str, "FORMAT ERROR\n");
-				write_str_to_socket(new_request.fd, response_str, strlen(response_str));
+				reply_size = strlen(response_str);
+				finish = stats_clock();
+				write_str_to_socket(new_request.fd, response_str, reply_size);
+				STAT_ADD(my_stats->counters.parse_errors, 1);
+				record_error(my_stats, &new_request, start, finish, reply_size);
 			}
 		}
 		else {
 			// Send an Error reply to the client.
 			sprintf(response_str, "FORMAT ERROR\n");
-			write_str_to_socket(new_request.fd, response_str, strlen(response_str));
+			reply_size = strlen(response_str);
+			finish = stats_clock();
+			write_str_to_socket(new_request.fd, response_str, reply_size);
+			STAT_ADD(my_stats->counters.read_errors, 1);
+			record_error(my_stats, &new_request, start, finish, reply_size);
+		}
+		write_done = stats_clock();
+		histogram_record(&my_stats->stages[STAGE_WRITE], write_done - finish);
+		trace_record(my_trace, TRACE_REPLY, new_request.id, finish, write_done, (uint32_t) reply_size);
+		PROBE3(kvserver, reply, new_request.id, reply_size, write_done - new_request.connection_start);
+
+		if (slow_log && write_done - new_request.connection_start > (uint64_t) SLOW_REQUEST_US * 1000)
+			trace_log_request(my_trace, new_request.id, new_request.connection_start, slow_log);
+
+		if (KEEP_ALIVE && numbytes > 0 && !broken && !stop) {
+			// The client sent more than one request at once.
+			if (frame_buffered(new_request.reader)) {
+				new_request.connection_start = stats_clock();
+				new_request.id = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+				pipelined = 1;
+				continue;
+			}
+
+			// Hand the connection back to the producer to wait for its next request.
+			event.events = EPOLLIN | EPOLLONESHOT;
+			event.data.ptr = new_request.reader;
+			if (epoll_ctl(epoll_fd, new_request.polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, new_request.fd, &event) == 0)
+				continue;
+			perror("epoll_ctl()");
 		}
-	    
-		close(new_request.fd);
+		close_connection(&new_request);
 	}
 
+	free(chunk);
 	return;
 }
 
+/*
+ * @name shutdown_server - Stops accepting connections, lets the consumer
+ * threads drain the queue for up to SHUTDOWN_DRAIN_MS, waits for them and
+ * the background threads to finish, persists everything the storage
+ * engine still holds in memory, syncs and closes the database and prints
+ * the final statistics.
+ * @param socket_fd: The TCP listening socket.
+ * @param unix_fd: The Unix domain listening socket, -1 if none.
+ *
+ * @return
+ */
+void shutdown_server(int socket_fd, int unix_fd) {
+
+	struct timespec pause = { 0, 10 * 1000000L };
+	uint64_t deadline;
+	connection_info dropped;
+	int i, lane, count = 0, idle = 0;
+
+	close(socket_fd);
+	if (unix_fd != -1) {
+		close(unix_fd);
+		unlink(UNIX_SOCKET_PATH);
+	}
+	fprintf(stderr, "(Info) main: Shutting down, %d connections queued.\n", items_in_queue);
+
+	// Wake idle consumers so they see stop; the rest exit once the queue is empty.
+	LOCKPROF_LOCK(empty_queue_cond_mutex);
+	pthread_cond_broadcast(&empty_queue_cond_var);
+	LOCKPROF_UNLOCK(empty_queue_cond_mutex);
+
+	deadline = stats_clock() + (uint64_t) SHUTDOWN_DRAIN_MS * 1000000;
+	while (!check_if_queue_is_empty() && stats_clock() < deadline) {
+		nanosleep(&pause, NULL);
+	}
+
+	// Out of time: drop whatever is still queued.
+	LOCKPROF_LOCK(dequeue_mutex);
+	while (!check_if_queue_is_empty()) {
+		dropped = dequeue(0);
+		close_connection(&dropped);
+		count++;
+	}
+	LOCKPROF_UNLOCK(dequeue_mutex);
+	if (count)
+		fprintf(stderr, "(Warning) main: Dropped %d queued connections after %d ms.\n", count, SHUTDOWN_DRAIN_MS);
+
+	// A consumer may still wait in read_frame() for a frame or a PUT_LARGE
+	// body that never comes; end its connection's input so it can be joined.
+	for (i = 0; i < max_connections; i++) {
+		if (__atomic_load_n(&open_connections[i], __ATOMIC_ACQUIRE))
+			shutdown(i, SHUT_RD);
+	}
+
+	for (i = 0; i < NUMBER_OF_CONSUMER_THREADS; i++)
+		pthread_join(thread_id[i], NULL);
+
+	// With the consumers gone, every connection still open waits in epoll
+	// for a request that will not be served.
+	for (i = 0; i < max_connections; i++) {
+		if (open_connections[i]) {
+			dropped.fd = i;
+			dropped.reader = open_connections[i];
+			close_connection(&dropped);
+			idle++;
+		}
+	}
+	if (idle)
+		fprintf(stderr, "(Info) main: Closed %d idle connections.\n", idle);
+	close(epoll_fd);
+
+	// No more requests; stop the background threads.
+	stop_background = 1;
+	if (ENGINE == ENGINE_MEMORY)
+		pthread_join(persist_thread_id, NULL);
+	if (ENGINE == ENGINE_LSM) {
+		LOCKPROF_LOCK(memtable_cond_mutex);
+		pthread_cond_signal(&memtable_full_cond_var);
+		LOCKPROF_UNLOCK(memtable_cond_mutex);
+		pthread_join(flush_thread_id, NULL);
+	}
+	sem_post(&snapshot_sem);
+	pthread_join(snapshot_thread_id, NULL);
+	sem_post(&trace_sem);
+	pthread_join(trace_dump_thread_id, NULL);
+
+	// A scrape reads db; stop answering them before it is freed.
+	if (metrics_fd != -1) {
+		shutdown(metrics_fd, SHUT_RDWR);
+		pthread_join(metrics_thread_id, NULL);
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+
+	// Persist what the engine still holds in memory.
+	if (ENGINE == ENGINE_MEMORY)
+		checkpoint();
+	else if (ENGINE == ENGINE_LSM)
+		flush_memtable();
+
+	if (KISSDB_sync(db))
+		fprintf(stderr, "(Error) main: Cannot sync the database.\n");
+	KISSDB_close(db);
+	free(db);
+	db = NULL;
+
+	if (change_log)
+		fclose(change_log);
+	if (slow_log)
+		fclose(slow_log);
+
+	stats_print(stderr);
+	if (rejected_connections)
+		fprintf(stderr, "Connections refused at accept: %llu\n", (unsigned long long) rejected_connections);
+	fprintf(stderr, "KISSDB admission (%s):\n", scheduler_policy_name(SCHEDULER_POLICY));
+	for (lane = 0; lane < LANES; lane++) {
+		fprintf(stderr, "%-6s lane %10llu admitted, at most %d waiting, wait p50 %llu ns, p99 %llu ns, max %llu ns\n",
+			scheduler_lane_name(lane), (unsigned long long) db_scheduler.lanes[lane].admitted, db_scheduler.lanes[lane].max_waiting,
+			(unsigned long long) histogram_percentile(&db_scheduler.lanes[lane].wait, 0.50),
+			(unsigned long long) histogram_percentile(&db_scheduler.lanes[lane].wait, 0.99),
+			(unsigned long long) db_scheduler.lanes[lane].wait.max);
+	}
+	if (GET_COALESCING && ENGINE != ENGINE_MEMORY)
+		fprintf(stderr, "GETs that shared another GET's KISSDB read: %llu of %llu\n", (unsigned long long) get_flights.shared,
+			(unsigned long long) (get_flights.led + get_flights.shared));
+	if (PUT_COMBINING && ENGINE == ENGINE_KISSDB && __atomic_load_n(&put_combiner.batches, __ATOMIC_RELAXED))
+		fprintf(stderr, "PUTs written to KISSDB: %llu in %llu batches\n",
+			(unsigned long long) __atomic_load_n(&put_combiner.requests, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&put_combiner.batches, __ATOMIC_RELAXED));
+#if LOCKPROF
+	lockprof_print(stderr);
+#endif
+}
+
+/*
+ * @name place_threads - Picks the CPU of every consumer thread and, when
+ * the consumers span several NUMA nodes, gives each node a queue of its
+ * own. Without PIN_THREADS the consumers float and share one queue.
+ * @param consumer_cpu: Receives the CPU of every consumer, -1 if not pinned.
+ *
+ * @return
+ */
+void place_threads(int *consumer_cpu) {
+	int cpus[AFFINITY_MAX_CPUS];
+	int nodes, count, i, node, steer;
+
+	number_of_queues = 1;
+	for (i = 0; i < AFFINITY_MAX_NODES; i++)
+		node_queue[i] = -1;
+	for (i = 0; i < NUMBER_OF_CONSUMER_THREADS; i++) {
+		consumer_cpu[i] = -1;
+		home_queue[i] = 0;
+	}
+	if (!PIN_THREADS)
+		return;
+
+	nodes = affinity_init();
+	if (!(count = affinity_cpus(cpus, AFFINITY_MAX_CPUS))) {
+		fprintf(stderr, "(Warning) main: Cannot read the allowed CPUs, threads are not pinned.\n");
+		return;
+	}
+
+	// Leave the producer its CPU to itself if there are others.
+	for (i = 0; i < count && count > 1; i++) {
+		if (cpus[i] == PRODUCER_CPU) {
+			memmove(&cpus[i], &cpus[i + 1], (count - i - 1) * sizeof(int));
+			count--;
+			break;
+		}
+	}
+
+	steer = STEER_BY_NODE && nodes > 1;
+	if (steer)
+		number_of_queues = 0;
+	for (i = 0; i < NUMBER_OF_CONSUMER_THREADS; i++) {
+		consumer_cpu[i] = cpus[i % count];
+		if (!steer)
+			continue;
+		node = affinity_node(consumer_cpu[i]);
+		if (node_queue[node] < 0)
+			node_queue[node] = number_of_queues++;
+		home_queue[i] = node_queue[node];
+	}
+
+	fprintf(stderr, "(Info) main: Pinned %d consumer threads to %d CPUs on %d NUMA nodes, %d queues.\n",
+		NUMBER_OF_CONSUMER_THREADS, count < NUMBER_OF_CONSUMER_THREADS ? count : NUMBER_OF_CONSUMER_THREADS, nodes, number_of_queues);
+}
+
 /*
  * @name main - The main routine.
  *
@@ -384,25 +1699,95 @@ void process_request(void *arg) {
 int main() {
 
 	int socket_fd;		// listen on this socket for new connections
+	int unix_fd = -1;	// and on this one for local connections
 	socklen_t clen;
-	struct sockaddr_in server_addr,	// my address information
-						client_addr;	// connector's address information
+	struct sockaddr_in server_addr;	// my address information
+	struct sockaddr_storage client_addr;	// connector's address information
 	connection_info new_request;
-	int thread_check, i;
+	int thread_check, i, ready, q;
+	int reuse = 1, nodelay = 1;
+	int consumer_cpu[NUMBER_OF_CONSUMER_THREADS];
+	pthread_attr_t attr;
+	struct epoll_event event, events[MAX_EVENTS];
+	struct rlimit fd_limit;
+	trace_ring *accept_trace;
 
 	struct sigaction sact;
-	sact.sa_handler = signal_handler;	// Handler for SIGTSTP.
+	sact.sa_handler = signal_handler;	// Handler for SIGTSTP, SIGINT and SIGTERM.
 	sigemptyset(&sact.sa_mask);			// No other signal to block.
-	sact.sa_flags = 0;
+	sact.sa_flags = SA_RESTART;			// Don't interrupt requests being served.
 
 	if (sigaction(SIGTSTP, &sact, NULL) < 0) {
 
 		perror("Failed to set action for SIGTSTP");
 	}
+	if (sigaction(SIGINT, &sact, NULL) < 0 || sigaction(SIGTERM, &sact, NULL) < 0) {
+
+		perror("Failed to set action for SIGINT/SIGTERM");
+	}
+
+	sem_init(&snapshot_sem, 0, 0);
+	sact.sa_handler = snapshot_signal_handler;	// Handler for SIGUSR1.
+	sact.sa_flags = SA_RESTART;			// Don't interrupt accept().
+	if (sigaction(SIGUSR1, &sact, NULL) < 0) {
+
+		perror("Failed to set action for SIGUSR1");
+	}
+
+	sem_init(&trace_sem, 0, 0);
+	sact.sa_handler = trace_signal_handler;		// Handler for SIGUSR2.
+	if (sigaction(SIGUSR2, &sact, NULL) < 0) {
+
+		perror("Failed to set action for SIGUSR2");
+	}
+
+	singleflight_init(&get_flights, KEY_SIZE, VALUE_SIZE);
+	combiner_init(&put_combiner, KEY_SIZE, VALUE_SIZE, apply_puts, NULL);
+	scheduler_init(&db_scheduler, SCHEDULER_POLICY);
+
+	if (stats_init(NUMBER_OF_CONSUMER_THREADS)) {
+		fprintf(stderr, "(Error) main: Cannot allocate memory for statistics.\n");
+		return 1;
+	}
+
+	// Every descriptor the process may open gets a slot, so an accepted connection always has one.
+	if (getrlimit(RLIMIT_NOFILE, &fd_limit) == -1) {
+		perror("getrlimit()");
+		return 1;
+	}
+	if (fd_limit.rlim_cur == RLIM_INFINITY || fd_limit.rlim_cur > (1 << 20)) {
+		fd_limit.rlim_cur = 1 << 20;
+		if (setrlimit(RLIMIT_NOFILE, &fd_limit) == -1) {
+			perror("setrlimit()");
+			return 1;
+		}
+	}
+	max_connections = (int) fd_limit.rlim_cur;
+	if (!(open_connections = (frame_reader **) calloc(max_connections, sizeof(frame_reader *)))) {
+		fprintf(stderr, "(Error) main: Cannot allocate memory for the connection table.\n");
+		return 1;
+	}
 
+	// One trace ring per consumer thread, the last one for the producer.
+	if (trace_init(NUMBER_OF_CONSUMER_THREADS + 1)) {
+		fprintf(stderr, "(Error) main: Cannot allocate memory for tracing.\n");
+		return 1;
+	}
+	accept_trace = trace_thread(NUMBER_OF_CONSUMER_THREADS);
+
+	if (SLOW_REQUEST_US && !(slow_log = fopen(SLOW_LOG_PATH, "a"))) {
+		perror(SLOW_LOG_PATH);
+	}
+
+	// A pinned consumer starts on its CPU, so its stack and buffers are allocated on that node.
+	place_threads(consumer_cpu);
 	for (i = 0; i < NUMBER_OF_CONSUMER_THREADS; i++) {
 
-		thread_check = pthread_create(&thread_id[i], NULL, (void *) process_request, NULL);
+		pthread_attr_init(&attr);
+		if (consumer_cpu[i] >= 0 && affinity_attr(&attr, consumer_cpu[i]) != 0)
+			fprintf(stderr, "(Warning) main: Cannot pin consumer %d to CPU %d.\n", i, consumer_cpu[i]);
+		thread_check = pthread_create(&thread_id[i], &attr, (void *) process_request, (void *)(intptr_t) i);
+		pthread_attr_destroy(&attr);
 		if (thread_check != 0) {
 
 			perror("pthread_create()");
@@ -414,6 +1799,10 @@ int main() {
 	if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
 		ERROR("socket()");
 
+	// Allow a restart while connections of the previous run are in TIME_WAIT.
+	if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+		perror("setsockopt(SO_REUSEADDR)");
+
 	// Ignore the SIGPIPE signal in order to not crash when a
 	// client closes the connection unexpectedly.
 	signal(SIGPIPE, SIG_IGN);
@@ -431,7 +1820,16 @@ int main() {
 	// start listening to socket for incomming connections
 	listen(socket_fd, MAX_PENDING_CONNECTIONS);
 	fprintf(stderr, "(Info) main: Listening for new connections on port %d ...\n", MY_PORT);
-	clen = sizeof(client_addr);
+
+	// Clients on this host can skip the TCP/IP stack; the framing and protocol are the same.
+	if (UNIX_SOCKET_PATH[0]) {
+		if ((unix_fd = listen_unix(UNIX_SOCKET_PATH)) == -1)
+			perror(UNIX_SOCKET_PATH);
+		else
+			fprintf(stderr, "(Info) main: Listening for local connections on %s ...\n", UNIX_SOCKET_PATH);
+	}
+	listeners[0] = socket_fd;
+	listeners[1] = unix_fd;
 
 	// Allocate memory for the database.
 	if (!(db = (KISSDB *)malloc(sizeof(KISSDB)))) {
@@ -440,47 +1838,172 @@ int main() {
 	}
 
 	// Open the database.
-	if (KISSDB_open(db, "mydb.db", KISSDB_OPEN_MODE_RWCREAT, HASH_SIZE, KEY_SIZE, VALUE_SIZE)) {
+	if (KISSDB_open_direct(db, DB_PATH, KISSDB_OPEN_MODE_RWCREAT, HASH_SIZE, KEY_SIZE, VALUE_SIZE, DB_POOL_BLOCKS)) {
 		fprintf(stderr, "(Error) main: Cannot open the database.\n");
 		return 1;
 	}
 
-	// main loop: wait for new connection/requests
-	while (1) {
-	
-		pthread_mutex_lock(&full_queue_cond_mutex);
-		while (check_if_queue_is_full()) {
+	if (ENGINE == ENGINE_MEMORY) {
+
+		if (load_memory_store())
+			return 1;
+
+		if (pthread_create(&persist_thread_id, NULL, persist_thread, NULL) != 0) {
 
-			pthread_cond_wait(&full_queue_cond_var, &full_queue_cond_mutex);
+			perror("pthread_create()");
+			exit(1);
 		}
-		pthread_mutex_unlock(&full_queue_cond_mutex);
+	}
 
-		// wait for incomming connection
-		if ((new_request.fd = accept(socket_fd, (struct sockaddr *)&client_addr, &clen)) == -1) {
-			ERROR("accept()");
+	if (ENGINE == ENGINE_LSM) {
+
+		if (memstore_init(&memtables[0], MEMTABLE_BUCKETS, KEY_SIZE, VALUE_SIZE)
+			|| memstore_init(&memtables[1], MEMTABLE_BUCKETS, KEY_SIZE, VALUE_SIZE)) {
+
+			fprintf(stderr, "(Error) main: Cannot allocate the memtables.\n");
+			return 1;
 		}
+		active_memtable = &memtables[0];
 
-		// get request arrival time.
-		if (clock_gettime(CLOCK_REALTIME, &new_request.connection_start) == -1) {
+		if (pthread_create(&flush_thread_id, NULL, flush_thread, NULL) != 0) {
 
-			perror("clock_gettime()");
+			perror("pthread_create()");
 			exit(1);
 		}
+	}
 
-		// got connection, serve request
-		fprintf(stderr, "(Info) main: Got connection from '%s'\n", inet_ntoa(client_addr.sin_addr));
+	if (pthread_create(&snapshot_thread_id, NULL, snapshot_thread, NULL) != 0) {
 
-		pthread_mutex_lock(&enqueue_mutex);
-		enqueue(new_request);
-		pthread_mutex_unlock(&enqueue_mutex);
+		perror("pthread_create()");
+		exit(1);
+	}
+
+	if (pthread_create(&trace_dump_thread_id, NULL, trace_dump_thread, NULL) != 0) {
+
+		perror("pthread_create()");
+		exit(1);
+	}
 
-		pthread_mutex_lock(&empty_queue_cond_mutex);
-		if (!check_if_queue_is_empty()) {
+	if (METRICS_PORT) {
 
-			pthread_cond_broadcast(&empty_queue_cond_var);
+		if ((metrics_fd = metrics_listen(METRICS_PORT)) == -1) {
+			perror("metrics_listen()");
+		} else if (pthread_create(&metrics_thread_id, NULL, metrics_thread, (void *)(intptr_t) metrics_fd) != 0) {
+
+			perror("pthread_create()");
+			exit(1);
+		} else {
+			fprintf(stderr, "(Info) main: Serving metrics on 127.0.0.1:%d/metrics\n", METRICS_PORT);
 		}
-		pthread_mutex_unlock(&empty_queue_cond_mutex);
 	}
 
+	// The listener stays armed; kept-alive connections are armed for one request at a time.
+	if ((epoll_fd = epoll_create1(0)) == -1)
+		ERROR("epoll_create1()");
+	for (i = 0; i < 2; i++) {
+		if (listeners[i] == -1)
+			continue;
+		event.events = EPOLLIN;
+		event.data.ptr = &listeners[i];		// A listener is known by its pointer into listeners[].
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i], &event) == -1)
+			ERROR("epoll_ctl()");
+	}
+
+	// Pinned last, so the background threads started above keep floating.
+	if (PIN_THREADS && PRODUCER_CPU >= 0 && affinity_pin_self(PRODUCER_CPU) != 0)
+		fprintf(stderr, "(Warning) main: Cannot pin the producer to CPU %d.\n", PRODUCER_CPU);
+
+	// main loop: wait for new connection/requests
+	while (!stop) {
+
+		// wait for incomming connections and requests, waking up now and then to check for a shutdown.
+		if ((ready = epoll_wait(epoll_fd, events, MAX_EVENTS, ACCEPT_POLL_MS)) <= 0) {
+			if (ready == -1 && errno != EINTR)
+				ERROR("epoll_wait()");
+			continue;
+		}
+
+		for (i = 0; i < ready; i++) {
+
+			if (events[i].data.ptr == &listeners[0] || events[i].data.ptr == &listeners[1]) {
+				clen = sizeof(client_addr);
+				if ((new_request.fd = accept(*(int *) events[i].data.ptr, (struct sockaddr *)&client_addr, &clen)) == -1) {
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					ERROR("accept()");
+				}
+				new_request.polled = 0;
+
+				// got connection, serve request
+				if (client_addr.ss_family == AF_INET)
+					fprintf(stderr, "(Info) main: Got connection from '%s'\n", inet_ntoa(((struct sockaddr_in *) &client_addr)->sin_addr));
+				else
+					fprintf(stderr, "(Info) main: Got local connection\n");
+
+				// Refuse what could not be served within the deadline anyway, before it takes up a queue slot.
+				if (QUEUE_DEADLINE_MS && (check_if_queue_is_full()
+					|| estimated_queue_wait() > (uint64_t) QUEUE_DEADLINE_MS * 1000000)) {
+					reject_connection(new_request.fd);
+					continue;
+				}
+
+				// Replies leave in one write, and a client waiting for each reply must not have Nagle hold back its next request.
+				if (client_addr.ss_family == AF_INET)
+					setsockopt(new_request.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+				if (!(new_request.reader = frame_reader_create(new_request.fd, CONNECTION_BUFFER_SIZE))) {
+					fprintf(stderr, "(Error) main: Cannot allocate memory for a connection.\n");
+					close(new_request.fd);
+					continue;
+				}
+				open_connections[new_request.fd] = new_request.reader;
+
+				// Queue it once its first request has arrived, so no consumer blocks on it.
+				if (KEEP_ALIVE) {
+					event.events = EPOLLIN | EPOLLONESHOT;
+					event.data.ptr = new_request.reader;
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_request.fd, &event) == -1) {
+						perror("epoll_ctl()");
+						close_connection(&new_request);
+					}
+					continue;
+				}
+			}
+			else {
+				// A request on a kept-alive connection, or the client closed it.
+				new_request.reader = (frame_reader *) events[i].data.ptr;
+				new_request.fd = new_request.reader->fd;
+				new_request.polled = 1;
+			}
+
+			// get request arrival time.
+			new_request.connection_start = stats_clock();
+			new_request.id = __atomic_add_fetch(&next_request_id, 1, __ATOMIC_RELAXED);
+			trace_record(accept_trace, TRACE_ACCEPT, new_request.id, new_request.connection_start, new_request.connection_start,
+				(uint32_t) new_request.polled);
+
+			q = steer_connection(new_request.fd);
+
+			LOCKPROF_LOCK(full_queue_cond_mutex);
+			while (check_if_queue_is_full()) {
+
+				LOCKPROF_COND_WAIT(full_queue_cond_var, full_queue_cond_mutex);
+			}
+			LOCKPROF_UNLOCK(full_queue_cond_mutex);
+
+			LOCKPROF_LOCK(enqueue_mutex);
+			enqueue(new_request, q);
+			LOCKPROF_UNLOCK(enqueue_mutex);
+
+			LOCKPROF_LOCK(empty_queue_cond_mutex);
+			if (!check_if_queue_is_empty()) {
+
+				pthread_cond_broadcast(&empty_queue_cond_var);
+			}
+			LOCKPROF_UNLOCK(empty_queue_cond_mutex);
+		}
+	}
+
+	shutdown_server(socket_fd, unix_fd);
+
 	return 0; 
 }
\ No newline at end of file
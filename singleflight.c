@@ -0,0 +1,164 @@
+/* singleflight.c
+
+	Coalescing of concurrent reads of the same key.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "singleflight.h"
+
+/**
+ * @name singleflight_hash - FNV-1a hash of a key.
+ * @param key: The key.
+ * @param len: The key size.
+ *
+ * @return The hash.
+ */
+static uint64_t singleflight_hash(const void *key, size_t len) {
+	const unsigned char *p = (const unsigned char *) key;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * @name singleflight_stripe_of - Finds the stripe of a key.
+ * @param sf: The coalescing table.
+ * @param key: The key.
+ *
+ * @return The stripe.
+ */
+static singleflight_stripe *singleflight_stripe_of(singleflight *sf, const void *key) {
+
+	return &sf->stripes[singleflight_hash(key, sf->key_size) % SINGLEFLIGHT_STRIPES];
+}
+
+/**
+ * @name singleflight_init - Initializes the coalescing table.
+ * @param sf: The coalescing table.
+ * @param key_size: Size of every key in bytes.
+ * @param value_size: Size of every value in bytes.
+ *
+ * @return
+ */
+void singleflight_init(singleflight *sf, size_t key_size, size_t value_size) {
+	int i;
+
+	memset(sf, 0, sizeof(singleflight));
+	sf->key_size = key_size;
+	sf->value_size = value_size;
+	for (i = 0; i < SINGLEFLIGHT_STRIPES; i++) {
+		pthread_mutex_init(&sf->stripes[i].lock, NULL);
+		sf->stripes[i].calls = NULL;
+	}
+}
+
+/**
+ * @name singleflight_destroy - Releases the stripe locks.
+ * @param sf: The coalescing table, with no read in flight.
+ *
+ * @return
+ */
+void singleflight_destroy(singleflight *sf) {
+	int i;
+
+	for (i = 0; i < SINGLEFLIGHT_STRIPES; i++)
+		pthread_mutex_destroy(&sf->stripes[i].lock);
+}
+
+/**
+ * @name singleflight_begin - Joins the read of a key in flight, or
+ * registers the caller as the one to perform it.
+ * @param sf: The coalescing table.
+ * @param key: The key.
+ * @param value: Receives the value if a read in flight was joined.
+ * @param result: Receives the result if a read in flight was joined.
+ * @param call: Receives the call to finish if the caller leads; NULL if it
+ * could not be allocated, in which case the read is simply not shared.
+ *
+ * @return 0 if a read in flight was joined, 1 if the caller must read the key.
+ */
+int singleflight_begin(singleflight *sf, const void *key, void *value, int *result, singleflight_call **call) {
+	singleflight_stripe *stripe = singleflight_stripe_of(sf, key);
+	singleflight_call *c;
+
+	pthread_mutex_lock(&stripe->lock);
+	for (c = stripe->calls; c; c = c->next) {
+		if (!memcmp(c->data, key, sf->key_size))
+			break;
+	}
+
+	if (c) {
+		// Wait for the leader and take a copy of its result.
+		c->waiters++;
+		while (!c->done)
+			pthread_cond_wait(&c->done_cond, &stripe->lock);
+		memcpy(value, c->data + sf->key_size, sf->value_size);
+		*result = c->result;
+		if (--c->waiters == 0) {
+			pthread_cond_destroy(&c->done_cond);
+			free(c);
+		}
+		pthread_mutex_unlock(&stripe->lock);
+		__atomic_add_fetch(&sf->shared, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if ((c = (singleflight_call *) malloc(sizeof(singleflight_call) + sf->key_size + sf->value_size))) {
+		c->waiters = 0;
+		c->done = 0;
+		c->result = 0;
+		pthread_cond_init(&c->done_cond, NULL);
+		memcpy(c->data, key, sf->key_size);
+		c->next = stripe->calls;
+		stripe->calls = c;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+
+	__atomic_add_fetch(&sf->led, 1, __ATOMIC_RELAXED);
+	*call = c;
+	return 1;
+}
+
+/**
+ * @name singleflight_finish - Publishes the result of a read and retires
+ * its call.
+ * @param sf: The coalescing table.
+ * @param call: The call returned by singleflight_begin(), or NULL.
+ * @param value: The value read.
+ * @param result: The result of the read.
+ *
+ * @return
+ */
+void singleflight_finish(singleflight *sf, singleflight_call *call, const void *value, int result) {
+	singleflight_stripe *stripe;
+	singleflight_call **link;
+
+	if (!call)
+		return;
+
+	stripe = singleflight_stripe_of(sf, call->data);
+	pthread_mutex_lock(&stripe->lock);
+	for (link = &stripe->calls; *link != call; link = &(*link)->next)
+		;
+	*link = call->next;
+
+	if (call->waiters == 0) {
+		pthread_mutex_unlock(&stripe->lock);
+		pthread_cond_destroy(&call->done_cond);
+		free(call);
+		return;
+	}
+
+	// The last waiter to copy the result frees the call.
+	memcpy(call->data + sf->key_size, value, sf->value_size);
+	call->result = result;
+	call->done = 1;
+	pthread_cond_broadcast(&call->done_cond);
+	pthread_mutex_unlock(&stripe->lock);
+}
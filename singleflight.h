@@ -0,0 +1,63 @@
+/* singleflight.h
+
+	Coalescing of concurrent reads of the same key.
+
+	The first thread to read a key leads: it performs the read and
+	publishes the result. Threads that ask for the same key while the read
+	is in flight wait for it and take a copy of its result instead of
+	reading the key again. In-flight reads are spread over
+	SINGLEFLIGHT_STRIPES mutexes by key hash.
+*/
+
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SINGLEFLIGHT_STRIPES 64
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+typedef struct singleflight_call {
+	struct singleflight_call *next;		// Stripe list of reads in flight.
+	int waiters;				// Threads waiting for the result.
+	int done;
+	int result;
+	pthread_cond_t done_cond;
+	char data[];				// key_size bytes of key, then value_size bytes of value.
+} singleflight_call;
+
+typedef struct singleflight_stripe {
+	pthread_mutex_t lock;
+	singleflight_call *calls;
+} __attribute__((aligned(CACHE_LINE_SIZE))) singleflight_stripe;
+
+typedef struct singleflight {
+	size_t key_size;
+	size_t value_size;
+	uint64_t led;				// Reads performed, updated atomically.
+	uint64_t shared;			// Reads answered with another thread's result.
+	singleflight_stripe stripes[SINGLEFLIGHT_STRIPES];
+} singleflight;
+
+// initialize for keys and values of the given sizes.
+void singleflight_init(singleflight *sf, size_t key_size, size_t value_size);
+
+// release the stripe locks. No read may be in flight.
+void singleflight_destroy(singleflight *sf);
+
+// join the read of 'key' in flight, if any: returns 0 after copying its
+// value to 'value' and its result to 'result'. Otherwise returns 1 and the
+// caller reads the key itself, then passes '*call' to singleflight_finish().
+int singleflight_begin(singleflight *sf, const void *key, void *value, int *result, singleflight_call **call);
+
+// publish the leader's 'value' and 'result' to the waiting threads and
+// retire the call; threads arriving from now on start a new read. A NULL
+// 'call' (out of memory in singleflight_begin()) is ignored.
+void singleflight_finish(singleflight *sf, singleflight_call *call, const void *value, int result);
+
+#endif
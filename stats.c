@@ -0,0 +1,241 @@
+/* stats.c
+
+	Per-worker request statistics of the key-value server.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static char *workers = NULL;
+static size_t worker_stride = 0;	// Bytes per block, a whole number of pages.
+static int number_of_workers = 0;
+
+#define WORKER(i) ((worker_stats *) (workers + (size_t) (i) * worker_stride))
+
+static const char *stat_names[STAT_OP_TYPES] = { "GET", "PUT", "STATS", "ERROR", "BUSY" };
+static const char *stage_names[STAGES] = { "queue", "read", "parse", "lock_wait", "db", "write" };
+
+/**
+ * @name stats_init - Allocates the per-worker blocks. Every block starts
+ * on a page of its own and the pages are left untouched, so each lands
+ * on the NUMA node of the worker that first records into it.
+ * @param num_workers: The number of consumer threads.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int stats_init(int num_workers) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	void *blocks;
+
+	worker_stride = (sizeof(worker_stats) + page - 1) / page * page;
+	blocks = mmap(NULL, worker_stride * num_workers, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (blocks == MAP_FAILED)
+		return -1;
+
+	workers = (char *) blocks;
+	number_of_workers = num_workers;
+	return 0;
+}
+
+/**
+ * @name stats_worker - Returns the block of a worker.
+ * @param id: The worker index.
+ *
+ * @return The block.
+ */
+worker_stats *stats_worker(int id) {
+
+	return WORKER(id);
+}
+
+/**
+ * @name stats_name - Returns the name of a request class.
+ * @param type: One of the STAT_ constants.
+ *
+ * @return The name.
+ */
+const char *stats_name(int type) {
+
+	return stat_names[type];
+}
+
+/**
+ * @name stats_stage_name - Returns the name of a stage.
+ * @param stage: One of the STAGE_ constants.
+ *
+ * @return The name.
+ */
+const char *stats_stage_name(int stage) {
+
+	return stage_names[stage];
+}
+
+/**
+ * @name stats_sum_counters - Sums the counters of all workers.
+ * @param totals: Receives the sums.
+ *
+ * @return
+ */
+void stats_sum_counters(worker_counters *totals) {
+	const worker_counters *c;
+	int i, type;
+
+	memset(totals, 0, sizeof(worker_counters));
+	for (i = 0; i < number_of_workers; i++) {
+		c = &WORKER(i)->counters;
+		for (type = 0; type < STAT_OP_TYPES; type++) {
+			totals->requests[type] += __atomic_load_n(&c->requests[type], __ATOMIC_RELAXED);
+			totals->failed[type] += __atomic_load_n(&c->failed[type], __ATOMIC_RELAXED);
+		}
+		totals->read_errors += __atomic_load_n(&c->read_errors, __ATOMIC_RELAXED);
+		totals->parse_errors += __atomic_load_n(&c->parse_errors, __ATOMIC_RELAXED);
+		totals->bytes_in += __atomic_load_n(&c->bytes_in, __ATOMIC_RELAXED);
+		totals->bytes_out += __atomic_load_n(&c->bytes_out, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @name stats_merge_latency - Merges one request class over all workers.
+ * @param type: One of the STAT_ constants.
+ * @param wait: Receives the merged queue wait histogram.
+ * @param service: Receives the merged service time histogram.
+ *
+ * @return
+ */
+void stats_merge_latency(int type, histogram *wait, histogram *service) {
+	int i;
+
+	histogram_reset(wait);
+	histogram_reset(service);
+	for (i = 0; i < number_of_workers; i++) {
+		histogram_merge(wait, &WORKER(i)->wait[type]);
+		histogram_merge(service, &WORKER(i)->service[type]);
+	}
+}
+
+/**
+ * @name stats_merge_stage - Merges one stage over all workers.
+ * @param stage: One of the STAGE_ constants.
+ * @param h: Receives the merged histogram.
+ *
+ * @return
+ */
+void stats_merge_stage(int stage, histogram *h) {
+	int i;
+
+	histogram_reset(h);
+	for (i = 0; i < number_of_workers; i++)
+		histogram_merge(h, &WORKER(i)->stages[stage]);
+}
+
+/**
+ * @name stats_print_histogram - Prints one line of the latency table.
+ *
+ * @return
+ */
+static void stats_print_histogram(FILE *out, const char *name, const char *kind, const histogram *h) {
+
+	fprintf(out, "%-6s %-9s%10llu %10llu %10llu %10llu %10llu %10llu\n", name, kind,
+		(unsigned long long) h->count,
+		(unsigned long long) histogram_percentile(h, 0.50),
+		(unsigned long long) histogram_percentile(h, 0.90),
+		(unsigned long long) histogram_percentile(h, 0.99),
+		(unsigned long long) histogram_percentile(h, 0.999),
+		(unsigned long long) h->max);
+}
+
+/**
+ * @name stats_print - Prints the counters, the average times and the
+ * latency percentiles of every request class.
+ * @param out: The stream to print to.
+ *
+ * @return
+ */
+void stats_print(FILE *out) {
+	static histogram wait[STAT_OP_TYPES], service[STAT_OP_TYPES];	// Too large for a signal handler's stack.
+	static histogram stage;
+	worker_counters totals;
+	double total_waiting_time = 0, total_service_time = 0;
+	uint64_t completed_requests;
+	int type;
+
+	stats_sum_counters(&totals);
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		stats_merge_latency(type, &wait[type], &service[type]);
+		total_waiting_time += (double) wait[type].sum;
+	}
+	total_service_time = (double) (service[STAT_GET].sum + service[STAT_PUT].sum);
+	completed_requests = totals.requests[STAT_GET] + totals.requests[STAT_PUT];
+
+	fprintf(out, "Completed requests: %llu\n", (unsigned long long) completed_requests);
+	fprintf(out, "Total waiting time (nanosec): %.0lf\n", total_waiting_time);
+	fprintf(out, "Average waiting time (nanosec): %.0lf\n", total_waiting_time / (double) completed_requests);
+	fprintf(out, "Total service time (nanosec): %.0lf\n", total_service_time);
+	fprintf(out, "Average service time (nanosec): %.0lf\n", total_service_time / (double) completed_requests);
+
+	fprintf(out, "GET requests: %llu (%llu not found)\n",
+		(unsigned long long) totals.requests[STAT_GET], (unsigned long long) totals.failed[STAT_GET]);
+	fprintf(out, "PUT requests: %llu (%llu failed)\n",
+		(unsigned long long) totals.requests[STAT_PUT], (unsigned long long) totals.failed[STAT_PUT]);
+	fprintf(out, "STATS requests: %llu\n", (unsigned long long) totals.requests[STAT_STATS]);
+	fprintf(out, "Malformed requests: %llu (%llu unreadable, %llu unparsable)\n",
+		(unsigned long long) totals.requests[STAT_ERROR], (unsigned long long) totals.read_errors,
+		(unsigned long long) totals.parse_errors);
+	fprintf(out, "Requests answered BUSY: %llu\n", (unsigned long long) totals.requests[STAT_BUSY]);
+	fprintf(out, "Bytes in: %llu, bytes out: %llu\n",
+		(unsigned long long) totals.bytes_in, (unsigned long long) totals.bytes_out);
+
+	fprintf(out, "%-15s %10s %10s %10s %10s %10s %10s\n", "Latency (ns)", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (type = 0; type < STAT_OP_TYPES; type++) {
+		stats_print_histogram(out, stat_names[type], "wait", &wait[type]);
+		stats_print_histogram(out, stat_names[type], "service", &service[type]);
+	}
+
+	fprintf(out, "%-15s %10s %10s %10s %10s %10s %10s\n", "Stage (ns)", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (type = 0; type < STAGES; type++) {
+		stats_merge_stage(type, &stage);
+		stats_print_histogram(out, "", stage_names[type], &stage);
+	}
+}
+
+/**
+ * @name stats_summary - Formats the counters and the GET/PUT service time
+ * percentiles as one line of "name=value" pairs.
+ * @param buf: Receives the line.
+ * @param size: Size of buf.
+ *
+ * @return
+ */
+void stats_summary(char *buf, size_t size) {
+	histogram *wait, *service;
+	worker_counters totals;
+	uint64_t p50[2] = { 0, 0 }, p99[2] = { 0, 0 };
+	int type;
+
+	stats_sum_counters(&totals);
+
+	// Called from consumer threads, so the histograms are not static.
+	wait = (histogram *) malloc(sizeof(histogram));
+	service = (histogram *) malloc(sizeof(histogram));
+	if (wait && service) {
+		for (type = STAT_GET; type <= STAT_PUT; type++) {
+			stats_merge_latency(type, wait, service);
+			p50[type] = histogram_percentile(service, 0.5);
+			p99[type] = histogram_percentile(service, 0.99);
+		}
+	}
+	free(wait);
+	free(service);
+
+	snprintf(buf, size, "get=%llu get_not_found=%llu put=%llu put_failed=%llu malformed=%llu busy=%llu "
+		"bytes_in=%llu bytes_out=%llu get_p50_ns=%llu get_p99_ns=%llu put_p50_ns=%llu put_p99_ns=%llu",
+		(unsigned long long) totals.requests[STAT_GET], (unsigned long long) totals.failed[STAT_GET],
+		(unsigned long long) totals.requests[STAT_PUT], (unsigned long long) totals.failed[STAT_PUT],
+		(unsigned long long) totals.requests[STAT_ERROR], (unsigned long long) totals.requests[STAT_BUSY],
+		(unsigned long long) totals.bytes_in, (unsigned long long) totals.bytes_out,
+		(unsigned long long) p50[STAT_GET], (unsigned long long) p99[STAT_GET],
+		(unsigned long long) p50[STAT_PUT], (unsigned long long) p99[STAT_PUT]);
+}
@@ -0,0 +1,94 @@
+/* stats.h
+
+	Per-worker request statistics of the key-value server.
+
+	Every consumer thread records into its own cache-line aligned block,
+	so recording takes no lock and shares no cache line with other
+	workers. Blocks are aggregated only when statistics are read.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include "histogram.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// Request classes statistics are kept for.
+#define STAT_GET        0
+#define STAT_PUT        1
+#define STAT_STATS      2
+#define STAT_ERROR      3	// Requests that could not be read or parsed.
+#define STAT_BUSY       4	// Requests answered BUSY after waiting too long in the queue.
+#define STAT_OP_TYPES   5
+
+// Stages a request passes through, timed separately.
+#define STAGE_QUEUE     0	// Accept to dequeue.
+#define STAGE_READ      1	// Reading the request from the socket.
+#define STAGE_PARSE     2	// parse_request().
+#define STAGE_LOCK      3	// Waiting for the reader/writer protocol or the memtable.
+#define STAGE_DB        4	// Storage engine work once the locks are held.
+#define STAGE_WRITE     5	// Writing the reply.
+#define STAGES          6
+
+// Single writer: a relaxed load and store is enough and avoids a locked instruction.
+#define STAT_ADD(field, n) \
+	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+typedef struct worker_counters {
+	uint64_t requests[STAT_OP_TYPES];	// Requests answered, per class.
+	uint64_t failed[STAT_OP_TYPES];		// GET ERROR (not found) and PUT ERROR replies.
+	uint64_t read_errors;			// Connections without a readable request.
+	uint64_t parse_errors;			// Requests parse_request() rejected.
+	uint64_t bytes_in;			// Request payload bytes.
+	uint64_t bytes_out;			// Reply payload bytes.
+} worker_counters;
+
+typedef struct worker_stats {
+	worker_counters counters;
+	histogram wait[STAT_OP_TYPES];		// Arrival to dequeue, in nanoseconds.
+	histogram service[STAT_OP_TYPES];	// Arrival to reply, in nanoseconds.
+	histogram stages[STAGES];		// Time spent in each stage, in nanoseconds.
+} __attribute__((aligned(CACHE_LINE_SIZE))) worker_stats;
+
+// current CLOCK_MONOTONIC time in nanoseconds. Unaffected by NTP steps and
+// answered from the vDSO without a system call.
+static inline uint64_t stats_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+// allocate zeroed blocks for 'num_workers' workers. 0 on success, -1 on error.
+int stats_init(int num_workers);
+
+// the block of worker 'id'; only that worker may record into it.
+worker_stats *stats_worker(int id);
+
+// sum the counters of all workers into 'totals'.
+void stats_sum_counters(worker_counters *totals);
+
+// merge the histograms of one request class over all workers.
+void stats_merge_latency(int type, histogram *wait, histogram *service);
+
+// merge the histograms of one stage over all workers.
+void stats_merge_stage(int stage, histogram *h);
+
+// name of a request class, e.g. "GET".
+const char *stats_name(int type);
+
+// name of a stage, e.g. "parse".
+const char *stats_stage_name(int stage);
+
+// print the counters, the average times and the latency percentiles.
+void stats_print(FILE *out);
+
+// write a one line summary of the counters and GET/PUT percentiles to 'buf'.
+void stats_summary(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,183 @@
+/* trace.c
+
+	Per-request trace events of the key-value server.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+static char *rings = NULL;
+static size_t ring_stride = 0;		// Bytes per ring, a whole number of pages.
+static int number_of_rings = 0;
+
+#define RING(i) ((trace_ring *) (rings + (size_t) (i) * ring_stride))
+
+static const char *trace_names[TRACE_TYPES] = { "accept", "queue", "read", "parse", "lock", "db", "reply" };
+
+/**
+ * @name trace_init - Allocates the per-thread rings, each on pages of its
+ * own that its thread is the first to write, so they land on its NUMA node.
+ * @param num_threads: The number of threads that record events.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int trace_init(int num_threads) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	void *blocks;
+
+	ring_stride = (sizeof(trace_ring) + page - 1) / page * page;
+	blocks = mmap(NULL, ring_stride * num_threads, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (blocks == MAP_FAILED)
+		return -1;
+
+	rings = (char *) blocks;
+	number_of_rings = num_threads;
+	return 0;
+}
+
+/**
+ * @name trace_thread - Returns the ring of a thread.
+ * @param id: The thread index.
+ *
+ * @return The ring.
+ */
+trace_ring *trace_thread(int id) {
+
+	return RING(id);
+}
+
+/**
+ * @name trace_record - Records one event, overwriting the oldest one if
+ * the ring is full.
+ * @param ring: The calling thread's ring.
+ * @param type: One of the TRACE_ constants.
+ * @param request: The request number.
+ * @param start: When the span started, from stats_clock().
+ * @param end: When it ended.
+ * @param value: Type-specific value.
+ *
+ * @return
+ */
+void trace_record(trace_ring *ring, int type, uint64_t request, uint64_t start, uint64_t end, uint32_t value) {
+	uint64_t head = ring->head;
+	trace_event *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+
+	event->start = start;
+	event->duration = end - start;
+	event->request = request;
+	event->type = (uint32_t) type;
+	event->value = value;
+
+	// Publish the event; a reader that sees the new head sees the event.
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @name trace_snapshot - Copies the events of a ring that were not
+ * overwritten while copying.
+ * @param ring: The ring.
+ * @param copy: Receives up to TRACE_RING_EVENTS events, oldest first.
+ *
+ * @return The number of events copied.
+ */
+static int trace_snapshot(trace_ring *ring, trace_event *copy) {
+	uint64_t head, first, i, valid_from;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+	for (i = first; i < head; i++)
+		copy[i - first] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+
+	// Slots the owner started to reuse meanwhile may be torn; drop them.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	valid_from = (head >= TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS + 1 : 0;
+	if (valid_from <= first)
+		return (int) (i - first);
+	if (valid_from >= i)
+		return 0;
+
+	memmove(copy, copy + (valid_from - first), sizeof(trace_event) * (i - valid_from));
+	return (int) (i - valid_from);
+}
+
+/**
+ * @name trace_dump_chrome - Writes every ring as Chrome trace JSON. Each
+ * thread becomes a track and each span a complete ("X") event.
+ * @param path: The file to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int trace_dump_chrome(const char *path) {
+	trace_event *copy, *event;
+	FILE *out;
+	int t, i, n, first = 1;
+
+	if (!(copy = (trace_event *) malloc(sizeof(trace_event) * TRACE_RING_EVENTS)))
+		return -1;
+	if (!(out = fopen(path, "w"))) {
+		free(copy);
+		return -1;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (t = 0; t < number_of_rings; t++) {
+		n = trace_snapshot(RING(t), copy);
+		for (i = 0; i < n; i++) {
+			event = &copy[i];
+			if (event->type >= TRACE_TYPES)
+				continue;
+			fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,",
+				first ? "" : ",\n", trace_names[event->type], (event->type == TRACE_ACCEPT) ? "i" : "X",
+				t, (double) event->start / 1000.0);
+			if (event->type == TRACE_ACCEPT)
+				fprintf(out, "\"s\":\"t\",");
+			else
+				fprintf(out, "\"dur\":%.3f,", (double) event->duration / 1000.0);
+			fprintf(out, "\"args\":{\"request\":%llu,\"value\":%u}}", (unsigned long long) event->request, event->value);
+			first = 0;
+		}
+	}
+	fprintf(out, "\n]}\n");
+
+	free(copy);
+	return fclose(out) ? -1 : 0;
+}
+
+/**
+ * @name trace_log_request - Writes the trail of one request, with every
+ * span's start relative to the accept.
+ * @param ring: The calling thread's ring, which served the request.
+ * @param request: The request number.
+ * @param accepted: When the request was accepted, from stats_clock().
+ * @param out: The stream to write to.
+ *
+ * @return
+ */
+void trace_log_request(trace_ring *ring, uint64_t request, uint64_t accepted, FILE *out) {
+	char line[1024];
+	trace_event *event;
+	uint64_t first, end = accepted;
+	int length;
+
+	// The request's events are the newest ones of its worker's ring.
+	first = ring->head;
+	while (first > 0 && ring->head - first < TRACE_RING_EVENTS
+		&& ring->events[(first - 1) & (TRACE_RING_EVENTS - 1)].request == request)
+		first--;
+
+	length = 0;
+	for (; first < ring->head && length < (int) sizeof(line); first++) {
+		event = &ring->events[first & (TRACE_RING_EVENTS - 1)];
+		length += snprintf(line + length, sizeof(line) - length, " %s +%.1fus %.1fus",
+			trace_names[event->type], (double) (event->start - accepted) / 1000.0, (double) event->duration / 1000.0);
+		if (event->start + event->duration > end)
+			end = event->start + event->duration;
+	}
+	fprintf(out, "request %llu took %.1fus:%s\n", (unsigned long long) request, (double) (end - accepted) / 1000.0,
+		length ? line : " no events");
+	fflush(out);
+}
@@ -0,0 +1,62 @@
+/* trace.h
+
+	Per-request trace events of the key-value server.
+
+	Every thread writes fixed-size events into its own ring buffer, so
+	recording takes no lock and never waits: the oldest events are simply
+	overwritten. The rings can be dumped at any time in the Chrome trace
+	event format (chrome://tracing, Perfetto), and the events of a single
+	request can be written out when it turns out to be slow.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define TRACE_RING_EVENTS 4096		// Per thread, a power of two.
+
+// Event types; every event but TRACE_ACCEPT is a span.
+#define TRACE_ACCEPT    0	// Request arrived at the producer thread; value is 1 if reported by epoll.
+#define TRACE_QUEUE     1	// Waiting in the queue, ends at dequeue.
+#define TRACE_READ      2	// Reading the request; value is its size.
+#define TRACE_PARSE     3	// parse_request().
+#define TRACE_LOCK      4	// Waiting for the database locks.
+#define TRACE_DB        5	// Storage engine operation; value is its return code.
+#define TRACE_REPLY     6	// Writing the reply; value is its size.
+#define TRACE_TYPES     7
+
+typedef struct trace_event {
+	uint64_t start;		// From stats_clock().
+	uint64_t duration;	// In nanoseconds.
+	uint64_t request;	// Request number assigned at accept.
+	uint32_t type;
+	uint32_t value;
+} trace_event;
+
+typedef struct trace_ring {
+	uint64_t head;		// Events ever recorded; only the owner writes it.
+	trace_event events[TRACE_RING_EVENTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_ring;
+
+// allocate zeroed rings for 'num_threads' threads. 0 on success, -1 on error.
+int trace_init(int num_threads);
+
+// the ring of thread 'id'; only that thread may record into it.
+trace_ring *trace_thread(int id);
+
+// record one event spanning 'start' to 'end'.
+void trace_record(trace_ring *ring, int type, uint64_t request, uint64_t start, uint64_t end, uint32_t value);
+
+// write the events of every ring to 'path' as Chrome trace JSON. 0 on success, -1 on error.
+int trace_dump_chrome(const char *path);
+
+// write one line with the events 'ring' still holds for 'request'.
+void trace_log_request(trace_ring *ring, uint64_t request, uint64_t accepted, FILE *out);
+
+#endif
@@ -25,74 +25,224 @@ void ERROR(const char *msg) {
 }
 
 /**
- * @name write_str_to_socker - Writes a message to the socket.
+ * @name write_str_to_socker - Writes a message to the socket. The length
+ * and the message leave in one system call, so Nagle's algorithm never
+ * holds back half a frame.
  * @param socket_fd: The socket descriptor.
  * @param buf: The buffer that contains the message.
  * @param numbytes: The length of the message.
  *
- * @return Number of bytes written.
+ * @return Number of bytes written, 0 on error.
  */
 int write_str_to_socket(const int socket_fd, char *buf, const int numbytes) {
-	char *ptr;
-	int nwritten, nleft;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t nwritten;
 	int wsize;
-	
-  // write the amount of data to be sent.
+
+	// the amount of data to be sent, then the data.
 	wsize = numbytes;
-	if (write(socket_fd, &wsize, sizeof(wsize)) < 0)
-		ERROR("write_to_socket()");
-	
-  // write data.
-	ptr = buf;
-	nleft = numbytes;
-	while (nleft > 0 ) {
-		if ((nwritten = write(socket_fd, ptr, nleft)) < 0)
+	iov[0].iov_base = &wsize;
+	iov[0].iov_len = sizeof(wsize);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = numbytes;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	while (msg.msg_iovlen > 0) {
+		if ((nwritten = sendmsg(socket_fd, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
 			return 0;
-		nleft -= nwritten;
-		ptr += nwritten;
+		}
+		// short write: skip what was sent.
+		while (msg.msg_iovlen > 0 && (size_t) nwritten >= msg.msg_iov->iov_len) {
+			nwritten -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + nwritten;
+			msg.msg_iov->iov_len -= nwritten;
+		}
 	}
-	
+
 	return numbytes;
 }
 
+/**
+ * @name read_full - Reads exactly 'size' bytes from the socket.
+ * @param socket_fd: The socket descriptor.
+ * @param buf: The buffer that will hold the bytes.
+ * @param size: The number of bytes.
+ *
+ * @return 'size', 0 on end of stream or error.
+ */
+static int read_full(const int socket_fd, void *buf, const int size) {
+	char *ptr = (char *) buf;
+	int nread, nleft = size;
+
+	while (nleft > 0) {
+		if ((nread = read(socket_fd, ptr, nleft)) <= 0) {
+			if (nread < 0 && errno == EINTR)
+				continue;
+			return 0;
+		}
+		nleft -= nread;
+		ptr += nread;
+	}
+	return size;
+}
+
 /**
  * @name readstr_from_socker - Reads a message from the socket.
  * @param socket_fd: The socket descriptor.
  * @param buf: The buffer that will hold the message.
  * @param bufize: The size of the buffer.
  *
- * @return Number of bytes read.
+ * @return Number of bytes read, 0 on end of stream, error or a message
+ * that does not fit in the buffer.
  */
 int read_str_from_socket(const int socket_fd, char *buf, const int bufsize)
 {
-	char *ptr;
-	int nread, nleft, rc;
 	int rsize;
-	
-  // read the amount of sent data. 
-	if ((rc = read(socket_fd, &rsize, sizeof(rsize))) < 0) {
-		// ERROR("read_from_socket()");
-		printf("Error in read_str_from_socket(). fd = %d\n", socket_fd);
-		exit(1);
-	}
-	else if (rc == 0)
+
+  // read the amount of sent data.
+	if (!read_full(socket_fd, &rsize, sizeof(rsize)))
+		return 0;
+	if (rsize <= 0 || rsize >= bufsize)
 		return 0;
-	
+
   // read data.
-	ptr = buf;
-	nleft = rsize;
-	while (nleft > 0 ) {
-		if ((nread = read(socket_fd, ptr, nleft)) <= 0)
-			return 0;
+	if (!read_full(socket_fd, buf, rsize))
+		return 0;
+	buf[rsize] = '\0';
+	return rsize;
+}
 
-		if (nread > bufsize)
-			return nread;
-		
-		nleft -= nread;
-		ptr += nread;
+/**
+ * @name frame_reader_create - Creates the read buffer of a connection.
+ * @param socket_fd: The socket descriptor.
+ * @param size: The buffer size; frames must fit in it with their length.
+ *
+ * @return The reader, NULL if out of memory.
+ */
+frame_reader *frame_reader_create(const int socket_fd, const int size) {
+	frame_reader *reader;
+
+	if (!(reader = (frame_reader *) malloc(sizeof(frame_reader) + size)))
+		return NULL;
+	reader->fd = socket_fd;
+	reader->size = size;
+	reader->start = 0;
+	reader->end = 0;
+	return reader;
+}
 
-	}  
-	*ptr = '\0';
+/**
+ * @name frame_reader_destroy - Releases a read buffer. The socket is not
+ * closed.
+ * @param reader: The reader, or NULL.
+ *
+ * @return
+ */
+void frame_reader_destroy(frame_reader *reader) {
+
+	free(reader);
+}
+
+/**
+ * @name frame_length - Decodes the frame at the front of a read buffer.
+ * @param reader: The reader.
+ *
+ * @return The length of the message, -1 if fewer than its four length
+ * bytes are buffered.
+ */
+static int frame_length(const frame_reader *reader) {
+	int rsize;
+
+	if (reader->end - reader->start < (int) sizeof(rsize))
+		return -1;
+	memcpy(&rsize, reader->buf + reader->start, sizeof(rsize));
 	return rsize;
 }
 
+/**
+ * @name frame_buffered - Tells whether a whole frame is already buffered,
+ * so read_frame() will not touch the socket.
+ * @param reader: The reader.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+int frame_buffered(const frame_reader *reader) {
+	int rsize = frame_length(reader);
+
+	return rsize >= 0 && reader->end - reader->start >= (int) sizeof(rsize) + rsize;
+}
+
+/**
+ * @name read_frame - Reads the next message sent with write_str_to_socket().
+ * Every recv() takes as much as fits in the connection's buffer, so
+ * requests sent back to back are served from memory. A message longer
+ * than the connection's buffer, such as a chunk of a large value, is
+ * read straight into 'buf'.
+ * @param reader: The connection's reader.
+ * @param buf: The buffer that will hold the message, terminated with '\0'.
+ * @param bufsize: The size of the buffer.
+ *
+ * @return Number of bytes read, 0 if the stream ended between messages,
+ * -1 on error, a stream ending inside a message or a message that does
+ * not fit in the buffer.
+ */
+int read_frame(frame_reader *reader, char *buf, const int bufsize) {
+	int rsize, buffered;
+	ssize_t nread;
+
+	while (!frame_buffered(reader)) {
+		rsize = frame_length(reader);
+		if (rsize != -1 && (rsize <= 0 || rsize >= bufsize))
+			return -1;
+
+		// too long for the connection's buffer: take what it holds, then the rest.
+		if (rsize != -1 && (int) sizeof(rsize) + rsize > reader->size) {
+			buffered = reader->end - reader->start - sizeof(rsize);
+			memcpy(buf, reader->buf + reader->start + sizeof(rsize), buffered);
+			reader->start = 0;
+			reader->end = 0;
+			if (!read_full(reader->fd, buf + buffered, rsize - buffered))
+				return -1;
+			buf[rsize] = '\0';
+			return rsize;
+		}
+
+		// make room at the end of the buffer.
+		if (reader->start == reader->end) {
+			reader->start = 0;
+			reader->end = 0;
+		}
+		else if (reader->end == reader->size) {
+			memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+			reader->end -= reader->start;
+			reader->start = 0;
+		}
+
+		if ((nread = recv(reader->fd, reader->buf + reader->end, reader->size - reader->end, 0)) <= 0) {
+			if (nread < 0 && errno == EINTR)
+				continue;
+			// a reset between messages is a client that left without reading our last reply.
+			if ((nread == 0 || errno == ECONNRESET) && reader->start == reader->end)
+				return 0;
+			return -1;
+		}
+		reader->end += nread;
+	}
+
+	rsize = frame_length(reader);
+	if (rsize <= 0 || rsize >= bufsize)
+		return -1;
+	memcpy(buf, reader->buf + reader->start + sizeof(rsize), rsize);
+	buf[rsize] = '\0';
+	reader->start += sizeof(rsize) + rsize;
+	return rsize;
+}
@@ -21,13 +21,38 @@
 #include <assert.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <sys/uio.h>
+
+// Read buffer of a connection, for read_frame().
+typedef struct frame_reader {
+	int fd;
+	int size;
+	int start;		// First byte not yet returned.
+	int end;		// End of the bytes received.
+	char buf[];
+} frame_reader;
 
 void ERROR(const char *msg);
 
-// write to socket 'numbytes' bytes from buffer 'buf'
+// write to socket 'numbytes' bytes from buffer 'buf', preceded by their
+// length, in one system call.
 int write_str_to_socket(const int socket_fd, char *buf, const int numbytes);
 
 // read from socket into buffer 'buf' a stream of bytes that were 
 // sent using write_to_socket(); terminate data with '\0'.
 int read_str_from_socket(const int socket_fd, char *buf, const int bufsize);
 
+// create the read buffer of connection 'socket_fd', holding 'size' bytes.
+frame_reader *frame_reader_create(const int socket_fd, const int size);
+
+// release a read buffer created with frame_reader_create().
+void frame_reader_destroy(frame_reader *reader);
+
+// nonzero if read_frame() can return a frame without reading the socket.
+int frame_buffered(const frame_reader *reader);
+
+// read into buffer 'buf' the next stream of bytes that was sent using
+// write_to_socket(), receiving as many as have arrived; terminate data
+// with '\0'. Frames longer than the reader's buffer are read straight
+// into 'buf'. Returns 0 if the stream ended between frames, -1 on error.
+int read_frame(frame_reader *reader, char *buf, const int bufsize);